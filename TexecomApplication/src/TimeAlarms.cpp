@@ -19,7 +19,10 @@
 */
 
 /*
-  Modified by Jumpmaster to only allow a single Alarm/Timer to run at a time.
+  Modified by Jumpmaster so a triggered Alarm/Timer stays in progress until its
+  owner completes it, each run with its own token and timeout.
+  Enabled alarms are kept in a min-heap on nextTrigger so serviceAlarms() only
+  has to look at the earliest one.
 */
 
 #include "TimeAlarms.h"
@@ -33,10 +36,26 @@
 
 AlarmClass::AlarmClass()
 {
-  Mode.isEnabled = Mode.isOneShot = 0;
+  Mode.isEnabled = Mode.isOneShot = Mode.isRunning = 0;
   Mode.alarmType = dtNotAllocated;
   value = nextTrigger = 0;
   onTickHandler = NULL;  // prevent a callback until this pointer is explicitly set
+  onTickContextHandler = NULL;
+  context = NULL;
+  heapIndex = dtINVALID_ALARM_ID;
+  generation = 0;
+  jobTimeout = dtDEFAULT_JOB_TIMEOUT;
+  jobDeadline = 0;
+  onTimeoutHandler = NULL;
+}
+
+MsTimerClass::MsTimerClass()
+{
+  onTickHandler = NULL;
+  onTickContextHandler = NULL;
+  context = NULL;
+  nextTrigger = interval = 0;
+  isAllocated = isActive = freeOnTrigger = false;
 }
 
 //**************************************************************
@@ -88,6 +107,13 @@ void AlarmClass::updateNextTrigger()
 TimeAlarmsClass::TimeAlarmsClass()
 {
   isServicing = false;
+  runningJobs = 0;
+  nextJobDeadline = 0;
+  timedOutJobs = 0;
+  heapSize = 0;
+  hasActiveMsTimers = false;
+  nextMsTrigger = 0;
+  resetMsTimerStats();
   for(uint8_t id = 0; id < dtNBR_ALARMS; id++) {
     free(id);   // ensure all Alarms are cleared and available for allocation
   }
@@ -96,7 +122,7 @@ TimeAlarmsClass::TimeAlarmsClass()
 void TimeAlarmsClass::enable(AlarmID_t ID)
 {
   if (isAllocated(ID)) {
-    if (( !(dtUseAbsoluteValue(Alarm[ID].Mode.alarmType) && (Alarm[ID].value == 0)) ) && (Alarm[ID].onTickHandler != NULL)) {
+    if (( !(dtUseAbsoluteValue(Alarm[ID].Mode.alarmType) && (Alarm[ID].value == 0)) ) && (Alarm[ID].onTickHandler != NULL || Alarm[ID].onTickContextHandler != NULL)) {
       // only enable if value is non zero and a tick handler has been set
       // (is not NULL, value is non zero ONLY for dtTimer & dtExplicitAlarm
       // (the rest can have 0 to account for midnight))
@@ -105,6 +131,7 @@ void TimeAlarmsClass::enable(AlarmID_t ID)
     } else {
       Alarm[ID].Mode.isEnabled = false;
     }
+    schedule(ID);
   }
 }
 
@@ -112,6 +139,7 @@ void TimeAlarmsClass::disable(AlarmID_t ID)
 {
   if (isAllocated(ID)) {
     Alarm[ID].Mode.isEnabled = false;
+    unschedule(ID);
   }
 }
 
@@ -148,9 +176,18 @@ dtAlarmPeriod_t TimeAlarmsClass::readType(AlarmID_t ID) const
 void TimeAlarmsClass::free(AlarmID_t ID)
 {
   if (isAllocated(ID)) {
+    unschedule(ID);
+    if (Alarm[ID].Mode.isRunning) {
+      Alarm[ID].Mode.isRunning = false;
+      runningJobs--;
+    }
+    Alarm[ID].jobTimeout = dtDEFAULT_JOB_TIMEOUT;
+    Alarm[ID].onTimeoutHandler = NULL;
     Alarm[ID].Mode.isEnabled = false;
     Alarm[ID].Mode.alarmType = dtNotAllocated;
     Alarm[ID].onTickHandler = NULL;
+    Alarm[ID].onTickContextHandler = NULL;
+    Alarm[ID].context = NULL;
     Alarm[ID].value = 0;
     Alarm[ID].nextTrigger = 0;
   }
@@ -189,12 +226,24 @@ AlarmID_t TimeAlarmsClass::getTriggeredAlarmId() const
   }
 }
 
+// returns the token to pass to complete() or postpone() for the current run
+// returns dtINVALID_ALARM_TOKEN if not invoked from within an alarm handler
+AlarmToken_t TimeAlarmsClass::getTriggeredAlarmToken() const
+{
+  if (isServicing) {
+    return (Alarm[servicedAlarmId].generation << 8) | servicedAlarmId;
+  } else {
+    return dtINVALID_ALARM_TOKEN;
+  }
+}
+
 // following functions are not Alarm ID specific.
 // void TimeAlarmsClass::delay(unsigned long ms)
 void TimeAlarmsClass::loop()//(unsigned long ms)
 {
   // unsigned long start = millis();
   // do {
+    serviceMsTimers();
     serviceAlarms();
   // } while (millis() - start  <= ms);
 }
@@ -225,27 +274,245 @@ uint8_t TimeAlarmsClass::getDigitsNow( dtUnits_t Units) const
   return 255;  // This should never happen
 }
 
-//returns isServicing
+// returns true while an alarm handler is being called
 bool TimeAlarmsClass::getIsServicing() const
 {
   return isServicing;
 }
 
-void TimeAlarmsClass::completeTriggeredAlarm() {
-  if (isServicing) {
-    if (Alarm[servicedAlarmId].Mode.isOneShot) {
-      free(servicedAlarmId);  // free the ID if mode is OnShot
-    } else {
-      Alarm[servicedAlarmId].updateNextTrigger();
+bool TimeAlarmsClass::isRunning(AlarmID_t ID) const
+{
+  return isAllocated(ID) && Alarm[ID].Mode.isRunning;
+}
+
+void TimeAlarmsClass::setJobTimeout(AlarmID_t ID, uint32_t timeoutMs)
+{
+  if (isAllocated(ID)) {
+    Alarm[ID].jobTimeout = timeoutMs;
+  }
+}
+
+void TimeAlarmsClass::setJobTimeoutHandler(AlarmID_t ID, OnTickContext_t onTimeoutHandler)
+{
+  if (isAllocated(ID)) {
+    Alarm[ID].onTimeoutHandler = onTimeoutHandler;
+  }
+}
+
+void TimeAlarmsClass::complete(AlarmToken_t token)
+{
+  AlarmID_t ID = token & 0xFF;
+  if (isRunning(ID) && Alarm[ID].generation == (token >> 8)) {
+    finishJob(ID);
+  }
+}
+
+void TimeAlarmsClass::completeTriggeredAlarm()
+{
+  complete(getTriggeredAlarmToken());
+}
+
+void TimeAlarmsClass::postpone(AlarmToken_t token, time_t seconds)
+{
+  AlarmID_t ID = token & 0xFF;
+  if (isRunning(ID) && Alarm[ID].generation == (token >> 8)) {
+    Alarm[ID].Mode.isRunning = false;
+    runningJobs--;
+    Alarm[ID].nextTrigger = Time.local() + (seconds > 0 ? seconds : 1);
+    schedule(ID);
+  }
+}
+
+MsTimerID_t TimeAlarmsClass::createMs(OnTick_t onTickHandler)
+{
+  for (uint8_t id = 0; id < dtNBR_MS_TIMERS; id++) {
+    if (!MsTimer[id].isAllocated) {
+      MsTimer[id].isAllocated = true;
+      MsTimer[id].isActive = false;
+      MsTimer[id].freeOnTrigger = false;
+      MsTimer[id].onTickHandler = onTickHandler;
+      MsTimer[id].onTickContextHandler = NULL;
+      MsTimer[id].context = NULL;
+      return id;
     }
-    isServicing = false;
   }
-  nextAlarmAllowed = Time.local() + ALARM_BUFFER;
+  return dtINVALID_ALARM_ID;
+}
+
+MsTimerID_t TimeAlarmsClass::createMs(OnTickContext_t onTickHandler, void *context)
+{
+  MsTimerID_t id = createMs((OnTick_t)NULL);
+  if (id != dtINVALID_ALARM_ID) {
+    MsTimer[id].onTickContextHandler = onTickHandler;
+    MsTimer[id].context = context;
+  }
+  return id;
+}
+
+void TimeAlarmsClass::startMs(MsTimerID_t ID, uint32_t delayMs, uint32_t intervalMs)
+{
+  if (ID < dtNBR_MS_TIMERS && MsTimer[ID].isAllocated) {
+    MsTimer[ID].nextTrigger = millis() + delayMs;
+    MsTimer[ID].interval = intervalMs;
+    MsTimer[ID].isActive = true;
+    updateNextMsTrigger();
+  }
+}
+
+void TimeAlarmsClass::stopMs(MsTimerID_t ID)
+{
+  if (ID < dtNBR_MS_TIMERS && MsTimer[ID].isActive) {
+    MsTimer[ID].isActive = false;
+    updateNextMsTrigger();
+  }
+}
+
+bool TimeAlarmsClass::isActiveMs(MsTimerID_t ID) const
+{
+  return ID < dtNBR_MS_TIMERS && MsTimer[ID].isActive;
+}
+
+void TimeAlarmsClass::freeMs(MsTimerID_t ID)
+{
+  if (ID < dtNBR_MS_TIMERS) {
+    stopMs(ID);
+    MsTimer[ID].isAllocated = false;
+    MsTimer[ID].onTickHandler = NULL;
+    MsTimer[ID].onTickContextHandler = NULL;
+  }
+}
+
+MsTimerID_t TimeAlarmsClass::timerOnceMs(uint32_t delayMs, OnTick_t onTickHandler)
+{
+  MsTimerID_t id = createMs(onTickHandler);
+  if (id != dtINVALID_ALARM_ID) {
+    MsTimer[id].freeOnTrigger = true;
+    startMs(id, delayMs);
+  }
+  return id;
+}
+
+MsTimerID_t TimeAlarmsClass::timerRepeatMs(uint32_t intervalMs, OnTick_t onTickHandler)
+{
+  if (intervalMs == 0) return dtINVALID_ALARM_ID;
+  MsTimerID_t id = createMs(onTickHandler);
+  if (id != dtINVALID_ALARM_ID) {
+    startMs(id, intervalMs, intervalMs);
+  }
+  return id;
+}
+
+uint32_t TimeAlarmsClass::getMsTimerAverageLateness() const
+{
+  return msTimerTriggerCount ? msTimerTotalLateness / msTimerTriggerCount : 0;
+}
+
+void TimeAlarmsClass::resetMsTimerStats()
+{
+  msTimerMaxLateness = 0;
+  msTimerTotalLateness = 0;
+  msTimerTriggerCount = 0;
 }
 
 //***********************************************************
 //* Private Methods
 
+void TimeAlarmsClass::updateNextMsTrigger()
+{
+  hasActiveMsTimers = false;
+  for (uint8_t id = 0; id < dtNBR_MS_TIMERS; id++) {
+    if (MsTimer[id].isActive) {
+      if (!hasActiveMsTimers || (int32_t)(MsTimer[id].nextTrigger - nextMsTrigger) < 0) {
+        nextMsTrigger = MsTimer[id].nextTrigger;
+      }
+      hasActiveMsTimers = true;
+    }
+  }
+}
+
+void TimeAlarmsClass::serviceMsTimers()
+{
+  // the common case is a single comparison against the earliest timer
+  if (!hasActiveMsTimers || (int32_t)(millis() - nextMsTrigger) < 0) {
+    return;
+  }
+
+  for (uint8_t id = 0; id < dtNBR_MS_TIMERS; id++) {
+    uint32_t now = millis();
+    if (MsTimer[id].isActive && (int32_t)(now - MsTimer[id].nextTrigger) >= 0) {
+      uint32_t lateness = now - MsTimer[id].nextTrigger;
+      if (lateness > msTimerMaxLateness) {
+        msTimerMaxLateness = lateness;
+      }
+      msTimerTotalLateness += lateness;
+      msTimerTriggerCount++;
+
+      OnTick_t TickHandler = MsTimer[id].onTickHandler;
+      OnTickContext_t ContextHandler = MsTimer[id].onTickContextHandler;
+      void *context = MsTimer[id].context;
+      if (MsTimer[id].interval > 0) {
+        MsTimer[id].nextTrigger += MsTimer[id].interval;
+        if ((int32_t)(now - MsTimer[id].nextTrigger) >= 0) {
+          MsTimer[id].nextTrigger = now + MsTimer[id].interval;  // don't try to catch up
+        }
+      } else if (MsTimer[id].freeOnTrigger) {
+        freeMs(id);
+      } else {
+        MsTimer[id].isActive = false;
+      }
+
+      // the handler may restart or stop any timer, including this one
+      if (TickHandler != NULL) {
+        (*TickHandler)();
+      } else if (ContextHandler != NULL) {
+        (*ContextHandler)(context);
+      }
+    }
+  }
+  updateNextMsTrigger();
+}
+
+// end the current run, freeing one shots and rescheduling repeats
+void TimeAlarmsClass::finishJob(AlarmID_t ID)
+{
+  Alarm[ID].Mode.isRunning = false;
+  runningJobs--;
+  if (Alarm[ID].Mode.isOneShot) {
+    free(ID);  // free the ID if mode is OnShot
+  } else {
+    Alarm[ID].updateNextTrigger();
+    schedule(ID);
+  }
+}
+
+// complete any run whose owner has not done so within its timeout so a stuck
+// job can't stop the alarm from triggering again
+void TimeAlarmsClass::serviceJobTimeouts()
+{
+  if (runningJobs == 0 || (int32_t)(millis() - nextJobDeadline) < 0) {
+    return;
+  }
+
+  bool first = true;
+  for (uint8_t id = 0; id < dtNBR_ALARMS; id++) {
+    if (isAllocated(id) && Alarm[id].Mode.isRunning) {
+      if ((int32_t)(millis() - Alarm[id].jobDeadline) >= 0) {
+        timedOutJobs++;
+        // a one shot is freed by finishJob so keep what the handler needs
+        OnTickContext_t TimeoutHandler = Alarm[id].onTimeoutHandler;
+        void *context = Alarm[id].context;
+        finishJob(id);
+        if (TimeoutHandler != NULL) {
+          (*TimeoutHandler)(context);
+        }
+      } else if (first || (int32_t)(Alarm[id].jobDeadline - nextJobDeadline) < 0) {
+        nextJobDeadline = Alarm[id].jobDeadline;
+        first = false;
+      }
+    }
+  }
+}
+
 void TimeAlarmsClass::serviceAlarms()
 {
   // Bodge to stop alarms running for 30 seconds as
@@ -256,21 +523,117 @@ void TimeAlarmsClass::serviceAlarms()
     firstRun = false;
   }
 
-  if (!isServicing && Time.local() > nextAlarmAllowed) {
+  serviceJobTimeouts();
+
+  if (heapSize == 0) {
+    return;
+  }
+
+  time_t time = Time.local();
+  while (heapSize > 0 && time >= Alarm[heap[0]].nextTrigger) {
+    servicedAlarmId = heap[0];
+    AlarmClass &alarm = Alarm[servicedAlarmId];
+    unschedule(servicedAlarmId);  // rescheduled when the run completes
+    alarm.Mode.isRunning = true;
+    alarm.generation++;
+    alarm.jobDeadline = millis() + alarm.jobTimeout;
+    if (runningJobs++ == 0 || (int32_t)(alarm.jobDeadline - nextJobDeadline) < 0) {
+      nextJobDeadline = alarm.jobDeadline;
+    }
+
+    OnTick_t TickHandler = alarm.onTickHandler;
+    OnTickContext_t ContextHandler = alarm.onTickContextHandler;
     isServicing = true;
-    for (servicedAlarmId = 0; servicedAlarmId < dtNBR_ALARMS; servicedAlarmId++) {
-      if (Alarm[servicedAlarmId].Mode.isEnabled && (Time.local() >= Alarm[servicedAlarmId].nextTrigger)) {
-        OnTick_t TickHandler = Alarm[servicedAlarmId].onTickHandler;
-        if (TickHandler != NULL) {
-          (*TickHandler)();     // call the handler
-        }
-        return;
-      }
+    if (TickHandler != NULL) {
+      (*TickHandler)();     // call the handler
+    } else if (ContextHandler != NULL) {
+      (*ContextHandler)(alarm.context);
     }
     isServicing = false;
   }
 }
 
+// add the alarm to the heap, or move it if its trigger time has changed
+void TimeAlarmsClass::schedule(AlarmID_t ID)
+{
+  // a running alarm is rescheduled when it completes
+  if (Alarm[ID].Mode.isRunning) {
+    return;
+  }
+
+  if (!Alarm[ID].Mode.isEnabled) {
+    unschedule(ID);
+    return;
+  }
+
+  uint8_t index = Alarm[ID].heapIndex;
+  if (index == dtINVALID_ALARM_ID) {
+    index = heapSize++;
+    heap[index] = ID;
+    Alarm[ID].heapIndex = index;
+  }
+  heapSiftUp(index);
+  heapSiftDown(Alarm[ID].heapIndex);
+}
+
+void TimeAlarmsClass::unschedule(AlarmID_t ID)
+{
+  uint8_t index = Alarm[ID].heapIndex;
+  if (index == dtINVALID_ALARM_ID) {
+    return;
+  }
+
+  Alarm[ID].heapIndex = dtINVALID_ALARM_ID;
+  heapSize--;
+  if (index < heapSize) {
+    heap[index] = heap[heapSize];
+    Alarm[heap[index]].heapIndex = index;
+    heapSiftUp(index);
+    heapSiftDown(Alarm[heap[index]].heapIndex);
+  }
+}
+
+void TimeAlarmsClass::heapSwap(uint8_t a, uint8_t b)
+{
+  AlarmID_t id = heap[a];
+  heap[a] = heap[b];
+  heap[b] = id;
+  Alarm[heap[a]].heapIndex = a;
+  Alarm[heap[b]].heapIndex = b;
+}
+
+void TimeAlarmsClass::heapSiftUp(uint8_t index)
+{
+  while (index > 0) {
+    uint8_t parent = (index - 1) / 2;
+    if (Alarm[heap[parent]].nextTrigger <= Alarm[heap[index]].nextTrigger) {
+      break;
+    }
+    heapSwap(index, parent);
+    index = parent;
+  }
+}
+
+void TimeAlarmsClass::heapSiftDown(uint8_t index)
+{
+  while (true) {
+    uint8_t smallest = index;
+    uint16_t left = 2 * index + 1;
+    uint16_t right = left + 1;
+    if (left < heapSize && Alarm[heap[left]].nextTrigger < Alarm[heap[smallest]].nextTrigger) {
+      smallest = left;
+    }
+    if (right < heapSize && Alarm[heap[right]].nextTrigger < Alarm[heap[smallest]].nextTrigger) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      break;
+    }
+    heapSwap(index, smallest);
+    index = smallest;
+  }
+}
+
 // returns the absolute time of the next scheduled alarm, or 0 if none
 time_t TimeAlarmsClass::getNextTrigger() const
 {
@@ -307,6 +670,8 @@ AlarmID_t TimeAlarmsClass::create(time_t value, OnTick_t onTickHandler, uint8_t
       if (Alarm[id].Mode.alarmType == dtNotAllocated) {
         // here if there is an Alarm id that is not allocated
         Alarm[id].onTickHandler = onTickHandler;
+        Alarm[id].onTickContextHandler = NULL;
+        Alarm[id].context = NULL;
         Alarm[id].Mode.isOneShot = isOneShot;
         Alarm[id].Mode.alarmType = alarmType;
         Alarm[id].value = value;
@@ -318,5 +683,25 @@ AlarmID_t TimeAlarmsClass::create(time_t value, OnTick_t onTickHandler, uint8_t
   return dtINVALID_ALARM_ID; // no IDs available or time is invalid
 }
 
+// as above, the handler is called with context
+AlarmID_t TimeAlarmsClass::create(time_t value, OnTickContext_t onTickHandler, void *context, uint8_t isOneShot, dtAlarmPeriod_t alarmType)
+{
+  if ( ! ( (dtIsAlarm(alarmType) && Time.local() < SECS_PER_YEAR) || (dtUseAbsoluteValue(alarmType) && (value == 0)) ) ) {
+    for (uint8_t id = 0; id < dtNBR_ALARMS; id++) {
+      if (Alarm[id].Mode.alarmType == dtNotAllocated) {
+        Alarm[id].onTickHandler = NULL;
+        Alarm[id].onTickContextHandler = onTickHandler;
+        Alarm[id].context = context;
+        Alarm[id].Mode.isOneShot = isOneShot;
+        Alarm[id].Mode.alarmType = alarmType;
+        Alarm[id].value = value;
+        enable(id);
+        return id;
+      }
+    }
+  }
+  return dtINVALID_ALARM_ID;
+}
+
 // make one instance for the user to use
 TimeAlarmsClass Alarm = TimeAlarmsClass();
@@ -14,7 +14,6 @@
 #define SECS_PER_WEEK (SECS_PER_DAY * DAYS_PER_WEEK)
 #define SECS_PER_YEAR (SECS_PER_WEEK * 52L)
 #define SECS_YR_2000  (946684800L) // the time at the start of y2k
-#define ALARM_BUFFER 10UL;
 
 /* Useful Macros for getting elapsed time */
 #define numberOfSeconds(_time_) (_time_ % SECS_PER_MIN)  
@@ -55,6 +54,14 @@
 #endif
 #endif
 
+#if !defined(dtDEFAULT_JOB_TIMEOUT)
+#define dtDEFAULT_JOB_TIMEOUT 120000UL  // ms an alarm may stay in progress before it is completed for it
+#endif
+
+#if !defined(dtNBR_MS_TIMERS)
+#define dtNBR_MS_TIMERS 8
+#endif
+
 // #define USE_SPECIALIST_METHODS  // define this for testing
 
 typedef enum {
@@ -72,6 +79,7 @@ typedef struct {
                                // or weekly alarm periods
   uint8_t isEnabled      :1 ;  // the timer is only actioned if isEnabled is true
   uint8_t isOneShot      :1 ;  // the timer will be de-allocated after trigger is processed
+  uint8_t isRunning      :1 ;  // triggered and waiting for its owner to call complete()
 } AlarmMode_t;
 
 // new time based alarms should be added just before dtLastAlarmType
@@ -91,11 +99,35 @@ typedef enum {
 typedef uint8_t AlarmID_t;
 typedef AlarmID_t AlarmId;  // Arduino friendly name
 
+// identifies one run of an alarm, the high byte changes every time it triggers
+// so a late complete() can't finish a later run
+typedef uint16_t AlarmToken_t;
+
 #define dtINVALID_ALARM_ID 255
+#define dtINVALID_ALARM_TOKEN 0xFFFF
 #define dtINVALID_TIME     (time_t)(-1)
 #define AlarmHMS(_hr_, _min_, _sec_) (_hr_ * SECS_PER_HOUR + _min_ * SECS_PER_MIN + _sec_)
 
 typedef void (*OnTick_t)();  // alarm callback function typedef
+typedef void (*OnTickContext_t)(void *context);  // callback with the pointer it was created with
+
+typedef uint8_t MsTimerID_t;
+
+// millis() based timer, serviced on every loop independently of the
+// one-at-a-time alarm handshake
+class MsTimerClass
+{
+public:
+  MsTimerClass();
+  OnTick_t onTickHandler;
+  OnTickContext_t onTickContextHandler;
+  void *context;
+  uint32_t nextTrigger;  // millis() value when the timer is due
+  uint32_t interval;     // repeat interval, 0 for one shot
+  bool isAllocated;
+  bool isActive;
+  bool freeOnTrigger;    // created by timerOnceMs()
+};
 
 // class defining an alarm instance, only used by dtAlarmsClass
 class AlarmClass
@@ -103,10 +135,17 @@ class AlarmClass
 public:
   AlarmClass();
   OnTick_t onTickHandler;
+  OnTickContext_t onTickContextHandler;
+  void *context;
   void updateNextTrigger();
   time_t value;
   time_t nextTrigger;
   AlarmMode_t Mode;
+  uint8_t heapIndex;  // position in the trigger heap or dtINVALID_ALARM_ID
+  uint8_t generation; // incremented each time the alarm triggers
+  uint32_t jobTimeout;  // ms allowed between trigger and complete()
+  uint32_t jobDeadline; // millis() when a running job is completed for it
+  OnTickContext_t onTimeoutHandler; // called with the context when a run times out
 };
 
 // class containing the collection of alarms
@@ -114,12 +153,34 @@ class TimeAlarmsClass
 {
 private:
   AlarmClass Alarm[dtNBR_ALARMS];
+  // enabled alarms ordered by nextTrigger, earliest at heap[0]
+  AlarmID_t heap[dtNBR_ALARMS];
+  uint8_t heapSize;
+  void schedule(AlarmID_t ID);
+  void unschedule(AlarmID_t ID);
+  void heapSwap(uint8_t a, uint8_t b);
+  void heapSiftUp(uint8_t index);
+  void heapSiftDown(uint8_t index);
   void serviceAlarms();
-  bool isServicing;
+  void serviceJobTimeouts();
+  void finishJob(AlarmID_t ID);
+  bool isServicing;        // true while a handler is being called
   bool firstRun = true;
-  long nextAlarmAllowed = 0;
   uint8_t servicedAlarmId; // the alarm currently being serviced
+  uint8_t runningJobs;
+  uint32_t nextJobDeadline;
+  uint32_t timedOutJobs;
   AlarmID_t create(time_t value, OnTick_t onTickHandler, uint8_t isOneShot, dtAlarmPeriod_t alarmType);
+  AlarmID_t create(time_t value, OnTickContext_t onTickHandler, void *context, uint8_t isOneShot, dtAlarmPeriod_t alarmType);
+
+  MsTimerClass MsTimer[dtNBR_MS_TIMERS];
+  uint32_t nextMsTrigger;       // earliest nextTrigger of the active ms timers
+  bool hasActiveMsTimers;
+  uint32_t msTimerMaxLateness;
+  uint32_t msTimerTotalLateness;
+  uint32_t msTimerTriggerCount;
+  void serviceMsTimers();
+  void updateNextMsTrigger();
 
 public:
   TimeAlarmsClass();
@@ -155,6 +216,13 @@ public:
   AlarmID_t alarmRepeat(const int H, const int M, const int S, OnTick_t onTickHandler) {
     return alarmRepeat(AlarmHMS(H,M,S), onTickHandler);
   }
+  AlarmID_t alarmRepeat(time_t value, OnTickContext_t onTickHandler, void *context) {
+    if (value > SECS_PER_DAY) return dtINVALID_ALARM_ID;
+    return create(value, onTickHandler, context, false, dtDailyAlarm);
+  }
+  AlarmID_t alarmRepeat(const int H, const int M, const int S, OnTickContext_t onTickHandler, void *context) {
+    return alarmRepeat(AlarmHMS(H,M,S), onTickHandler, context);
+  }
 
   // trigger weekly at a specific day and time
   AlarmID_t alarmRepeat(const timeDayOfWeek_t DOW, const uint8_t H, const uint8_t M, const uint8_t S, OnTick_t onTickHandler) {
@@ -171,6 +239,10 @@ public:
   AlarmID_t timerOnce(const uint8_t H, const uint8_t M, const uint8_t S, OnTick_t onTickHandler) {
     return timerOnce(AlarmHMS(H,M,S), onTickHandler);
   }
+  AlarmID_t timerOnce(time_t value, OnTickContext_t onTickHandler, void *context) {
+    if (value <= 0) return dtINVALID_ALARM_ID;
+    return create(value, onTickHandler, context, true, dtTimer);
+  }
 
   // trigger at a regular interval
   AlarmID_t timerRepeat(time_t value, OnTick_t onTickHandler) {
@@ -180,6 +252,29 @@ public:
   AlarmID_t timerRepeat(const uint8_t H,  const uint8_t M,  const uint8_t S, OnTick_t onTickHandler) {
     return timerRepeat(AlarmHMS(H,M,S), onTickHandler);
   }
+  AlarmID_t timerRepeat(time_t value, OnTickContext_t onTickHandler, void *context) {
+    if (value <= 0) return dtINVALID_ALARM_ID;
+    return create(value, onTickHandler, context, false, dtTimer);
+  }
+
+  // millisecond timers, ids are kept until freeMs() so they can be restarted
+  MsTimerID_t createMs(OnTick_t onTickHandler);                      // allocate a stopped timer
+  MsTimerID_t createMs(OnTickContext_t onTickHandler, void *context);
+  void startMs(MsTimerID_t ID, uint32_t delayMs, uint32_t intervalMs = 0); // (re)start, interval 0 for one shot
+  void stopMs(MsTimerID_t ID);
+  bool isActiveMs(MsTimerID_t ID) const;
+  void freeMs(MsTimerID_t ID);
+
+  // trigger once after the given number of milliseconds, the id is freed when it fires
+  MsTimerID_t timerOnceMs(uint32_t delayMs, OnTick_t onTickHandler);
+  // trigger every intervalMs milliseconds
+  MsTimerID_t timerRepeatMs(uint32_t intervalMs, OnTick_t onTickHandler);
+
+  // how late ms timers have fired since the last reset
+  uint32_t getMsTimerMaxLateness() const { return msTimerMaxLateness; }
+  uint32_t getMsTimerAverageLateness() const;
+  uint32_t getMsTimerTriggerCount() const { return msTimerTriggerCount; }
+  void resetMsTimerStats();
 
   // void delay(unsigned long ms);
   void loop();
@@ -192,9 +287,18 @@ public:
   // low level methods
   void enable(AlarmID_t ID);                // enable the alarm to trigger
   void disable(AlarmID_t ID);               // prevent the alarm from triggering
-  void completeTriggeredAlarm();
+  // a triggered alarm stays in progress until complete() is called with its token, or its
+  // timeout expires. Any number of alarms can be in progress at once.
+  void complete(AlarmToken_t token);
+  void completeTriggeredAlarm();            // complete from within the handler
+  void postpone(AlarmToken_t token, time_t seconds); // give the run back and trigger again later
+  void setJobTimeout(AlarmID_t ID, uint32_t timeoutMs);
+  void setJobTimeoutHandler(AlarmID_t ID, OnTickContext_t onTimeoutHandler); // lets the owner drop the stuck job
+  bool isRunning(AlarmID_t ID) const;
+  uint32_t getTimedOutJobCount() const { return timedOutJobs; }
   AlarmID_t getTriggeredAlarmId() const;          // returns the currently triggered  alarm id
-  bool getIsServicing() const;                    // returns isServicing
+  AlarmToken_t getTriggeredAlarmToken() const;    // returns the token for the current run, only valid in a handler
+  bool getIsServicing() const;                    // returns true while inside a handler
   void write(AlarmID_t ID, time_t value);   // write the value (and enable) the alarm with the given ID
   time_t read(AlarmID_t ID) const;                // return the value for the given timer
   dtAlarmPeriod_t readType(AlarmID_t ID) const;   // return the alarm type for the given alarm ID
@@ -0,0 +1,56 @@
+// Copyright 2020 Kevin Cooper
+
+#include "areatable.h"
+
+AreaTable::AreaTable() {
+    memset(states, 0xFF, sizeof(states));
+    memset(changed, 0, sizeof(changed));
+}
+
+// Odd areas in the low nibble, even areas in the high nibble
+uint8_t AreaTable::get(uint8_t area) const {
+    if (!isValid(area))
+        return stateUnknown;
+
+    uint8_t index = area - 1;
+    return (states[index / 2] >> ((index & 1) * 4)) & 0x0F;
+}
+
+bool AreaTable::set(uint8_t area, uint8_t state) {
+    if (!isValid(area) || get(area) == (state & 0x0F))
+        return false;
+
+    uint8_t index = area - 1;
+    uint8_t shift = (index & 1) * 4;
+    states[index / 2] = (states[index / 2] & ~(0x0F << shift)) | ((state & 0x0F) << shift);
+    changed[index / 8] |= 1 << (index % 8);
+    return true;
+}
+
+bool AreaTable::takeChanged(uint8_t *area) {
+    for (uint8_t i = 0; i < sizeof(changed); i++) {
+        if (changed[i] == 0)
+            continue;
+
+        uint8_t bit = __builtin_ctz(changed[i]);
+        changed[i] &= ~(1 << bit);
+        *area = i * 8 + bit + 1;
+        return true;
+    }
+    return false;
+}
+
+bool AreaTable::hasChanges() const {
+    for (uint8_t i = 0; i < sizeof(changed); i++) {
+        if (changed[i])
+            return true;
+    }
+    return false;
+}
+
+void AreaTable::markKnownChanged() {
+    for (uint8_t area = 1; area <= maxAreas; area++) {
+        if (isKnown(area))
+            changed[(area - 1) / 8] |= 1 << ((area - 1) % 8);
+    }
+}
@@ -0,0 +1,38 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __AREATABLE_H_
+#define __AREATABLE_H_
+
+#include "Particle.h"
+
+// Arm state per area (1 based), a nibble each, plus a bit per area marking
+// those changed since they were last taken for publishing. Covers the
+// largest Premier Elite panel in 40 bytes.
+class AreaTable {
+ public:
+    static const uint8_t maxAreas = 64;
+    static const uint8_t stateUnknown = 0x0F;  // not reported since startup
+
+ public:
+    AreaTable();
+    bool isValid(uint8_t area) const { return area >= 1 && area <= maxAreas; }
+
+    uint8_t get(uint8_t area) const;
+    bool isKnown(uint8_t area) const { return get(area) != stateUnknown; }
+
+    // Returns true if the state changed, marking the area for publishing
+    bool set(uint8_t area, uint8_t state);
+
+    // Next changed area in area order, clearing its mark. False when none.
+    bool takeChanged(uint8_t *area);
+    bool hasChanges() const;
+
+    // Marks every known area so all of them are published again
+    void markKnownChanged();
+
+ private:
+    uint8_t states[maxAreas / 2];
+    uint8_t changed[maxAreas / 8];
+};
+
+#endif  // __AREATABLE_H_
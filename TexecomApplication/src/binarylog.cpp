@@ -0,0 +1,114 @@
+// Copyright 2020 Kevin Cooper
+
+#include "binarylog.h"
+
+static const char base64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+BinaryLogClass::BinaryLogClass() {}
+
+void BinaryLogClass::packValue(uint8_t *payload, uint8_t &length, const char *value) {
+    if (length >= maxPayloadSize)
+        return;
+
+    uint8_t stringLength = 0;
+    if (value) {
+        while (value[stringLength] && stringLength < BINARY_LOG_MAX_STRING)
+            stringLength++;
+    }
+
+    if (length + 1 + stringLength > maxPayloadSize)
+        stringLength = maxPayloadSize - length - 1;
+
+    payload[length++] = stringLength;
+    memcpy(&payload[length], value, stringLength);
+    length += stringLength;
+}
+
+void BinaryLogClass::recordFrame(uint16_t id, const char *data, uint8_t length) {
+    uint8_t payload[maxPayloadSize];
+
+    if (length > maxPayloadSize - 1)
+        length = maxPayloadSize - 1;
+
+    payload[0] = length;
+    memcpy(&payload[1], data, length);
+    append(id, LOG_LEVEL_INFO, payload, length + 1);
+}
+
+void BinaryLogClass::dumpFrame(const char *fmt, const char *data, uint8_t length) {
+    Log.info(fmt, data);
+    for (uint8_t i = 0; i < length; i++) {
+        Log.info("%d\n", data[i]);
+    }
+}
+
+void BinaryLogClass::append(uint16_t id, LogLevel level, const uint8_t *payload, uint8_t length) {
+    if (batchLength + BINARY_LOG_HEADER_SIZE + length > batchSize)
+        flush();
+
+    if (batchLength == 0) {
+        batchStartTime = millis();
+        batchLevel = LOG_LEVEL_INFO;
+    }
+    if (level > batchLevel)
+        batchLevel = level;
+
+    uint32_t now = millis();
+    uint8_t *record = &batch[batchLength];
+    record[0] = id & 0xFF;
+    record[1] = id >> 8;
+    record[2] = level;
+    record[3] = now & 0xFF;
+    record[4] = (now >> 8) & 0xFF;
+    record[5] = (now >> 16) & 0xFF;
+    record[6] = (now >> 24) & 0xFF;
+    record[7] = length;
+    if (length > 0)
+        memcpy(&record[BINARY_LOG_HEADER_SIZE], payload, length);
+    batchLength += BINARY_LOG_HEADER_SIZE + length;
+
+    // Errors go out straight away rather than waiting for the batch
+    if (level >= LOG_LEVEL_ERROR)
+        flush();
+}
+
+// out needs room for ((length + 2) / 3) * 4 characters and the terminator
+void BinaryLogClass::encodeBase64(const uint8_t *data, uint16_t length, char *out) {
+    for (uint16_t i = 0; i < length; i += 3) {
+        uint32_t block = data[i] << 16;
+        if (i + 1 < length)
+            block |= data[i+1] << 8;
+        if (i + 2 < length)
+            block |= data[i+2];
+
+        *out++ = base64Chars[(block >> 18) & 0x3F];
+        *out++ = base64Chars[(block >> 12) & 0x3F];
+        *out++ = i + 1 < length ? base64Chars[(block >> 6) & 0x3F] : '=';
+        *out++ = i + 2 < length ? base64Chars[block & 0x3F] : '=';
+    }
+    *out = '\0';
+}
+
+void BinaryLogClass::flush() {
+    if (batchLength == 0)
+        return;
+
+    char encoded[sizeof(BINARY_LOG_MARKER) + ((batchSize + 2) / 3) * 4];
+    strcpy(encoded, BINARY_LOG_MARKER);
+    encodeBase64(batch, batchLength, &encoded[strlen(BINARY_LOG_MARKER)]);
+
+    batchLength = 0;
+    if (batchLevel >= LOG_LEVEL_ERROR)
+        Log.error("%s", encoded);
+    else
+        Log.info("%s", encoded);
+}
+
+void BinaryLogClass::loop() {
+    if (batchLength > 0 && millis() - batchStartTime > flushInterval)
+        flush();
+}
+
+// make one instance for the user to use
+BinaryLogClass BinaryLog = BinaryLogClass();
@@ -0,0 +1,97 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __BINARYLOG_H_
+#define __BINARYLOG_H_
+
+#include "Particle.h"
+#include <type_traits>
+#include "binarylogformat.h"
+
+// Uncomment to replace formatted log lines from the TLOG_ macros with
+// compact binary records. Decode them with Tools/logdecode.
+// #define BINARY_LOGGING
+
+#if defined(BINARY_LOGGING)
+
+// The format string is only used to compute the id at compile time so it
+// never ends up in flash.
+#define TLOG_ID(fmt) (std::integral_constant<uint16_t, binaryLogHash(fmt)>::value)
+#define TLOG_INFO(fmt, ...) BinaryLog.record(TLOG_ID(fmt), LOG_LEVEL_INFO, ##__VA_ARGS__)
+#define TLOG_ERROR(fmt, ...) BinaryLog.record(TLOG_ID(fmt), LOG_LEVEL_ERROR, ##__VA_ARGS__)
+#define TLOG_FRAME(fmt, data, length) BinaryLog.recordFrame(TLOG_ID(fmt), data, length)
+#define TLOG_DUMP(fmt, data, length) BinaryLog.recordFrame(TLOG_ID(fmt), data, length)
+
+#else
+
+#define TLOG_INFO(fmt, ...) Log.info(fmt, ##__VA_ARGS__)
+#define TLOG_ERROR(fmt, ...) Log.error(fmt, ##__VA_ARGS__)
+#define TLOG_FRAME(fmt, data, length) Log.info(fmt, data)
+#define TLOG_DUMP(fmt, data, length) BinaryLog.dumpFrame(fmt, data, length)
+
+#endif
+
+class BinaryLogClass {
+ public:
+    BinaryLogClass();
+    void loop();
+    void flush();
+
+    template<typename... Args>
+    void record(uint16_t id, LogLevel level, Args... args) {
+        uint8_t payload[maxPayloadSize];
+        uint8_t length = 0;
+        pack(payload, length, args...);
+        append(id, level, payload, length);
+    }
+
+    // Messages without arguments have no payload
+    void record(uint16_t id, LogLevel level) {
+        append(id, level, NULL, 0);
+    }
+
+    void recordFrame(uint16_t id, const char *data, uint8_t length);
+    void dumpFrame(const char *fmt, const char *data, uint8_t length);
+
+    static void encodeBase64(const uint8_t *data, uint16_t length, char *out);
+
+ private:
+    // Device OS cuts log messages at LOG_MAX_STRING_LENGTH (160), so a
+    // full batch is 148 characters once encoded with its marker. A record
+    // has to fit in an empty batch.
+    static const uint16_t batchSize = 108;
+    static const uint8_t maxPayloadSize = batchSize - BINARY_LOG_HEADER_SIZE;
+    const unsigned int flushInterval = 2000;
+
+    void append(uint16_t id, LogLevel level, const uint8_t *payload, uint8_t length);
+
+    void pack(uint8_t *, uint8_t &) {}
+
+    template<typename T, typename... Args>
+    void pack(uint8_t *payload, uint8_t &length, T value, Args... args) {
+        packValue(payload, length, value);
+        pack(payload, length, args...);
+    }
+
+    template<typename T>
+    void packValue(uint8_t *payload, uint8_t &length, T value) {
+        if (length + 4 > maxPayloadSize)
+            return;
+        uint32_t v = (uint32_t)(int32_t)value;
+        for (uint8_t i = 0; i < 4; i++)
+            payload[length++] = (v >> (8 * i)) & 0xFF;
+    }
+
+    void packValue(uint8_t *payload, uint8_t &length, const char *value);
+    void packValue(uint8_t *payload, uint8_t &length, char *value) {
+        packValue(payload, length, (const char *)value);
+    }
+
+    uint8_t batch[batchSize];
+    uint16_t batchLength = 0;
+    uint32_t batchStartTime = 0;
+    LogLevel batchLevel = LOG_LEVEL_INFO;  // highest in the batch
+};
+
+extern BinaryLogClass BinaryLog;
+
+#endif  // __BINARYLOG_H_
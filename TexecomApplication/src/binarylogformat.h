@@ -0,0 +1,38 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __BINARYLOGFORMAT_H_
+#define __BINARYLOGFORMAT_H_
+
+#include <stdint.h>
+
+// Shared between the firmware and Tools/logdecode.cpp so keep this header
+// free of any Particle includes.
+//
+// A batch is published as a single log line "BIN:<base64>" containing any
+// number of records laid out as:
+//
+//  0-1  Format id (little endian) - binaryLogHash() of the format string
+//  2    Log level
+//  3-6  millis() when the record was written (little endian)
+//  7    Payload length
+//  8-   Payload
+//
+// The payload holds the format arguments in order. Integers are 4 bytes
+// little endian, strings and raw frames are a length byte followed by the
+// bytes themselves.
+
+#define BINARY_LOG_MARKER "BIN:"
+#define BINARY_LOG_HEADER_SIZE 8
+#define BINARY_LOG_MAX_STRING 64
+
+constexpr uint32_t binaryLogFnv(const char *s, uint32_t h = 2166136261u) {
+    return *s ? binaryLogFnv(s + 1, (h ^ (uint8_t)*s) * 16777619u) : h;
+}
+
+// 16 bit folded FNV-1a. Collisions are reported by the decoder when it
+// builds its dictionary from the source.
+constexpr uint16_t binaryLogHash(const char *s) {
+    return (uint16_t)((binaryLogFnv(s) >> 16) ^ (binaryLogFnv(s) & 0xFFFF));
+}
+
+#endif  // __BINARYLOGFORMAT_H_
@@ -5,8 +5,6 @@
 
 #include "Particle.h"
 
-#define texSerial Serial1
-
 class CrestronHelper {
  public:
     typedef enum {
@@ -15,11 +13,12 @@ class CrestronHelper {
     } CRESTRON_COMMAND;
 
  public:
-    CrestronHelper();
+    explicit CrestronHelper(Stream &serial);
     void request(CRESTRON_COMMAND command);
     void requestArmState();
     void requestScreen();
  private:
+    Stream &serial;
 };
 
  #endif  //__CRESTRONHELPER_H_
\ No newline at end of file
@@ -1,12 +1,12 @@
 #include "crestonhelper.h"
 
-CrestronHelper::CrestronHelper() {}
+CrestronHelper::CrestronHelper(Stream &serial) : serial(serial) {}
 
 void CrestronHelper::request(CRESTRON_COMMAND command) {
     if (command == COMMAND_SCREEN_STATE)
-        texSerial.println("LSTATUS");
+        serial.println("LSTATUS");
     else if (command == COMMAND_ARMED_STATE) {
-        texSerial.println("ASTATUS");
+        serial.println("ASTATUS");
     }
     // lastCommandTime = millis();
 }
@@ -0,0 +1,65 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __DIGISTATE_H_
+#define __DIGISTATE_H_
+
+#include <stdint.h>
+
+// Maps a mask of active digi outputs to the alarm state and flags. Kept free
+// of Particle includes so the table can be checked on the host, see
+// Tools/test/digistate.cpp.
+//
+// Mask bits follow TexecomClass::DIGI_OUTPUT and the state and flag values
+// follow TexecomClass::ALARM_STATE and ALARM_FLAGS, texecom.cpp checks both.
+
+#define DIGI_BIT_FULL_ARMED     (1 << 0)
+#define DIGI_BIT_PART_ARMED     (1 << 1)
+#define DIGI_BIT_EXIT           (1 << 2)
+#define DIGI_BIT_ENTRY          (1 << 3)
+#define DIGI_BIT_TRIGGERED      (1 << 4)
+#define DIGI_BIT_ARM_FAILED     (1 << 5)
+#define DIGI_BIT_FAULT_PRESENT  (1 << 6)
+#define DIGI_BIT_AREA_READY     (1 << 7)
+
+// Outputs that select the alarm state and outputs that only set a flag
+#define DIGI_STATE_OUTPUTS (DIGI_BIT_FULL_ARMED | DIGI_BIT_PART_ARMED | DIGI_BIT_EXIT | \
+                            DIGI_BIT_ENTRY | DIGI_BIT_TRIGGERED)
+#define DIGI_FLAG_OUTPUTS (DIGI_BIT_ARM_FAILED | DIGI_BIT_FAULT_PRESENT | DIGI_BIT_AREA_READY)
+
+struct DigiState {
+    uint8_t state;
+    uint8_t flags;
+};
+
+// When several state outputs are active the latest in the arming sequence
+// wins: triggered, exit, entry, part armed then full armed. No state output
+// is disarmed.
+constexpr uint8_t digiAlarmState(uint8_t mask) {
+    return (mask & DIGI_BIT_TRIGGERED) ? 5 :
+           (mask & DIGI_BIT_EXIT) ? 4 :
+           (mask & DIGI_BIT_ENTRY) ? 3 :
+           (mask & DIGI_BIT_PART_ARMED) ? 1 :
+           (mask & DIGI_BIT_FULL_ARMED) ? 2 : 0;
+}
+
+constexpr uint8_t digiAlarmFlags(uint8_t mask) {
+    return ((mask & DIGI_BIT_AREA_READY) ? 1 << 0 : 0) |
+           ((mask & DIGI_BIT_FAULT_PRESENT) ? 1 << 1 : 0) |
+           ((mask & DIGI_BIT_ARM_FAILED) ? 1 << 2 : 0);
+}
+
+#define DIGI_STATE_1(m) { digiAlarmState(m), digiAlarmFlags(m) }
+#define DIGI_STATE_4(m) DIGI_STATE_1(m), DIGI_STATE_1(m + 1), DIGI_STATE_1(m + 2), DIGI_STATE_1(m + 3)
+#define DIGI_STATE_16(m) DIGI_STATE_4(m), DIGI_STATE_4(m + 4), DIGI_STATE_4(m + 8), DIGI_STATE_4(m + 12)
+#define DIGI_STATE_64(m) DIGI_STATE_16(m), DIGI_STATE_16(m + 16), DIGI_STATE_16(m + 32), DIGI_STATE_16(m + 48)
+
+static constexpr DigiState digiStateTable[256] = {
+    DIGI_STATE_64(0), DIGI_STATE_64(64), DIGI_STATE_64(128), DIGI_STATE_64(192)
+};
+
+#undef DIGI_STATE_1
+#undef DIGI_STATE_4
+#undef DIGI_STATE_16
+#undef DIGI_STATE_64
+
+#endif  // __DIGISTATE_H_
@@ -0,0 +1,48 @@
+// Copyright 2020 Kevin Cooper
+
+#include "memorystats.h"
+
+MemoryStatsClass MemoryStats;
+
+// Not inlined so the frame address is this call's, everything below it is
+// free until setup() returns into the loop
+void __attribute__((noinline)) MemoryStatsClass::paintStack() {
+    uintptr_t top = ((uintptr_t)__builtin_frame_address(0) - stackMargin) & ~(uintptr_t)3;
+    volatile uint32_t *end = (volatile uint32_t *)top;
+
+    stackBottom = end - stackPaintBytes / sizeof(uint32_t);
+    for (volatile uint32_t *p = stackBottom; p < end; p++)
+        *p = stackPattern;
+}
+
+// Stack grows down, so count untouched words up from the bottom
+uint32_t MemoryStatsClass::getStackFree() const {
+    if (stackBottom == NULL)
+        return stackPaintBytes;
+
+    uint32_t words = 0;
+    while (words < stackPaintBytes / sizeof(uint32_t) && stackBottom[words] == stackPattern)
+        words++;
+    return words * sizeof(uint32_t);
+}
+
+void MemoryStatsClass::sample() {
+    runtime_info_t info;
+    memset(&info, 0, sizeof(info));
+    info.size = sizeof(info);
+    HAL_Core_Runtime_Info(&info, NULL);
+
+    heapFree = info.freeheap;
+    largestBlock = info.largest_free_block_heap;
+    maxUsedHeap = info.max_used_heap;
+
+    if (heapMinFree == 0 || heapFree < heapMinFree)
+        heapMinFree = heapFree;
+    if (minLargestBlock == 0 || largestBlock < minLargestBlock)
+        minLargestBlock = largestBlock;
+}
+
+void MemoryStatsClass::resetStats() {
+    heapMinFree = heapFree;
+    minLargestBlock = largestBlock;
+}
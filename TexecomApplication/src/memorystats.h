@@ -0,0 +1,50 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __MEMORYSTATS_H_
+#define __MEMORYSTATS_H_
+
+#include "Particle.h"
+
+// Stack and heap high water marks for the application thread. paintStack()
+// fills the stack below setup() with a pattern, the deepest word that's been
+// overwritten since is as far as loop() and everything it calls has reached.
+// The heap is sampled from the system's runtime info, so the lows are only
+// as good as the sampling interval.
+class MemoryStatsClass {
+ public:
+    // Device OS gives the application thread 6K, setup() starts well under
+    // 1K into it so 4K leaves room for the frames above and the margin
+    static const uint32_t stackPaintBytes = 4096;
+
+ public:
+    // Call first thing in setup(), before the stack has been used deeply
+    void paintStack();
+    void sample();
+    void resetStats();
+
+    // Since boot, a painted word can't be repainted safely once it's in use
+    uint32_t getStackUsed() const { return stackPaintBytes - getStackFree(); }
+    uint32_t getStackFree() const;
+
+    // At the last sample and the lowest seen since resetStats()
+    uint32_t getHeapFree() const { return heapFree; }
+    uint32_t getHeapMinFree() const { return heapMinFree; }
+    uint32_t getLargestBlock() const { return largestBlock; }
+    uint32_t getMinLargestBlock() const { return minLargestBlock; }
+    uint32_t getMaxUsedHeap() const { return maxUsedHeap; }  // system's own high water
+
+ private:
+    static const uint32_t stackPattern = 0xDEADBEEF;
+    static const uint32_t stackMargin = 256;  // left for paintStack's own frame
+
+    volatile uint32_t *stackBottom = NULL;
+    uint32_t heapFree = 0;
+    uint32_t heapMinFree = 0;
+    uint32_t largestBlock = 0;
+    uint32_t minLargestBlock = 0;
+    uint32_t maxUsedHeap = 0;
+};
+
+extern MemoryStatsClass MemoryStats;
+
+#endif  // __MEMORYSTATS_H_
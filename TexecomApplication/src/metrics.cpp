@@ -0,0 +1,65 @@
+// Copyright 2020 Kevin Cooper
+
+#include "metrics.h"
+
+#if defined(LATENCY_METRICS)
+
+MetricsClass Metrics;
+
+const char *MetricsClass::names[METRIC_COUNT] = {
+    "texecom_loop", "mqtt_loop", "crestron_message", "papertrail_log"
+};
+
+void LatencyHistogram::record(uint32_t micros) {
+    if (count == 0 || micros < minMicros)
+        minMicros = micros;
+    if (micros > maxMicros)
+        maxMicros = micros;
+    count++;
+
+    uint8_t bucket = 0;
+    while (bucket < buckets - 1 && micros >= (4UL << bucket))
+        bucket++;
+    histogram[bucket]++;
+}
+
+void LatencyHistogram::reset() {
+    count = 0;
+    minMicros = 0;
+    maxMicros = 0;
+    memset(histogram, 0, sizeof(histogram));
+}
+
+// Upper bound of the bucket holding the percentile, capped at the maximum
+uint32_t LatencyHistogram::getPercentile(uint8_t percent) const {
+    if (count == 0)
+        return 0;
+
+    uint32_t target = ((uint64_t)count * percent + 99) / 100;
+    uint32_t total = 0;
+    for (uint8_t bucket = 0; bucket < buckets; bucket++) {
+        total += histogram[bucket];
+        if (total >= target)
+            return (4UL << bucket) < maxMicros ? (4UL << bucket) : maxMicros;
+    }
+    return maxMicros;
+}
+
+void MetricsClass::reset() {
+    for (uint8_t i = 0; i < METRIC_COUNT; i++)
+        histograms[i].reset();
+}
+
+String MetricsClass::summary() const {
+    String text;
+
+    for (uint8_t i = 0; i < METRIC_COUNT; i++) {
+        const LatencyHistogram &h = histograms[i];
+        text.concat(String::format("%s n=%lu min=%lu p50=%lu p99=%lu max=%lu\n",
+                                   names[i], h.getCount(), h.getMin(),
+                                   h.getPercentile(50), h.getPercentile(99), h.getMax()));
+    }
+    return text;
+}
+
+#endif
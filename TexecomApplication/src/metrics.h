@@ -0,0 +1,84 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __METRICS_H_
+#define __METRICS_H_
+
+#include "Particle.h"
+
+// Uncomment to time the hot paths with the cycle counter. Each point keeps
+// a histogram in RAM, readable through the "latency" cloud variable and
+// published hourly. Without it METRIC_SCOPE is empty and none of this is
+// built.
+// #define LATENCY_METRICS
+
+#if defined(LATENCY_METRICS)
+
+typedef enum {
+    METRIC_TEXECOM_LOOP = 0,
+    METRIC_MQTT_LOOP = 1,
+    METRIC_CRESTRON_MESSAGE = 2,
+    METRIC_PAPERTRAIL_LOG = 3,
+    METRIC_COUNT = 4
+} METRIC;
+
+class LatencyHistogram {
+ public:
+    // Bucket n counts times below 4us << n, the last also takes anything longer
+    static const uint8_t buckets = 20;
+
+    LatencyHistogram() { reset(); }
+    void record(uint32_t micros);
+    void reset();
+
+    uint32_t getCount() const { return count; }
+    uint32_t getMin() const { return count ? minMicros : 0; }
+    uint32_t getMax() const { return maxMicros; }
+    uint32_t getPercentile(uint8_t percent) const;
+
+ private:
+    uint32_t count;
+    uint32_t minMicros;
+    uint32_t maxMicros;
+    uint32_t histogram[buckets];
+};
+
+class MetricsClass {
+ public:
+    void record(METRIC metric, uint32_t ticks) {
+        histograms[metric].record(ticks / System.ticksPerMicrosecond());
+    }
+
+    const LatencyHistogram &get(METRIC metric) const { return histograms[metric]; }
+    const char *getName(METRIC metric) const { return names[metric]; }
+    void reset();
+
+    // One line per metric for the cloud variable
+    String summary() const;
+
+ private:
+    static const char *names[METRIC_COUNT];
+    LatencyHistogram histograms[METRIC_COUNT];
+};
+
+extern MetricsClass Metrics;
+
+// Times the rest of the enclosing scope
+class MetricScope {
+ public:
+    explicit MetricScope(METRIC metric) : metric(metric), start(System.ticks()) {}
+    ~MetricScope() { Metrics.record(metric, System.ticks() - start); }
+
+ private:
+    METRIC metric;
+    uint32_t start;
+};
+
+#define METRIC_SCOPE(metric) MetricScope metricScope(metric)
+
+#else
+
+#define METRIC_SCOPE(metric)
+
+#endif
+
+#endif  // __METRICS_H_
@@ -1,4 +1,5 @@
 #include "mqtt.h"
+#include "tracecapture.h"
 
 #define LOGGING
 
@@ -101,90 +102,107 @@ bool MQTT::connect(const char *id, const char *user, const char *pass) {
 
 bool MQTT::connect(const char *id, const char *user, const char *pass, const char* willTopic, EMQTT_QOS willQos, uint8_t willRetain, const char* willMessage, bool cleanSession, MQTT_VERSION version) {
     if (!isConnected()) {
-        int result = 0;
-        if (ip == NULL)
-            result = _client.connect(this->domain.c_str(), this->port);
-        else
-            result = _client.connect(this->ip, this->port);
+        if (openSocket() && sendConnect(id, user, pass, willTopic, willQos, willRetain, willMessage, cleanSession, version)) {
+            EMQTT_CONNECT_STATE state;
+            while ((state = pollConnect()) == CONNECT_PENDING) {}
+            return state == CONNECT_ACCEPTED;
+        }
+        _client.stop();
+    }
+    return false;
+}
 
-        if (result) {
-            nextMsgId = 1;
-            uint16_t length = 5;
+bool MQTT::openSocket() {
+    if (ip == NULL)
+        return _client.connect(this->domain.c_str(), this->port);
+    else
+        return _client.connect(this->ip, this->port);
+}
 
-            if (version == MQTT_V311) {
-                const uint8_t MQTT_HEADER_V311[] = {0x00,0x04,'M','Q','T','T',MQTT_V311};
-                memcpy(buffer + length, MQTT_HEADER_V311, sizeof(MQTT_HEADER_V311));
-                length+=sizeof(MQTT_HEADER_V311);
-            } else {
-                const uint8_t MQTT_HEADER_V31[] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_V31};
-                memcpy(buffer + length, MQTT_HEADER_V31, sizeof(MQTT_HEADER_V31));
-                length+=sizeof(MQTT_HEADER_V31);
-            }
+bool MQTT::sendConnect(const char *id, const char *user, const char *pass, const char* willTopic, EMQTT_QOS willQos, uint8_t willRetain, const char* willMessage, bool cleanSession, MQTT_VERSION version) {
+    nextMsgId = 1;
+    uint16_t length = 5;
 
-            uint8_t v = 0;
-            if (willTopic) {
-                v = 0x06|(willQos<<3)|(willRetain<<5);
-            } else {
-                v = 0x02;
-            }
+    if (version == MQTT_V311) {
+        const uint8_t MQTT_HEADER_V311[] = {0x00,0x04,'M','Q','T','T',MQTT_V311};
+        memcpy(buffer + length, MQTT_HEADER_V311, sizeof(MQTT_HEADER_V311));
+        length+=sizeof(MQTT_HEADER_V311);
+    } else {
+        const uint8_t MQTT_HEADER_V31[] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_V31};
+        memcpy(buffer + length, MQTT_HEADER_V31, sizeof(MQTT_HEADER_V31));
+        length+=sizeof(MQTT_HEADER_V31);
+    }
 
-            if (!cleanSession) {
-              v = v&0xfd;
-            }
+    uint8_t v = 0;
+    if (willTopic) {
+        v = 0x06|(willQos<<3)|(willRetain<<5);
+    } else {
+        v = 0x02;
+    }
 
-            if(user != NULL) {
-                v = v|0x80;
+    if (!cleanSession) {
+      v = v&0xfd;
+    }
 
-                if(pass != NULL) {
-                    v = v|(0x80>>1);
-                }
-            }
+    if(user != NULL) {
+        v = v|0x80;
 
-            buffer[length++] = v;
+        if(pass != NULL) {
+            v = v|(0x80>>1);
+        }
+    }
 
-            buffer[length++] = ((this->keepalive) >> 8);
-            buffer[length++] = ((this->keepalive) & 0xFF);
-            length = writeString(id, buffer, length);
-            if (willTopic) {
-                length = writeString(willTopic, buffer, length);
-                length = writeString(willMessage, buffer, length);
-            }
+    buffer[length++] = v;
 
-            if(user != NULL) {
-                length = writeString(user,buffer,length);
-                if(pass != NULL) {
-                    length = writeString(pass,buffer,length);
-                }
-            }
+    buffer[length++] = ((this->keepalive) >> 8);
+    buffer[length++] = ((this->keepalive) & 0xFF);
+    length = writeString(id, buffer, length);
+    if (willTopic) {
+        length = writeString(willTopic, buffer, length);
+        length = writeString(willMessage, buffer, length);
+    }
 
-            write(MQTTCONNECT, buffer, length-5);
-            lastInActivity = lastOutActivity = millis();
+    if(user != NULL) {
+        length = writeString(user,buffer,length);
+        if(pass != NULL) {
+            length = writeString(pass,buffer,length);
+        }
+    }
 
-            while (!_client.available()) {
-                unsigned long t = millis();
-                if (t-lastInActivity > this->keepalive*1000UL) {
-                    _client.stop();
-                    return false;
-                }
-            }
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
+    if (!write(MQTTCONNECT, buffer, length-5)) {
+        _client.stop();
+        return false;
+    }
+    lastInActivity = lastOutActivity = millis();
+    return true;
+}
 
-            if (len == 4) {
-                if (buffer[3] == CONN_ACCEPT) {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    debug_print(" Connect success\n");
-                    return true;
-                } else {
-                    // check EMQTT_CONNACK_RESPONSE code.
-                    debug_print(" Connect fail. code = [%d]\n", buffer[3]);
-                }
-            }
+MQTT::EMQTT_CONNECT_STATE MQTT::pollConnect() {
+    // CONNACK is four bytes, wait for all of them so readPacket won't block
+    if (_client.available() < 4) {
+        if (millis() - lastInActivity > this->keepalive*1000UL || !_client.connected()) {
+            _client.stop();
+            return CONNECT_FAILED;
         }
-        _client.stop();
+        return CONNECT_PENDING;
     }
-    return false;
+
+    uint8_t llen;
+    uint16_t len = readPacket(&llen);
+
+    if (len == 4) {
+        if (buffer[3] == CONN_ACCEPT) {
+            lastInActivity = millis();
+            pingOutstanding = false;
+            debug_print(" Connect success\n");
+            return CONNECT_ACCEPTED;
+        } else {
+            // check EMQTT_CONNACK_RESPONSE code.
+            debug_print(" Connect fail. code = [%d]\n", buffer[3]);
+        }
+    }
+    _client.stop();
+    return CONNECT_FAILED;
 }
 
 uint8_t MQTT::readByte() {
@@ -374,6 +392,8 @@ bool MQTT::publish(const char* topic, const uint8_t* payload, unsigned int pleng
 
 bool MQTT::publish(const char* topic, const uint8_t* payload, unsigned int plength, bool retain, EMQTT_QOS qos, bool dup, uint16_t *messageid) {
     if (isConnected()) {
+        TRACE_MQTT(TRACE_MQTT_OUT, topic, payload, plength);
+
         // Leave room in the buffer for header and variable length field
         uint16_t length = 5;
         memset(buffer, 0, this->maxpacketsize);
@@ -124,6 +124,12 @@ typedef enum {
     CONN_NOT_AUTHORIZED = 5
 } EMQTT_CONNACK_RESPONSE;
 
+typedef enum {
+    CONNECT_PENDING,
+    CONNECT_ACCEPTED,
+    CONNECT_FAILED
+} EMQTT_CONNECT_STATE;
+
 private:
     TCPClient _client;
     uint8_t *buffer = NULL;
@@ -174,6 +180,16 @@ public:
     bool connect(const char *id);
     bool connect(const char *id, const char *user, const char *pass);
     bool connect(const char *id, const char *user, const char *pass, const char* willTopic, EMQTT_QOS willQos, uint8_t willRetain, const char* willMessage, bool cleanSession, MQTT_VERSION version = MQTT_V311);
+
+    // connect() in steps for callers that can't wait on the broker.
+    // openSocket() blocks as long as TCPClient::connect does, so can be run
+    // on another thread. sendConnect() writes CONNECT and pollConnect()
+    // returns CONNECT_PENDING until the CONNACK is in or the keepalive has
+    // passed. The client is stopped on failure.
+    bool openSocket();
+    bool sendConnect(const char *id, const char *user, const char *pass, const char* willTopic = NULL, EMQTT_QOS willQos = QOS0, uint8_t willRetain = 0, const char* willMessage = NULL, bool cleanSession = true, MQTT_VERSION version = MQTT_V311);
+    EMQTT_CONNECT_STATE pollConnect();
+
     void disconnect();
     void clear();
 
@@ -0,0 +1,125 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __PANELTASK_H_
+#define __PANELTASK_H_
+
+#include "Particle.h"
+
+// Stackless coroutines for the panel conversations, so a flow that sends a
+// command and waits for the reply reads top to bottom. The body is a member
+// function that opens with TASK_BEGIN. TASK_AWAIT records its line in the
+// frame and returns, the next resume jumps back to it through the switch
+// TASK_BEGIN opened. Locals don't survive a wait so anything needed across
+// one lives in the frame or the owner, and waits can't sit inside a switch.
+//
+//     void Owner::exampleTask(Task &task) {
+//         TASK_BEGIN(task);
+//         send(request);
+//         task.setTimeout(1000);
+//         TASK_AWAIT(task, task.bit(REPLY));
+//         if (task.result != REPLY)
+//             TASK_EXIT(task);  // timed out
+//         TASK_END(task);
+//     }
+//
+// Results are small enum values, each wait takes a mask of the ones it
+// wants and the rest are ignored until it times out.
+template<typename Owner, typename Result>
+class TaskFrame {
+ public:
+    typedef void (Owner::*Body)(TaskFrame &task);
+
+    Result result;      // what the task was last resumed with
+    uint16_t counter;   // scratch that survives waits
+    uint16_t resumeLine;
+
+    static uint32_t bit(Result result) { return 1UL << result; }
+
+    bool isRunning() const { return body != NULL; }
+    bool isWaitingFor(Result result) const { return result < 32 && (waitMask & bit(result)) != 0; }
+    bool hasTimedOut(uint32_t now) const {
+        return waitMask != 0 && hasDeadline && (int32_t)(now - deadline) >= 0;
+    }
+
+    // Deadline for the waits that follow, until it's set again
+    void setTimeout(uint32_t timeout) {
+        deadline = millis() + timeout;
+        hasDeadline = true;
+    }
+
+    void start(Owner *owner, Body body) {
+        this->owner = owner;
+        this->body = body;
+        resumeLine = 0;
+        counter = 0;
+        hasDeadline = false;
+        waitMask = 0xFFFFFFFF;
+    }
+
+    // Runs the task up to its next wait if it's waiting for result, the
+    // mask is cleared first so a resume from inside the body is ignored
+    bool resume(Result result) {
+        if (!isWaitingFor(result))
+            return false;
+
+        this->result = result;
+        waitMask = 0;
+        (owner->*body)(*this);
+        return true;
+    }
+
+    // Resumes with timeoutResult whatever the task is waiting for
+    void expire(Result timeoutResult) {
+        this->result = timeoutResult;
+        waitMask = 0;
+        (owner->*body)(*this);
+    }
+
+    void wait(uint32_t results, uint16_t line) {
+        waitMask = results;
+        resumeLine = line;
+    }
+
+    void finish() {
+        body = NULL;
+        waitMask = 0;
+    }
+
+ private:
+    Owner *owner = NULL;
+    Body body = NULL;
+    uint32_t waitMask = 0;
+    uint32_t deadline = 0;
+    bool hasDeadline = false;
+};
+
+// Fixed set of frames shared by every owner, a task takes the first free one
+template<typename Owner, typename Result, uint8_t Size>
+class TaskPool {
+ public:
+    typedef TaskFrame<Owner, Result> Frame;
+
+    Frame *start(Owner *owner, typename Frame::Body body) {
+        for (uint8_t i = 0; i < Size; i++) {
+            if (!frames[i].isRunning()) {
+                frames[i].start(owner, body);
+                return &frames[i];
+            }
+        }
+        return NULL;
+    }
+
+ private:
+    Frame frames[Size];
+};
+
+#define TASK_BEGIN(task) switch ((task).resumeLine) { case 0:
+
+#define TASK_AWAIT(task, results) \
+    do { (task).wait((results), __LINE__); return; case __LINE__: ; } while (0)
+
+#define TASK_EXIT(task) do { (task).finish(); return; } while (0)
+
+#define TASK_END(task) } (task).finish()
+
+#endif  // __PANELTASK_H_
@@ -1,4 +1,5 @@
 #include "papertrail.h"
+#include "metrics.h"
 
 ///Local port to be used by the socket.
 const uint16_t PapertrailLogHandler::kLocalPort = 8888;
@@ -7,6 +8,10 @@ PapertrailLogHandler::PapertrailLogHandler(String host, uint16_t port, String ap
     const LogCategoryFilters &filters) : LogHandler(level, filters), m_host(host), m_port(port), m_app(app),
                                          m_system(system)  {
     m_inited = false;
+    m_addressValid = false;
+    m_addressStale = false;
+    m_addressTime = 0;
+    m_resolver = NULL;
     LogManager::instance()->addHandler(this);
 }
 
@@ -20,41 +25,148 @@ IPAddress PapertrailLogHandler::resolve(const char *host) {
 #endif
 }
 
+bool PapertrailLogHandler::networkReady() {
+#if Wiring_WiFi
+    return WiFi.ready();
+#elif Wiring_Cellular
+    return Cellular.ready();
+#else
+#error Unsupported plaform
+#endif
+}
+
+/// Keeps the cached address fresh so logMessage() never waits on DNS.
+void PapertrailLogHandler::resolverThread(void *param) {
+    PapertrailLogHandler *handler = static_cast<PapertrailLogHandler *>(param);
+    uint32_t retryInterval = kMinRetryInterval;
+    uint32_t nextAttempt = 0;
+
+    while (true) {
+        bool due;
+        ATOMIC_BLOCK() {
+            due = !handler->m_addressValid || handler->m_addressStale ||
+                  millis() - handler->m_addressTime > kAddressTTL;
+        }
+
+        if (due && networkReady() && (int32_t)(millis() - nextAttempt) >= 0) {
+            IPAddress address = resolve(handler->m_host);
+
+            if (address) {
+                ATOMIC_BLOCK() {
+                    handler->m_address = address;
+                    handler->m_addressTime = millis();
+                    handler->m_addressValid = true;
+                    handler->m_addressStale = false;
+                }
+                retryInterval = kMinRetryInterval;
+            } else {
+                // Keep using the previous address, if any, until a resolve succeeds
+                nextAttempt = millis() + retryInterval;
+                retryInterval *= 2;
+                if (retryInterval > kMaxRetryInterval)
+                    retryInterval = kMaxRetryInterval;
+            }
+        }
+
+        delay(1000);
+    }
+}
+
+bool PapertrailLogHandler::currentAddress(IPAddress *address) {
+    bool valid;
+    ATOMIC_BLOCK() {
+        valid = m_addressValid;
+        if (valid)
+            *address = m_address;
+    }
+    return valid;
+}
+
+bool PapertrailLogHandler::send(const char *packet, size_t length) {
+    IPAddress address;
+    if (!currentAddress(&address))
+        return false;
+
+    int ret = m_udp.sendPacket(packet, length, address, m_port);
+    if (ret < 1) {
+        // Ask the resolver to refresh rather than resolving here
+        if (++m_sendFailures >= kMaxSendFailures) {
+            m_sendFailures = 0;
+            ATOMIC_BLOCK() {
+                m_addressStale = true;
+            }
+        }
+        return false;
+    }
+
+    m_sendFailures = 0;
+    return true;
+}
+
+/// Hold a packet until an address is known, dropping the oldest when full.
+void PapertrailLogHandler::queue(const char *packet, size_t length) {
+    if (length >= kQueuedPacketSize)
+        length = kQueuedPacketSize - 1;
+
+    if (m_queueCount == kQueueLength) {
+        m_queueHead = (m_queueHead + 1) % kQueueLength;
+        m_queueCount--;
+        m_queueDropped++;
+    }
+
+    uint8_t slot = (m_queueHead + m_queueCount) % kQueueLength;
+    memcpy(m_queued[slot], packet, length);
+    m_queued[slot][length] = '\0';
+    m_queuedLength[slot] = length;
+    m_queueCount++;
+}
+
+void PapertrailLogHandler::sendQueued() {
+    while (m_queueCount > 0) {
+        if (!send(m_queued[m_queueHead], m_queuedLength[m_queueHead]))
+            return;
+        m_queueHead = (m_queueHead + 1) % kQueueLength;
+        m_queueCount--;
+    }
+
+    if (m_queueDropped > 0) {
+        String dropped = String::format("<22>1 %s %s %s - - - %u log messages dropped while offline",
+                                        Time.format(Time.now(), TIME_FORMAT_ISO8601_FULL).c_str(),
+                                        m_system.c_str(), m_app.c_str(), m_queueDropped);
+        if (send(dropped.c_str(), dropped.length()))
+            m_queueDropped = 0;
+    }
+}
+
 /// Send the log message to Papertrail.
 void PapertrailLogHandler::log(String message) {
     String time = Time.format(Time.now(), TIME_FORMAT_ISO8601_FULL);
     String packet = String::format("<22>1 %s %s %s - - - %s", time.c_str(), m_system.c_str(), m_app.c_str(),
                                    message.c_str());
-    int ret = m_udp.sendPacket(packet, packet.length(), m_address, m_port);
-    if (ret < 1) {
-        m_inited = false;
-    }
+
+    if (m_inited)
+        sendQueued();
+
+    if (!m_inited || m_queueCount > 0 || !send(packet.c_str(), packet.length()))
+        queue(packet.c_str(), packet.length());
 }
 
 PapertrailLogHandler::~PapertrailLogHandler() {
     LogManager::instance()->removeHandler(this);
 }
 
-/// Initialize socket and resolve address if needed.
+/// Initialize socket and start the background resolver if needed.
 bool PapertrailLogHandler::lazyInit() {
-    if (!m_inited) {
-        uint8_t ret = m_udp.begin(kLocalPort);
-        m_inited = ret != 0;
-
-        if (!m_inited) {
-            return false;
-        }
+    if (m_resolver == NULL) {
+        m_resolver = new Thread("papertrail", resolverThread, this);
     }
 
-    if (!m_address) {
-        m_address = resolve(m_host);
-
-        if (!m_address) {
-            return false;
-        }
+    if (!m_inited && networkReady()) {
+        uint8_t ret = m_udp.begin(kLocalPort);
+        m_inited = ret != 0;
     }
 
-    return true;
+    return m_inited;
 }
 
 // The floowing methods are taken from Particle FW, specifically spark::StreamLogHandler.
@@ -81,9 +193,10 @@ const char* PapertrailLogHandler::extractFuncName(const char *s, size_t *size) {
 }
 
 void PapertrailLogHandler::logMessage(const char *msg, LogLevel level, const char *category, const LogAttributes &attr) {
-    if (!lazyInit()) {
-      return;
-    }
+    METRIC_SCOPE(METRIC_PAPERTRAIL_LOG);
+
+    // Messages are queued until the socket and address are ready
+    lazyInit();
 
     //
     //  Rate limit logs per second
@@ -17,6 +17,10 @@ class PapertrailLogHandler : public LogHandler {
     UDP m_udp;
     bool m_inited;
     IPAddress m_address;
+    uint32_t m_addressTime;
+    bool m_addressValid;
+    bool m_addressStale;
+    Thread *m_resolver;
 
 public:
     /// Initialize the log handler.
@@ -39,8 +43,32 @@ private:
     const char* extractFileName(const char *s);
     const char* extractFuncName(const char *s, size_t *size);
     void log(String message);
+    bool send(const char *packet, size_t length);
+    void queue(const char *packet, size_t length);
+    void sendQueued();
+    bool currentAddress(IPAddress *address);
+    static void resolverThread(void *param);
     static IPAddress resolve(const char *host);
+    static bool networkReady();
     static const uint16_t kLocalPort;
+
+    /// Cached address is refreshed in the background after this long.
+    static const uint32_t kAddressTTL = 3600000;
+    /// Resolver retry interval, doubled on each failure up to kMaxRetryInterval.
+    static const uint32_t kMinRetryInterval = 5000;
+    static const uint32_t kMaxRetryInterval = 300000;
+    /// Consecutive send failures before the address is re-resolved.
+    static const uint8_t kMaxSendFailures = 5;
+    uint8_t m_sendFailures = 0;
+
+    /// Packets logged before the address is known are held here.
+    static const uint8_t kQueueLength = 8;
+    static const uint16_t kQueuedPacketSize = 256;
+    char m_queued[kQueueLength][kQueuedPacketSize];
+    uint16_t m_queuedLength[kQueueLength];
+    uint8_t m_queueHead = 0;
+    uint8_t m_queueCount = 0;
+    uint16_t m_queueDropped = 0;
     uint32_t lastMessageSent;
     const uint8_t maxTokens = 15;
     uint8_t messageTokens = maxTokens;
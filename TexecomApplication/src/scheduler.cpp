@@ -0,0 +1,95 @@
+// Copyright 2020 Kevin Cooper
+
+#include "scheduler.h"
+
+int8_t Scheduler::add(const char *name, JobFunction function, uint8_t priority,
+                      uint32_t budgetMicros, uint32_t intervalMicros) {
+    if (jobCount >= maxJobs)
+        return -1;
+
+    int8_t id = jobCount++;
+    JOB &job = jobs[id];
+    job.function = function;
+    job.priority = priority;
+    job.budget = budgetMicros;
+    job.interval = intervalMicros;
+    job.maxGap = 0;
+    job.lastRun = micros();
+    job.wasDeferred = false;
+    memset(&job.stats, 0, sizeof(job.stats));
+    job.stats.name = name;
+
+    // Insertion sort, jobs of the same priority keep the order they were added
+    uint8_t i = id;
+    while (i > 0 && jobs[order[i - 1]].priority > priority) {
+        order[i] = order[i - 1];
+        i--;
+    }
+    order[i] = id;
+    return id;
+}
+
+void Scheduler::setMaxGap(int8_t id, uint32_t maxGapMicros) {
+    if (id >= 0 && id < jobCount)
+        jobs[id].maxGap = maxGapMicros;
+}
+
+void Scheduler::loop() {
+    uint32_t passStart = micros();
+
+    for (uint8_t i = 0; i < jobCount; i++) {
+        JOB &job = jobs[order[i]];
+        uint32_t now = micros();
+
+        if (job.interval && now - job.lastRun < job.interval)
+            continue;
+
+        // Jobs past their maximum gap, or put off last pass, run whatever
+        // this pass has spent so nothing is starved
+        if (now - passStart >= passBudget && !job.wasDeferred &&
+                !(job.maxGap && now - job.lastRun >= job.maxGap)) {
+            job.wasDeferred = true;
+            job.stats.deferred++;
+            continue;
+        }
+
+        job.wasDeferred = false;
+        run(job);
+        serviceOverdue();
+    }
+}
+
+void Scheduler::run(JOB &job) {
+    uint32_t start = micros();
+    uint32_t gap = start - job.lastRun;
+    if (gap > job.stats.maxGapMicros)
+        job.stats.maxGapMicros = gap;
+
+    job.function();
+
+    uint32_t elapsed = micros() - start;
+    job.lastRun = start;
+    job.stats.runs++;
+    job.stats.totalMicros += elapsed;
+    if (elapsed > job.stats.maxMicros)
+        job.stats.maxMicros = elapsed;
+    if (elapsed > job.budget)
+        job.stats.overruns++;
+}
+
+// Between jobs, so a long one only delays a guaranteed job by itself
+void Scheduler::serviceOverdue() {
+    for (uint8_t i = 0; i < jobCount; i++) {
+        JOB &job = jobs[order[i]];
+        if (job.maxGap && micros() - job.lastRun >= job.maxGap)
+            run(job);
+    }
+}
+
+void Scheduler::resetStats() {
+    for (uint8_t i = 0; i < jobCount; i++) {
+        const char *name = jobs[i].stats.name;
+        memset(&jobs[i].stats, 0, sizeof(jobs[i].stats));
+        jobs[i].stats.name = name;
+    }
+}
@@ -0,0 +1,65 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __SCHEDULER_H_
+#define __SCHEDULER_H_
+
+#include "Particle.h"
+
+// Runs the application loop's jobs cooperatively. Each pass runs the due
+// jobs in priority order (0 first) until the pass budget is spent, the rest
+// wait for the next pass but aren't put off twice running. A job given a
+// maximum gap is also run between other jobs whenever it has waited that
+// long, so a slow MQTT connect can't hold up the serial port for more than
+// the gap plus one job.
+class Scheduler {
+ public:
+    static const uint8_t maxJobs = 8;
+    typedef void (*JobFunction)();
+
+    struct JOB_STATS {
+        const char *name;
+        uint32_t runs;
+        uint32_t totalMicros;
+        uint32_t maxMicros;
+        uint32_t overruns;    // runs longer than the job's budget
+        uint32_t deferred;    // passes it was due but the pass budget was spent
+        uint32_t maxGapMicros;  // longest time between runs
+    };
+
+ public:
+    explicit Scheduler(uint32_t passBudgetMicros) : passBudget(passBudgetMicros) {}
+
+    // Returns the job's id or -1 if there's no room. interval is the
+    // least time between runs, 0 runs it every pass.
+    int8_t add(const char *name, JobFunction function, uint8_t priority,
+               uint32_t budgetMicros, uint32_t intervalMicros = 0);
+    void setMaxGap(int8_t id, uint32_t maxGapMicros);
+
+    void loop();
+
+    uint8_t getJobCount() const { return jobCount; }
+    const JOB_STATS &getStats(uint8_t id) const { return jobs[id].stats; }
+    void resetStats();
+
+ private:
+    struct JOB {
+        JobFunction function;
+        uint8_t priority;
+        uint32_t budget;
+        uint32_t interval;
+        uint32_t maxGap;
+        uint32_t lastRun;
+        bool wasDeferred;
+        JOB_STATS stats;
+    };
+
+    void run(JOB &job);
+    void serviceOverdue();
+
+    JOB jobs[maxJobs];
+    uint8_t order[maxJobs];  // job ids by priority
+    uint8_t jobCount = 0;
+    uint32_t passBudget;
+};
+
+#endif  // __SCHEDULER_H_
@@ -0,0 +1,47 @@
+// Copyright 2020 Kevin Cooper
+
+#include "serialreader.h"
+
+void SerialReader::start() {
+    if (thread != NULL)
+        return;
+
+    frame.length = 0;
+    thread = new Thread("serial", run, this, OS_THREAD_PRIORITY_DEFAULT + 1, 1024);
+}
+
+void SerialReader::run(void *context) {
+    static_cast<SerialReader*>(context)->readFrames();
+}
+
+void SerialReader::readFrames() {
+    for (;;) {
+        while (serial.available() > 0) {
+            char c = serial.read();
+            lastByte = millis();
+
+            if (frame.length == 0) {
+                frame.startMillis = lastByte;
+                frame.startMicros = micros();
+            }
+            frame.data[frame.length++] = c;
+
+            if ((c == '\n' && frame.length > 1 && frame.data[frame.length - 2] == '\r') ||
+                    frame.length == SerialFrame::maxLength)
+                pushFrame();
+        }
+
+        if (frame.length > 0 && millis() - lastByte >= idleFlush)
+            pushFrame();
+
+        // Two bytes arrive each millisecond at 19200 baud, well inside the
+        // UART buffer
+        delay(1);
+    }
+}
+
+// A full queue drops the frame, the engine times out the message it was part of
+void SerialReader::pushFrame() {
+    frames.push(frame);
+    frame.length = 0;
+}
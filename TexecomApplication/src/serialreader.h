@@ -0,0 +1,51 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __SERIALREADER_H_
+#define __SERIALREADER_H_
+
+#include "Particle.h"
+#include "spscqueue.h"
+
+// Bytes read from the panel, up to and including a CR LF. Frames are split
+// at CR LF only, the engine still decides where a Simple message ends as
+// its binary payload can contain CR LF.
+struct SerialFrame {
+    static const uint8_t maxLength = 104;  // a whole maximum size message
+    uint8_t length;
+    uint32_t startMillis;  // when the first byte was read
+    uint32_t startMicros;
+    char data[maxLength];
+};
+
+// Reads the panel serial port on its own thread so slow publishes and log
+// sends on the application loop can't hold up reading and overrun the
+// UART. Only the reader thread reads the stream once started, writes still
+// come from the loop.
+class SerialReader {
+ public:
+    explicit SerialReader(Stream &serial) : serial(serial) {}
+    void start();
+
+    // Loop side
+    bool pop(SerialFrame *frame) { return frames.pop(frame); }
+    uint8_t getHighWaterMark() const { return frames.getHighWaterMark(); }
+    uint32_t getOverruns() const { return frames.getOverruns(); }
+    void resetStats() { frames.resetStats(); }
+
+ private:
+    static void run(void *context);
+    void readFrames();
+    void pushFrame();
+
+    // Part frames are passed on once the line goes quiet, well inside the
+    // engine's 50ms message timeout
+    const uint32_t idleFlush = 20;  // ms
+
+    Stream &serial;
+    Thread *thread = NULL;
+    SerialFrame frame;
+    uint32_t lastByte = 0;
+    SpscQueue<SerialFrame, 8> frames;
+};
+
+#endif  // __SERIALREADER_H_
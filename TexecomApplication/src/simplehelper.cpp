@@ -1,6 +1,6 @@
 #include "simplehelper.h"
 
-SimpleHelper::SimpleHelper() {}
+SimpleHelper::SimpleHelper(Stream &serial) : serial(serial) {}
 
 bool SimpleHelper::checkSimpleChecksum(const char *text, uint8_t length) {
     unsigned int a = 0;
@@ -15,11 +15,11 @@ void SimpleHelper::sendSimpleMessage(const char *text, uint8_t length) {
     unsigned int a = 0;
     for (unsigned int i = 0; i < length; i++) {
         a += text[i];
-        texSerial.write(text[i]);
+        serial.write(text[i]);
         // Log.info("Message: %d", text[i]);
     }
     char checksum = (a ^ 255) % 0x100;
-    texSerial.write(checksum);
+    serial.write(checksum);
     // Log.info("Message: %d", checksum);
 }
 
@@ -44,40 +44,81 @@ bool SimpleHelper::processReceivedTime(const char *message) {
     }
 }
 
-bool SimpleHelper::processReceivedZoneData(const char *message, uint8_t messageLength, uint8_t *zoneState) {
+// Bits 0-1 of the low byte are the zone state rather than flags
+static const uint16_t zoneStateFlags[4] = {
+    0,                          // Secure
+    SimpleHelper::ZONE_ACTIVE,  // Active
+    SimpleHelper::ZONE_TAMPER,  // Tamper
+    SimpleHelper::ZONE_SHORT,   // Short
+};
 
-    for (uint8_t i = 0; i < messageLength; i+=2) {
-        uint8_t lowByte = message[i];
-        // uint8_t HighByte = message[i+1];
+// ZONE_FLAGS for each remaining bit of the status, low byte then high byte.
+// Bits with no known meaning map to 0.
+static const uint16_t zoneStatusFlags[16] = {
+    0, 0,
+    SimpleHelper::ZONE_FAULT,
+    SimpleHelper::ZONE_FAILED_TEST,
+    SimpleHelper::ZONE_ALARMED,
+    SimpleHelper::ZONE_MANUAL_BYPASS,
+    SimpleHelper::ZONE_AUTO_BYPASS,
+    0,
+    SimpleHelper::ZONE_ALARM_MEMORY,
+    SimpleHelper::ZONE_SOAK_TEST,
+    0, 0, 0, 0, 0, 0,
+};
 
-        zoneState[i/2] = lowByte;
+bool SimpleHelper::processReceivedZoneData(const char *message, uint8_t messageLength, uint16_t *zoneState) {
+    for (uint8_t i = 0; i + 1 < messageLength; i+=2) {
+        uint16_t status = (uint8_t)message[i] | ((uint8_t)message[i+1] << 8);
+        uint16_t flags = zoneStateFlags[status & 0x3];
 
-        /*
-        bool a1 = (lowByte & 0x1) != 0;
-        bool a2 = (lowByte & 0x2) != 0;
-        bool a3 = (lowByte & 0x4) != 0;
-        bool a4 = (lowByte & 0x8) != 0;
-        bool a5 = (lowByte & 0x10) != 0;
-        bool a6 = (lowByte & 0x20) != 0;
-        bool a7 = (lowByte & 0x40) != 0;
-        bool a8 = (lowByte & 0x80) != 0;
+        // Mask each entry with all ones or all zeros from the status bit
+        for (uint8_t bit = 2; bit < 16; bit++)
+            flags |= zoneStatusFlags[bit] & -((status >> bit) & 1);
 
-        bool b1 = (HighByte & 0x1) != 0;
-        bool b2 = (HighByte & 0x2) != 0;
-        bool b3 = (HighByte & 0x4) != 0;
-        bool b4 = (HighByte & 0x8) != 0;
-        bool b5 = (HighByte & 0x10) != 0;
-        bool b6 = (HighByte & 0x20) != 0;
-        bool b7 = (HighByte & 0x40) != 0;
-        bool b8 = (HighByte & 0x80) != 0;
+        zoneState[i/2] = flags;
+    }
+    return true;
+}
 
-        Log.info("Zone %d L - %d %d %d %d %d %d %d %d", (i/2)+9, a1, a2, a3, a4, a5, a6, a7, a8);
-        Log.info("Zone %d H - %d %d %d %d %d %d %d %d", (i/2)+9, b1, b2, b3, b4, b5, b6, b7, b8);
-        */
+// Reply to \I/ is the panel description, e.g. "Premier Elite 48 V4.02.01".
+// Returns the number of zones the panel supports or 0 if it isn't recognised.
+uint16_t SimpleHelper::processReceivedIdentification(const char *message, uint8_t messageLength) {
+    uint8_t i = 0;
+    while (i < messageLength && !isdigit(message[i]))
+        i++;
 
+    uint16_t model = 0;
+    while (i < messageLength && isdigit(message[i]))
+        model = model * 10 + (message[i++] - '0');
 
-    }
-    return true;
+    Log.info("Panel identification: %.*s", messageLength, message);
+
+    // Premier 412, 816 and 832 are named expansion-max, all others by max zones
+    if (model == 412 || model == 816 || model == 832)
+        return model % 100;
+    return model;
+}
+
+// Event records are type, group, parameter (LE) and a packed timestamp (LE)
+// of seconds:6, minutes:6, hours:5, day:5, month:4, years since 2000:6
+void SimpleHelper::decodeLogEvent(const char *record, LOG_EVENT *event) {
+    const uint8_t *data = (const uint8_t *)record;
+    event->type = data[0];
+    event->group = data[1];
+    event->parameter = data[2] | (data[3] << 8);
+
+    uint32_t packed = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+
+    struct tm t;
+    t.tm_sec = packed & 0x3F;
+    t.tm_min = (packed >> 6) & 0x3F;
+    t.tm_hour = (packed >> 12) & 0x1F;
+    t.tm_mday = (packed >> 17) & 0x1F;
+    t.tm_mon = ((packed >> 22) & 0xF) - 1;
+    t.tm_year = (packed >> 26) + 100;
+    t.tm_isdst = -1;
+    event->time = mktime(&t);
 }
 
 void SimpleHelper::simpleLogout() {
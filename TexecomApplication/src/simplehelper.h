@@ -5,8 +5,6 @@
 
 #include "Particle.h"
 
-#define texSerial Serial1
-
 class SimpleHelper {
  public:
    struct ZONE_STATE {
@@ -16,14 +14,43 @@ class SimpleHelper {
       bool hasFault;
    };
 
+   // One record from the panel event log
+   struct LOG_EVENT {
+      uint8_t type;
+      uint8_t group;
+      uint16_t parameter;
+      time_t time;
+   };
+
+   static const uint8_t logEventSize = 8;
+
+   // Zone status as decoded from both bytes of a zone read, also kept by
+   // the engine for Crestron zone events
+   typedef enum {
+      ZONE_ACTIVE = 1 << 0,
+      ZONE_TAMPER = 1 << 1,
+      ZONE_FAULT = 1 << 2,
+      ZONE_FAILED_TEST = 1 << 3,
+      ZONE_ALARMED = 1 << 4,
+      ZONE_MANUAL_BYPASS = 1 << 5,
+      ZONE_AUTO_BYPASS = 1 << 6,
+      ZONE_ALWAYS_ZERO = 1 << 7,
+      ZONE_SHORT = 1 << 8,
+      ZONE_ALARM_MEMORY = 1 << 9,
+      ZONE_SOAK_TEST = 1 << 10,
+   } ZONE_FLAGS;
+
  public:
-    SimpleHelper();
+    explicit SimpleHelper(Stream &serial);
     bool checkSimpleChecksum(const char *text, uint8_t length);
     void sendSimpleMessage(const char *text, uint8_t length);
     bool processReceivedTime(const char *message);
-    bool processReceivedZoneData(const char *message, uint8_t messageLength, uint8_t *zoneState);
+    bool processReceivedZoneData(const char *message, uint8_t messageLength, uint16_t *zoneState);
+    uint16_t processReceivedIdentification(const char *message, uint8_t messageLength);
+    void decodeLogEvent(const char *record, LOG_EVENT *event);
     void simpleLogout();
  private:
+    Stream &serial;
 };
 
  #endif  //__SIMPLEHELPER_H_
\ No newline at end of file
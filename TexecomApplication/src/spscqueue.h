@@ -0,0 +1,86 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __SPSCQUEUE_H_
+#define __SPSCQUEUE_H_
+
+#include "Particle.h"
+#include <atomic>
+
+// Single producer / single consumer queue, wait-free on both sides. Only
+// push() writes head and only pop() writes tail so no locking is needed.
+// The producer may be an interrupt or another thread.
+template<typename T, uint8_t Size>
+class SpscQueue {
+    static_assert((Size & (Size - 1)) == 0 && Size <= 128, "SpscQueue size must be a power of 2 up to 128");
+
+ public:
+    // Producer only
+    bool push(const T &item) {
+        uint8_t h = head.load(std::memory_order_relaxed);
+        uint8_t next = (h + 1) & (Size - 1);
+        uint8_t t = tail.load(std::memory_order_acquire);
+
+        if (next == t) {
+            overflowed.store(true, std::memory_order_relaxed);
+            overruns.store(overruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        buffer[h] = item;
+        head.store(next, std::memory_order_release);
+
+        uint8_t used = (next - t) & (Size - 1);
+        if (used > highWaterMark.load(std::memory_order_relaxed))
+            highWaterMark.store(used, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Consumer only
+    bool pop(T *item) {
+        uint8_t t = tail.load(std::memory_order_relaxed);
+
+        if (t == head.load(std::memory_order_acquire))
+            return false;
+
+        *item = buffer[t];
+        tail.store((t + 1) & (Size - 1), std::memory_order_release);
+        return true;
+    }
+
+    bool isEmpty() const {
+        return tail.load(std::memory_order_relaxed) == head.load(std::memory_order_acquire);
+    }
+
+    // True once after items have been dropped because the queue was full
+    bool takeOverflow() { return overflowed.exchange(false); }
+
+    // Most items ever queued at once and items dropped, since the last reset.
+    // A reset racing push() can lose that one update, fine for statistics.
+    uint8_t getHighWaterMark() const { return highWaterMark.load(std::memory_order_relaxed); }
+    uint32_t getOverruns() const { return overruns.load(std::memory_order_relaxed); }
+    void resetStats() {
+        highWaterMark.store(0, std::memory_order_relaxed);
+        overruns.store(0, std::memory_order_relaxed);
+    }
+
+ private:
+    T buffer[Size];
+    std::atomic<uint8_t> head{0};
+    std::atomic<uint8_t> tail{0};
+    std::atomic<bool> overflowed{false};
+    std::atomic<uint8_t> highWaterMark{0};
+    std::atomic<uint32_t> overruns{0};
+};
+
+// A level change captured by a pin interrupt
+struct DigiEdge {
+    uint8_t input;
+    uint8_t level;
+    uint32_t micros;
+};
+
+// Pin interrupts to loop
+template<uint8_t Size>
+using EdgeQueue = SpscQueue<DigiEdge, Size>;
+
+#endif  // __SPSCQUEUE_H_
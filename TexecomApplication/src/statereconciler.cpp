@@ -0,0 +1,92 @@
+// Copyright 2020 Kevin Cooper
+
+#include "statereconciler.h"
+#include "binarylog.h"
+
+static const char *sourceNames[] = { "Digi", "Crestron" };
+static const char *eventNames[] = { "Armed", "Disarmed", "Entry", "Exit", "Triggered" };
+
+StateReconciler::StateReconciler() {
+    clearPending();
+    resetStats();
+}
+
+void StateReconciler::observe(SOURCE source, EVENT event, uint32_t timestamp) {
+    SOURCE other = source == SOURCE_DIGI ? SOURCE_CRESTRON : SOURCE_DIGI;
+    uint8_t bit = 1 << event;
+
+    if ((pending[other] & bit) && timestamp - pendingTime[other][event] <= matchWindow) {
+        pending[other] &= ~bit;
+        recordLag(other, timestamp - pendingTime[other][event]);
+        mismatch = false;
+    } else {
+        pending[source] |= bit;
+        pendingTime[source][event] = timestamp;
+    }
+}
+
+// Returns true if the mismatch state changed
+bool StateReconciler::loop(uint32_t now) {
+    bool wasMismatch = mismatch;
+
+    for (uint8_t source = 0; source < SOURCE_COUNT; source++) {
+        if (pending[source] == 0)
+            continue;
+
+        for (uint8_t event = 0; event < EVENT_COUNT; event++) {
+            uint8_t bit = 1 << event;
+            if (!(pending[source] & bit) || now - pendingTime[source][event] <= matchWindow)
+                continue;
+
+            pending[source] &= ~bit;
+            mismatchCount++;
+            mismatch = true;
+            TLOG_ERROR("Alarm state %s only reported by %s", eventNames[event], sourceNames[source]);
+        }
+    }
+
+    return mismatch != wasMismatch;
+}
+
+// Transitions seen while the other source can't report them are dropped
+void StateReconciler::clearPending() {
+    memset(pending, 0, sizeof(pending));
+}
+
+void StateReconciler::recordLag(SOURCE leader, uint32_t lag) {
+    LAG_STATS &s = stats[leader];
+
+    if (s.count == 0 || lag < s.minLag)
+        s.minLag = lag;
+    s.count++;
+    s.totalLag += lag;
+
+    uint8_t bucket = 0;
+    while (bucket < lagBuckets - 1 && lag >= (256UL << bucket))
+        bucket++;
+    s.histogram[bucket]++;
+}
+
+uint32_t StateReconciler::getAverageLag(SOURCE source) const {
+    return stats[source].count ? stats[source].totalLag / stats[source].count : 0;
+}
+
+// Upper bound of the bucket holding the 99th percentile
+uint32_t StateReconciler::getP99Lag(SOURCE source) const {
+    const LAG_STATS &s = stats[source];
+    if (s.count == 0)
+        return 0;
+
+    uint32_t target = s.count - s.count / 100;
+    uint32_t total = 0;
+    for (uint8_t bucket = 0; bucket < lagBuckets; bucket++) {
+        total += s.histogram[bucket];
+        if (total >= target)
+            return 256UL << bucket;
+    }
+    return 256UL << (lagBuckets - 1);
+}
+
+void StateReconciler::resetStats() {
+    memset(stats, 0, sizeof(stats));
+}
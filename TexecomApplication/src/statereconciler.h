@@ -0,0 +1,66 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __STATERECONCILER_H_
+#define __STATERECONCILER_H_
+
+#include "Particle.h"
+
+// Pairs up the alarm state transitions reported by the digi outputs and by
+// Crestron events, measuring how far one source lags the other and flagging
+// transitions that only one source reports.
+class StateReconciler {
+ public:
+    typedef enum {
+        SOURCE_DIGI = 0,
+        SOURCE_CRESTRON = 1,
+        SOURCE_COUNT = 2
+    } SOURCE;
+
+    // Crestron can't tell part and full armed apart so both are ARMED
+    typedef enum {
+        EVENT_ARMED = 0,
+        EVENT_DISARMED = 1,
+        EVENT_ENTRY = 2,
+        EVENT_EXIT = 3,
+        EVENT_TRIGGERED = 4,
+        EVENT_COUNT = 5
+    } EVENT;
+
+ public:
+    StateReconciler();
+    void observe(SOURCE source, EVENT event, uint32_t timestamp);
+    bool loop(uint32_t now);
+    void clearPending();
+
+    bool hasMismatch() const { return mismatch; }
+    uint32_t getMismatchCount() const { return mismatchCount; }
+
+    // Lag of the other source, in microseconds, when source saw the transition first
+    uint32_t getLeadCount(SOURCE source) const { return stats[source].count; }
+    uint32_t getMinLag(SOURCE source) const { return stats[source].count ? stats[source].minLag : 0; }
+    uint32_t getAverageLag(SOURCE source) const;
+    uint32_t getP99Lag(SOURCE source) const;
+    void resetStats();
+
+ private:
+    // Bucket n counts lags below 256us << n, the last also takes anything longer
+    static const uint8_t lagBuckets = 16;
+    const uint32_t matchWindow = 3000000;  // 3 seconds
+
+    struct LAG_STATS {
+        uint32_t count;
+        uint32_t minLag;
+        uint64_t totalLag;
+        uint32_t histogram[lagBuckets];
+    };
+
+    void recordLag(SOURCE leader, uint32_t lag);
+
+    uint32_t pendingTime[SOURCE_COUNT][EVENT_COUNT];
+    uint8_t pending[SOURCE_COUNT];  // one bit per EVENT
+    LAG_STATS stats[SOURCE_COUNT];
+    uint32_t mismatchCount = 0;
+    bool mismatch = false;
+};
+
+#endif  // __STATERECONCILER_H_
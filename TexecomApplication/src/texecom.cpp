@@ -2,10 +2,53 @@
 
 #include "texecom.h"
 #include "TimeAlarms.h"
+#include "binarylog.h"
+#include "digistate.h"
+#include "metrics.h"
+#include "tracecapture.h"
+
+static_assert(DIGI_BIT_FULL_ARMED == 1 << TexecomClass::DIGI_FULL_ARMED &&
+              DIGI_BIT_PART_ARMED == 1 << TexecomClass::DIGI_PART_ARMED &&
+              DIGI_BIT_EXIT == 1 << TexecomClass::DIGI_EXIT &&
+              DIGI_BIT_ENTRY == 1 << TexecomClass::DIGI_ENTRY &&
+              DIGI_BIT_TRIGGERED == 1 << TexecomClass::DIGI_TRIGGERED &&
+              DIGI_BIT_ARM_FAILED == 1 << TexecomClass::DIGI_ARM_FAILED &&
+              DIGI_BIT_FAULT_PRESENT == 1 << TexecomClass::DIGI_FAULT_PRESENT &&
+              DIGI_BIT_AREA_READY == 1 << TexecomClass::DIGI_AREA_READY,
+              "digistate.h bits must match DIGI_OUTPUT");
+static_assert(digiStateTable[DIGI_BIT_TRIGGERED | DIGI_BIT_FULL_ARMED].state == TexecomClass::TRIGGERED &&
+              digiStateTable[DIGI_BIT_EXIT].state == TexecomClass::EXIT &&
+              digiStateTable[DIGI_BIT_ENTRY].state == TexecomClass::ENTRY &&
+              digiStateTable[DIGI_BIT_PART_ARMED].state == TexecomClass::ARMED_HOME &&
+              digiStateTable[DIGI_BIT_FULL_ARMED].state == TexecomClass::ARMED_AWAY &&
+              digiStateTable[0].state == TexecomClass::DISARMED,
+              "digistate.h states must match ALARM_STATE");
+static_assert(digiStateTable[DIGI_BIT_AREA_READY].flags == TexecomClass::ALARM_READY &&
+              digiStateTable[DIGI_BIT_FAULT_PRESENT].flags == TexecomClass::ALARM_FAULT &&
+              digiStateTable[DIGI_BIT_ARM_FAILED].flags == TexecomClass::ALARM_ARM_FAILED,
+              "digistate.h flags must match ALARM_FLAGS");
+
+// Next panel event log record to read. Retained so reads carry on from where
+// they left off after a reset, the check word catches a cold start.
+retained uint16_t eventLogIndexes[TexecomClass::maxPanels];
+retained uint16_t eventLogIndexChecks[TexecomClass::maxPanels];
+
+TexecomClass *TexecomClass::digiOwner = NULL;
+
+// Each panel runs at most one Crestron and one Simple conversation at a time
+static TaskPool<TexecomClass, TexecomClass::TASK_STEP_RESULT, TexecomClass::maxPanels * 2> taskPool;
+static_assert(TexecomClass::SIMPLE_TIME_CHECK_OUT < 32, "Task results must fit a wait mask");
+
+// An out of range panel would share another's EEPROM block and retained
+// slots, so the instance is left invalid and setup and loop do nothing
+TexecomClass::TexecomClass(Stream &serial, uint8_t panel) :
+    simpleHelper(serial), crestronHelper(serial), serial(serial),
+    panel(panel < maxPanels ? panel : 0), valid(panel < maxPanels) {
+    if (!valid)
+        Log.error("Panel %u is out of range, at most %u are supported", panel, maxPanels);
+}
 
-TexecomClass::TexecomClass() {}
-
-void TexecomClass::setZoneCallback(void (*zoneCallback)(uint8_t, uint8_t)) {
+void TexecomClass::setZoneCallback(void (*zoneCallback)(uint16_t, uint16_t)) {
     this->zoneCallback = zoneCallback;
 }
 
@@ -13,42 +56,156 @@ void TexecomClass::setAlarmCallback(void (*alarmCallback)(TexecomClass::ALARM_ST
     this->alarmCallback = alarmCallback;
 }
 
+void TexecomClass::setEventLogCallback(bool (*eventLogCallback)(uint16_t, const SimpleHelper::LOG_EVENT&)) {
+    this->eventLogCallback = eventLogCallback;
+}
+
+void TexecomClass::setTriggeredCallback(bool (*triggeredCallback)(uint16_t)) {
+    this->triggeredCallback = triggeredCallback;
+}
+
+void TexecomClass::setAreaCallback(void (*areaCallback)(uint8_t, TexecomClass::ALARM_STATE)) {
+    this->areaCallback = areaCallback;
+}
+
 void TexecomClass::setDebug(bool enabled) {
     savedData.isDebug = enabled;
-    EEPROM.put(0, savedData);
+    EEPROM.put(eepromAddress(0), savedData);
 }
 
 void TexecomClass::setUDLCode(const char *code) {
     if (strlen(code) == 6) {
         strcpy(savedData.udlCode, code);
-        EEPROM.put(0, savedData);
+        EEPROM.put(eepromAddress(0), savedData);
     }
-    Log.info("New UDL code = %s", savedData.udlCode);
+    TLOG_INFO("New UDL code = %s", savedData.udlCode);
 }
 
-void TexecomClass::requestTimeSync() { Alarm.timerOnce(1, startTimeSync); }
+void TexecomClass::requestTimeSync() { Alarm.timerOnce(1, startTimeSync, this); }
 
-void TexecomClass::startTimeSync() { Texecom.syncTime(); }
+// Simple work is handed to the session so the alarm completes straight away
+void TexecomClass::startTimeSync(void *context) {
+    TexecomClass *texecom = static_cast<TexecomClass*>(context);
+    texecom->syncTime();
+    Alarm.completeTriggeredAlarm();
+}
 
 void TexecomClass::syncTime() {
-    simpleTask = SIMPLE_CHECK_TIME;
-    taskStep = SIMPLE_LOGIN_REQUIRED;
-    simpleLogin(RESULT_NONE);
+    queueSimpleWork(SIMPLE_WORK_TIME);
 }
 
-void TexecomClass::requestZoneSync() { Alarm.timerOnce(1, startZoneSync); }
+void TexecomClass::requestZoneSync() { Alarm.timerOnce(1, startZoneSync, this); }
 
-void TexecomClass::startZoneSync() { Texecom.syncZones(); }
+void TexecomClass::startZoneSync(void *context) {
+    TexecomClass *texecom = static_cast<TexecomClass*>(context);
+    texecom->syncZones();
+    Alarm.completeTriggeredAlarm();
+}
 
 void TexecomClass::syncZones() {
-    simpleTask = SIMPLE_ZONE_CHECK;
-    taskStep = SIMPLE_LOGIN_REQUIRED;
-    simpleLogin(RESULT_NONE);
+    queueSimpleWork(SIMPLE_WORK_ZONES);
+}
+
+// Ask the panel for its size then scan every zone for ones in use
+void TexecomClass::requestZoneLearn() { Alarm.timerOnce(1, startZoneLearn, this); }
+
+void TexecomClass::startZoneLearn(void *context) {
+    TexecomClass *texecom = static_cast<TexecomClass*>(context);
+    texecom->queueSimpleWork(SIMPLE_WORK_IDENTIFY);
+    Alarm.completeTriggeredAlarm();
+}
+
+void TexecomClass::requestEventLogRead() { Alarm.timerOnce(1, startEventLogRead, this); }
+
+void TexecomClass::startEventLogRead(void *context) {
+    TexecomClass *texecom = static_cast<TexecomClass*>(context);
+    texecom->queueSimpleWork(SIMPLE_WORK_EVENT_LOG);
+    Alarm.completeTriggeredAlarm();
+}
+
+void TexecomClass::saveZoneConfig() {
+    ZONE_CONFIG zoneConfig;
+    zoneConfig.magic = zoneConfigMagic;
+    zoneConfig.capacity = zones.getCapacity();
+    zoneConfig.firstZone = zones.getFirstZone();
+    zoneConfig.lastZone = zones.getLastZone();
+    EEPROM.put(eepromAddress(zoneConfigAddress), zoneConfig);
+}
+
+// Work queued while a session is open is run before logging out
+void TexecomClass::queueSimpleWork(SIMPLE_WORK work) {
+    simpleWork |= work;
+
+    if (simpleTask == SIMPLE_IDLE)
+        startSimpleSession();
+}
+
+void TexecomClass::startSimpleSession() {
+    if (simpleWork == 0 || simpleTask != SIMPLE_IDLE || crestronTask != CRESTRON_IDLE ||
+            (lastJobCompleted != 0 && millis() - lastJobCompleted < panelJobSpacing))
+        return;
+
+    simpleSessionStart = millis();
+    simpleTask = nextSimpleTask();
+    reconciler.clearPending();
+
+    if (!startTask(&simpleSession, &TexecomClass::simpleSessionTask))
+        simpleTask = SIMPLE_IDLE;
+}
+
+TexecomClass::SIMPLE_TASK TexecomClass::nextSimpleTask() {
+    if (simpleWork & SIMPLE_WORK_IDENTIFY)
+        return SIMPLE_IDENTIFY;
+    else if (simpleWork & SIMPLE_WORK_ZONE_SCAN)
+        return SIMPLE_ZONE_SCAN;
+    else if (simpleWork & SIMPLE_WORK_ZONES)
+        return SIMPLE_ZONE_CHECK;
+    else if (simpleWork & SIMPLE_WORK_TIME)
+        return SIMPLE_CHECK_TIME;
+    else if (simpleWork & SIMPLE_WORK_EVENT_LOG)
+        return SIMPLE_EVENT_LOG;
+    return SIMPLE_IDLE;
+}
+
+// Clears the work the current command was doing
+void TexecomClass::finishSimpleTask() {
+    simpleCommandCount++;
+
+    if (simpleTask == SIMPLE_CHECK_TIME)
+        simpleWork &= ~SIMPLE_WORK_TIME;
+    else if (simpleTask == SIMPLE_ZONE_CHECK)
+        simpleWork &= ~SIMPLE_WORK_ZONES;
+    else if (simpleTask == SIMPLE_IDENTIFY)
+        simpleWork &= ~SIMPLE_WORK_IDENTIFY;
+    else if (simpleTask == SIMPLE_ZONE_SCAN)
+        simpleWork &= ~SIMPLE_WORK_ZONE_SCAN;
+    else if (simpleTask == SIMPLE_EVENT_LOG)
+        simpleWork &= ~SIMPLE_WORK_EVENT_LOG;
+}
+
+void TexecomClass::endSimpleSession() {
+    activeProtocol = CRESTRON;
+    simpleTask = SIMPLE_IDLE;
+    lastJobCompleted = millis();
+
+    // Serial time spent in Simple mode, during which Crestron events are missed
+    simpleModeTime += millis() - simpleSessionStart;
+    simpleSessionCount++;
+
+    if (millis() - simpleStatsStart >= 3600000) {
+        simpleModeTimeLastHour = simpleModeTime;
+        TLOG_INFO("SIMPLE: %lu ms in Simple mode over the last hour, %u sessions, %u commands",
+            simpleModeTime, simpleSessionCount, simpleCommandCount);
+        simpleStatsStart = millis();
+        simpleModeTime = 0;
+        simpleSessionCount = 0;
+        simpleCommandCount = 0;
+    }
 }
 
 void TexecomClass::requestDisarm(const char *code) {
     if (strlen(userPin) > 0) {
-        Log.info("DISARM: Request already in progress");
+        TLOG_INFO("DISARM: Request already in progress");
         return;
     }
 
@@ -57,22 +214,25 @@ void TexecomClass::requestDisarm(const char *code) {
     else
         return;
 
-    Alarm.timerOnce(1, startDisarm);
+    Alarm.timerOnce(1, startDisarm, this);
 }
 
-void TexecomClass::startDisarm() {
-    Texecom.disarm();
+void TexecomClass::startDisarm(void *context) {
+    TexecomClass *texecom = static_cast<TexecomClass*>(context);
+    if (texecom->beginJob())
+        texecom->disarm();
 }
 
 void TexecomClass::disarm() {
     crestronTask = CRESTRON_DISARM;
     taskStep = CRESTRON_START;
-    disarmSystem(RESULT_NONE);
+    if (!startTask(&crestronSession, &TexecomClass::disarmTask))
+        abortCrestronTask();
 }
 
 void TexecomClass::requestArm(const char *code, ARM_TYPE type) {
     if (strlen(userPin) > 0) {
-        Log.info("ARM: Request already in progress");
+        TLOG_INFO("ARM: Request already in progress");
         return;
     }
 
@@ -82,420 +242,722 @@ void TexecomClass::requestArm(const char *code, ARM_TYPE type) {
         return;
 
     armType = type;
-    Alarm.timerOnce(1, startArm);
+    Alarm.timerOnce(1, startArm, this);
 }
 
-void TexecomClass::startArm() {
-    Texecom.arm();
+void TexecomClass::startArm(void *context) {
+    TexecomClass *texecom = static_cast<TexecomClass*>(context);
+    if (texecom->beginJob())
+        texecom->arm();
 }
 
 void TexecomClass::arm() {
     crestronTask = CRESTRON_ARM;
     taskStep = CRESTRON_START;
-    armSystem(RESULT_NONE);
+    if (!startTask(&crestronSession, &TexecomClass::armTask))
+        abortCrestronTask();
+}
+
+// Called from an alarm handler. Takes ownership of the triggered alarm, or
+// hands it back to be retried if another panel job is still running.
+bool TexecomClass::beginJob() {
+    AlarmToken_t token = Alarm.getTriggeredAlarmToken();
+
+    if (crestronTask != CRESTRON_IDLE || simpleTask != SIMPLE_IDLE ||
+            (lastJobCompleted != 0 && millis() - lastJobCompleted < panelJobSpacing)) {
+        Alarm.postpone(token, busyRetryDelay);
+        return false;
+    }
+
+    activeJob = token;
+    Alarm.setJobTimeoutHandler(Alarm.getTriggeredAlarmId(), jobTimedOut);
+    return true;
+}
+
+void TexecomClass::completeJob() {
+    Alarm.complete(activeJob);
+    activeJob = dtINVALID_ALARM_TOKEN;
+    lastJobCompleted = millis();
+}
+
+// The alarm has completed the job for us, so whatever the session was
+// waiting for isn't coming. Drop it or beginJob() would put off every job
+// that follows.
+void TexecomClass::jobTimedOut(void *context) {
+    static_cast<TexecomClass*>(context)->abortJob();
+}
+
+void TexecomClass::abortJob() {
+    TLOG_ERROR("JOB: Timed out, abandoning the panel session");
+    activeJob = dtINVALID_ALARM_TOKEN;
+
+    if (crestronSession) {
+        crestronSession->finish();
+        crestronSession = NULL;
+    }
+    if (crestronTask != CRESTRON_IDLE)
+        abortCrestronTask();
+
+    if (simpleSession) {
+        simpleSession->finish();
+        simpleSession = NULL;
+    }
+    if (simpleTask != SIMPLE_IDLE) {
+        simpleHelper.sendSimpleMessage("\\H/", 3);
+        simpleWork = 0;
+        endSimpleSession();
+    }
 }
 
 void TexecomClass::delayCommand(CrestronHelper::CRESTRON_COMMAND command, int delay) {
     delayedCommand = command;
-    delayedCommandExecuteTime = millis() + delay;
+    Alarm.startMs(delayedCommandTimer, delay);
+}
+
+void TexecomClass::executeDelayedCommand(void *context) {
+    TexecomClass *texecom = static_cast<TexecomClass*>(context);
+    texecom->crestronHelper.request(texecom->delayedCommand);
+}
+
+// HANDLE CRESTON LOGIN VIA KEYPRESS ON VIRTUAL SCREEN
+void TexecomClass::startPinEntry() {
+    taskStep = CRESTRON_LOGIN;
+    cacheScreen(RESULT_NONE);
+    loginPinPosition = 0;
+    Alarm.startMs(pinEntryTimer, 0);
+}
+
+void TexecomClass::sendNextPinDigit(void *context) {
+    TexecomClass *texecom = static_cast<TexecomClass*>(context);
+    if (texecom->taskStep != CRESTRON_LOGIN)
+        return;
+
+    texecom->serial.print("KEY");
+    texecom->serial.println(texecom->userPin[texecom->loginPinPosition++]);
+    texecom->pinKeySentTime = millis();
+
+    if (texecom->loginPinPosition >= strlen(texecom->userPin)) {
+        texecom->loginPinPosition = 0;
+        texecom->processTask(CRESTRON_LOGIN_COMPLETE);
+    } else {
+        // Fallback if the panel doesn't acknowledge the key
+        Alarm.startMs(texecom->pinEntryTimer, texecom->PIN_ENTRY_DELAY);
+    }
+}
+
+void TexecomClass::pinKeyAcknowledged() {
+    if (taskStep != CRESTRON_LOGIN || loginPinPosition == 0)
+        return;
+
+    uint32_t elapsed = millis() - pinKeySentTime;
+    Alarm.startMs(pinEntryTimer, elapsed < minAckedKeyGap ? minAckedKeyGap - elapsed : 0);
+}
+
+// SWITCH TO SIMPLE PROTOCOL BY SENDING
+// THE UDL CODE AS \W1234/ TWICE
+void TexecomClass::sendSimpleLogin() {
+    TLOG_INFO("SIMPLE: Performing simple login");
+
+    char loginData[9];
+    loginData[0] = '\\';
+    loginData[1] = 'W';
+    for (int i = 0; i < 6; i++)
+        loginData[2+i] = savedData.udlCode[i];
+    loginData[8] = '/';
+
+    simpleHelper.sendSimpleMessage(loginData, 9);
 }
 
 void TexecomClass::updateAlarmState() {
+    // Without the digi outputs the state is keypadArea's, which isn't known
+    // until Crestron has reported it
+    if (digiOwner != this && !areas.isKnown(keypadArea))
+        return;
+
     if (alarmCallback)
         alarmCallback(alarmState, alarmStateFlags);
+
+    // The digi outputs tell part from full arm, Crestron events don't
+    if (digiOwner == this)
+        areas.set(keypadArea, alarmState);
     
     if (alarmState == TRIGGERED) {
-        Alarm.timerOnce(1, startZoneSync);
+        Alarm.timerOnce(1, startZoneSync, this);
     }
 }
 
 void TexecomClass::decodeZoneState(char *message) {
-    uint8_t zone;
+    uint16_t zone;
     uint8_t state;
 
     char zoneChar[4];
     memcpy(zoneChar, &message[2], 3);
     zoneChar[3] = '\0';
-    zone = atoi(zoneChar) - firstZone;
+    zone = atoi(zoneChar);
+
+    if (!zones.isValid(zone)) {
+        TLOG_INFO("Zone %d is outside the zone table", zone);
+        return;
+    }
+
+    // Seen now so the scan keeps it whatever state it's in by then
+    if (!zones.isInstalled(zone)) {
+        TLOG_INFO("ZONE: Zone %d is outside the learnt range, rescanning", zone);
+        noteZoneInUse(zone);
+        queueSimpleWork(SIMPLE_WORK_ZONE_SCAN);
+        return;
+    }
 
     state = message[5] - '0';
 
     if (state == 0) { // Healthy
-        zoneStates[zone] &= ~ZONE_ACTIVE;
-        zoneStates[zone] &= ~ZONE_TAMPER;
+        zones.update(zone, 0, SimpleHelper::ZONE_ACTIVE | SimpleHelper::ZONE_TAMPER | SimpleHelper::ZONE_SHORT);
     } else if (state == 1) { // Active
-        zoneStates[zone] |= ZONE_ACTIVE;
-        zoneStates[zone] &= ~ZONE_TAMPER;
+        zones.update(zone, SimpleHelper::ZONE_ACTIVE, SimpleHelper::ZONE_TAMPER | SimpleHelper::ZONE_SHORT);
     } else if (state == 2) { // Tamper
-        zoneStates[zone] &= ~ZONE_ACTIVE;
-        zoneStates[zone] |= ZONE_TAMPER;
+        zones.update(zone, SimpleHelper::ZONE_TAMPER, SimpleHelper::ZONE_ACTIVE | SimpleHelper::ZONE_SHORT);
     }
 
+    if (zones.get(zone) != 0)
+        noteZoneInUse(zone);
     updateZoneState(zone);
 }
 
-void TexecomClass::updateZoneState(uint8_t zone) {
-    if (zoneCallback)
-        zoneCallback(zone+firstZone, zoneStates[zone]);
+void TexecomClass::updateZoneState(uint16_t zone) {
+    if (zoneCallback && zones.isInstalled(zone))
+        zoneCallback(zone, zones.get(zone));
 }
 
 void TexecomClass::processTask(TASK_STEP_RESULT result) {
-    if (result == CRESTRON_TASK_TIMEOUT)
-        Log.info("processTask: Task timed out");
+    if (activeProtocol == SIMPLE || taskStep == SIMPLE_LOGIN)
+        resumeTask(&simpleSession, result);
+    else
+        resumeTask(&crestronSession, result);
+}
 
-    if (taskStep == SIMPLE_LOGIN) {
-        simpleLogin(result);
-    } else if (activeProtocol == SIMPLE) {
-        if (simpleTask == SIMPLE_CHECK_TIME) {
-            checkTime(result);
-        } else if (simpleTask == SIMPLE_ZONE_CHECK) {
-            zoneCheck(result);
-        }
-    } else if (activeProtocol == CRESTRON) {
-        if (crestronTask == CRESTRON_ARM) {
-            armSystem(result);
-        } else if (crestronTask == CRESTRON_DISARM) {
-            disarmSystem(result);
+bool TexecomClass::startTask(PanelTask **task, PanelTask::Body body) {
+    *task = taskPool.start(this, body);
+    if (*task == NULL) {
+        TLOG_ERROR("No free task frame, more panels than TEXECOM_MAX_PANELS?");
+        return false;
+    }
+
+    resumeTask(task, RESULT_NONE);
+    return true;
+}
+
+// Results the task isn't waiting for are dropped, the frame goes back to the
+// pool once the task has run to its end
+void TexecomClass::resumeTask(PanelTask **task, TASK_STEP_RESULT result) {
+    if (*task == NULL)
+        return;
+
+    (*task)->resume(result);
+    if (!(*task)->isRunning())
+        *task = NULL;
+}
+
+// THERE IS NO NOTIFICATION IF AN INCORRECT USER CODE IS ENTERED
+// WE HAVE TO RELY ON A TIMEOUT TO DETECT AN ARM OR DISARM FAILURE
+void TexecomClass::checkTaskTimeouts() {
+    uint32_t now = millis();
+
+    if (crestronSession && crestronSession->hasTimedOut(now)) {
+        TLOG_INFO("processTask: Task timed out");
+        crestronSession->expire(CRESTRON_TASK_TIMEOUT);
+        if (!crestronSession->isRunning())
+            crestronSession = NULL;
+    }
+
+    if (simpleSession && simpleSession->hasTimedOut(now)) {
+        simpleSession->expire(SIMPLE_TIMEOUT);
+        if (!simpleSession->isRunning())
+            simpleSession = NULL;
+    }
+}
+
+void TexecomClass::disarmTask(PanelTask &task) {
+    TASK_BEGIN(task);
+    TLOG_INFO("DISARM: Starting disarm process");
+    task.setTimeout(disarmTimeout);
+
+    taskStep = CRESTRON_CONFIRM_ARMED;
+    task.result = getCachedArmState();
+    if (task.result != RESULT_NONE) {
+        TLOG_INFO("DISARM: Using cached arm state");
+    } else {
+        crestronHelper.requestArmState();
+        TASK_AWAIT(task, task.bit(CRESTRON_IS_ARMED) | task.bit(CRESTRON_IS_DISARMED));
+    }
+
+    if (task.result != CRESTRON_IS_ARMED) {
+        if (task.result == CRESTRON_IS_DISARMED)
+            TLOG_INFO("DISARM: System already disarmed. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
+    }
+
+    TLOG_INFO("DISARM: Confirmed armed. Confirming idle screen");
+    taskStep = CRESTRON_CONFIRM_IDLE_SCREEN;
+    task.result = getCachedScreen();
+    if (task.result != RESULT_NONE) {
+        TLOG_INFO("DISARM: Using cached screen");
+    } else {
+        crestronHelper.requestScreen();
+        TASK_AWAIT(task, task.bit(CRESTRON_SCREEN_IDLE) | task.bit(CRESTRON_SCREEN_PART_ARMED) |
+                            task.bit(CRESTRON_SCREEN_FULL_ARMED) | task.bit(CRESTRON_SCREEN_AREA_ENTRY) |
+                            task.bit(CRESTRON_SCREEN_AREA_EXIT));
+    }
+
+    if (task.result != CRESTRON_SCREEN_IDLE &&
+            task.result != CRESTRON_SCREEN_PART_ARMED &&
+            task.result != CRESTRON_SCREEN_FULL_ARMED &&
+            task.result != CRESTRON_SCREEN_AREA_ENTRY) {
+        TLOG_INFO("DISARM: Screen is not idle. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
+    }
+
+    TLOG_INFO("DISARM: Idle screen confirmed. Starting login process");
+    startPinEntry();
+    TASK_AWAIT(task, task.bit(CRESTRON_LOGIN_COMPLETE));
+    if (task.result != CRESTRON_LOGIN_COMPLETE) {
+        TLOG_INFO("DISARM: Login failed. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
+    }
+
+    TLOG_INFO("DISARM: Login complete. Awaiting confirmed login");
+    taskStep = CRESTRON_LOGIN_WAIT;
+    TASK_AWAIT(task, task.bit(CRESTRON_LOGIN_CONFIRMED));
+    if (task.result != CRESTRON_LOGIN_CONFIRMED) {
+        TLOG_INFO("DISARM: Login failed to confirm. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
+    }
+
+    // In entry the panel disarms as soon as the code is accepted
+    if (alarmState != ENTRY) {
+        TLOG_INFO("DISARM: Login confirmed. Waiting for Disarm prompt");
+        taskStep = CRESTRON_WAIT_FOR_DISARM_PROMPT;
+        delayCommand(CrestronHelper::COMMAND_SCREEN_STATE, 500);
+        TASK_AWAIT(task, task.bit(CRESTRON_DISARM_PROMPT));
+        if (task.result != CRESTRON_DISARM_PROMPT) {
+            TLOG_INFO("DISARM: No Disarm prompt. Aborting");
+            abortCrestronTask();
+            TASK_EXIT(task);
         }
+
+        TLOG_INFO("DISARM: Disarm prompt confirmed, disarming");
+        if (!savedData.isDebug)
+            serial.println("KEYY");  // Yes
+    } else {
+        TLOG_INFO("DISARM: Login confirmed. Waiting for Disarm confirmation");
+    }
+
+    taskStep = CRESTRON_DISARM_REQUESTED;
+    TASK_AWAIT(task, task.bit(CRESTRON_IS_DISARMED));
+    if (task.result != CRESTRON_IS_DISARMED) {
+        TLOG_INFO("DISARM: Disarm not confirmed. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
     }
+
+    TLOG_INFO("DISARM: DISARM CONFIRMED");
+    finishCrestronTask();
+    TASK_END(task);
 }
 
-void TexecomClass::disarmSystem(TASK_STEP_RESULT result) {
-    switch (taskStep) {
-        case CRESTRON_START :
-            disarmStartTime = millis();
-            Log.info("DISARM: Starting disarm process");
-            taskStep = CRESTRON_CONFIRM_ARMED;
-            crestronHelper.requestArmState();
-            break;
+void TexecomClass::armTask(PanelTask &task) {
+    TASK_BEGIN(task);
+    if (armType == FULL_ARM)
+        TLOG_INFO("ARM: Starting full arm process");
+    else
+        TLOG_INFO("ARM: Starting night arm process");
+    task.setTimeout(armTimeout);
+
+    taskStep = CRESTRON_CONFIRM_DISARMED;
+    task.result = getCachedArmState();
+    if (task.result != RESULT_NONE) {
+        TLOG_INFO("ARM: Using cached arm state");
+    } else {
+        TLOG_INFO("ARM: Requesting arm state");
+        crestronHelper.requestArmState();
+        TASK_AWAIT(task, task.bit(CRESTRON_IS_ARMED) | task.bit(CRESTRON_IS_DISARMED));
+    }
 
-        case CRESTRON_CONFIRM_ARMED :
-            if (result == CRESTRON_IS_ARMED) {
-                Log.info("DISARM: Confirmed armed. Confirming idle screen");
-                taskStep = CRESTRON_CONFIRM_IDLE_SCREEN;
-                crestronHelper.requestScreen();
-            } else if (result == CRESTRON_IS_DISARMED) {
-                Log.info("DISARM: System already armed. Aborting");
-                abortCrestronTask();
-            } else {
-                abortCrestronTask();
-            }
-            break;
+    if (task.result != CRESTRON_IS_DISARMED) {
+        if (task.result == CRESTRON_IS_ARMED)
+            TLOG_INFO("ARM: System already armed. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
+    }
 
-        case CRESTRON_CONFIRM_IDLE_SCREEN :
-            if (
-                result == CRESTRON_SCREEN_IDLE ||
-                result == CRESTRON_SCREEN_PART_ARMED ||
-                result == CRESTRON_SCREEN_FULL_ARMED ||
-                result == CRESTRON_SCREEN_AREA_ENTRY) {
-                Log.info("DISARM: Idle screen confirmed. Starting login process");
-                taskStep = CRESTRON_LOGIN;
-            } else {
-                Log.info("DISARM: Screen is not idle. Aborting");
-                abortCrestronTask();
-            }
-            break;
+    TLOG_INFO("ARM: Confirmed disarmed. Confirming idle screen");
+    taskStep = CRESTRON_CONFIRM_IDLE_SCREEN;
+    task.result = getCachedScreen();
+    if (task.result != RESULT_NONE) {
+        TLOG_INFO("ARM: Using cached screen");
+    } else {
+        crestronHelper.requestScreen();
+        TASK_AWAIT(task, task.bit(CRESTRON_SCREEN_IDLE) | task.bit(CRESTRON_SCREEN_PART_ARMED) |
+                            task.bit(CRESTRON_SCREEN_FULL_ARMED) | task.bit(CRESTRON_SCREEN_AREA_ENTRY) |
+                            task.bit(CRESTRON_SCREEN_AREA_EXIT));
+    }
 
-        case CRESTRON_LOGIN:
-            if (result == CRESTRON_LOGIN_COMPLETE) {
-                Log.info("DISARM: Login complete. Awaiting confirmed login");
-                taskStep = CRESTRON_LOGIN_WAIT;
-            } else {
-                Log.info("DISARM: Login failed. Aborting");
-                abortCrestronTask();
-            }
-            break;
+    if (task.result != CRESTRON_SCREEN_IDLE) {
+        TLOG_INFO("ARM: Screen is not idle. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
+    }
 
-        case CRESTRON_LOGIN_WAIT :
-            if (result == CRESTRON_LOGIN_CONFIRMED) {
-                if (alarmState != ENTRY) {
-                    Log.info("DISARM: Login confirmed. Waiting for Disarm prompt");
-                    taskStep = CRESTRON_WAIT_FOR_DISARM_PROMPT;
-                    delayCommand(CrestronHelper::COMMAND_SCREEN_STATE, 500);
-                } else {
-                    Log.info("DISARM: Login confirmed. Waiting for Disarm confirmation");
-                    taskStep = CRESTRON_DISARM_REQUESTED;
-                }
-            } else {
-                Log.info("DISARM: Login failed to confirm. Aborting");
-                abortCrestronTask();
-            }
-            break;
+    TLOG_INFO("ARM: Idle screen confirmed. Starting login process");
+    startPinEntry();
+    TASK_AWAIT(task, task.bit(CRESTRON_LOGIN_COMPLETE));
+    if (task.result != CRESTRON_LOGIN_COMPLETE) {
+        TLOG_INFO("ARM: Login failed. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
+    }
 
-        case CRESTRON_WAIT_FOR_DISARM_PROMPT :
-            if (result == CRESTRON_DISARM_PROMPT) {
-                Log.info("DISARM: Disarm prompt confirmed, disarming");
-                if (!savedData.isDebug)
-                    texSerial.println("KEYY");  // Yes
+    TLOG_INFO("ARM: Login complete. Awaiting confirmed login");
+    taskStep = CRESTRON_LOGIN_WAIT;
+    TASK_AWAIT(task, task.bit(CRESTRON_LOGIN_CONFIRMED));
+    if (task.result != CRESTRON_LOGIN_CONFIRMED) {
+        TLOG_INFO("ARM: Login failed to confirm. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
+    }
 
-                taskStep = CRESTRON_DISARM_REQUESTED;
-            } else {
-                Log.info("DISARM: Unexpected result at WAIT_FOR_DISARM_PROMPT. Aborting");
-                abortCrestronTask();
-            }
-            break;
+    TLOG_INFO("ARM: Login confirmed. Waiting for Arm prompt");
+    taskStep = CRESTRON_WAIT_FOR_ARM_PROMPT;
+    delayCommand(CrestronHelper::COMMAND_SCREEN_STATE, 500);
+    TASK_AWAIT(task, task.bit(CRESTRON_FULL_ARM_PROMPT));
+    if (task.result != CRESTRON_FULL_ARM_PROMPT) {
+        TLOG_INFO("ARM: No Arm prompt. Aborting");
+        abortCrestronTask();
+        TASK_EXIT(task);
+    }
 
-        case CRESTRON_DISARM_REQUESTED :
-            if (result == CRESTRON_IS_DISARMED) {
-                Log.info("DISARM: DISARM CONFIRMED");
-                crestronTask = CRESTRON_IDLE;
-                memset(userPin, 0, sizeof userPin);
-                disarmStartTime = 0;
-                Alarm.completeTriggeredAlarm();
-            } else {
-                Log.info("DISARM: Unexpected result at DISARM_REQUESTED. Aborting");
-                abortCrestronTask();
-            }
-            break;
+    // Night arm is two menus down from full arm
+    if (armType == NIGHT_ARM) {
+        TLOG_INFO("ARM: Full arm prompt confirmed, waiting for part arm prompt");
+        taskStep = CRESTRON_WAIT_FOR_PART_ARM_PROMPT;
+        serial.println("KEYD");  // Down
+        delayCommand(CrestronHelper::COMMAND_SCREEN_STATE, 500);
+        TASK_AWAIT(task, task.bit(CRESTRON_PART_ARM_PROMPT));
+        if (task.result != CRESTRON_PART_ARM_PROMPT) {
+            TLOG_INFO("ARM: No Part arm prompt. Aborting");
+            abortCrestronTask();
+            TASK_EXIT(task);
+        }
+
+        TLOG_INFO("ARM: Part arm prompt confirmed, waiting for night arm prompt");
+        taskStep = CRESTRON_WAIT_FOR_NIGHT_ARM_PROMPT;
+        serial.println("KEYY");  // Yes
+        delayCommand(CrestronHelper::COMMAND_SCREEN_STATE, 500);
+        TASK_AWAIT(task, task.bit(CRESTRON_NIGHT_ARM_PROMPT));
+        if (task.result != CRESTRON_NIGHT_ARM_PROMPT) {
+            TLOG_INFO("ARM: No Night arm prompt. Aborting");
+            abortCrestronTask();
+            TASK_EXIT(task);
+        }
+
+        TLOG_INFO("ARM: Night arm prompt confirmed, Completing part arm");
+    } else {
+        TLOG_INFO("ARM: Full arm prompt confirmed, completing full arm");
     }
 
-    if (result == CRESTRON_TASK_TIMEOUT && crestronTask != CRESTRON_IDLE)
+    if (!savedData.isDebug)
+        serial.println("KEYY");  // Yes
+
+    taskStep = CRESTRON_ARM_REQUESTED;
+    TASK_AWAIT(task, task.bit(CRESTRON_IS_ARMING));
+    if (task.result != CRESTRON_IS_ARMING) {
+        TLOG_INFO("ARM: Arming not confirmed. Aborting");
         abortCrestronTask();
+        TASK_EXIT(task);
+    }
+
+    TLOG_INFO("ARM: ARM CONFIRMED");
+    finishCrestronTask();
+    TASK_END(task);
 }
 
-void TexecomClass::armSystem(TASK_STEP_RESULT result) {
-    switch (taskStep) {
-        case CRESTRON_START :  // Initiate request
-            if (armType == FULL_ARM)
-                Log.info("ARM: Starting full arm process");
-            else if (armType == NIGHT_ARM)
-                Log.info("ARM: Starting night arm process");
-            else
-                return;
+// Logs in, works through the queued commands and logs out. Each command
+// gets simpleProtocolTimeout, one that runs over drops the rest of the
+// queue as the repeating syncs will queue it again.
+void TexecomClass::simpleSessionTask(PanelTask &task) {
+    TASK_BEGIN(task);
+    TLOG_INFO("SIMPLE: Starting login process");
+    taskStep = SIMPLE_LOGIN;
+
+    // The panel ignores logins until it's between Crestron messages
+    for (task.counter = 0; ; task.counter++) {
+        if (task.counter >= simpleProtocolTimeout / simpleLoginRetry) {
+            TLOG_INFO("SIMPLE: Login timed out");
+            simpleWork = 0;
+            endSimpleSession();
+            TASK_EXIT(task);
+        }
 
-            armStartTime = millis();
-            Log.info("ARM: Requesting arm state");
-            taskStep = CRESTRON_CONFIRM_DISARMED;
-            crestronHelper.requestArmState();
+        sendSimpleLogin();
+        task.setTimeout(simpleLoginRetry);
+        TASK_AWAIT(task, task.bit(SIMPLE_OK));
+        if (task.result == SIMPLE_OK)
             break;
+    }
 
-        case CRESTRON_CONFIRM_DISARMED:
-            if (result == CRESTRON_IS_DISARMED) {
-                Log.info("ARM: Confirmed disarmed. Confirming idle screen");
-                taskStep = CRESTRON_CONFIRM_IDLE_SCREEN;
-                crestronHelper.requestScreen();
-            } else if (result == CRESTRON_IS_ARMED) {
-                Log.info("ARM: System already armed. Aborting");
-                abortCrestronTask();
-            } else {
-                abortCrestronTask();
-            }
-            break;
+    TLOG_INFO("SIMPLE: Simple login confirmed");
+    activeProtocol = SIMPLE;
 
-        case CRESTRON_CONFIRM_IDLE_SCREEN :
-            if (result == CRESTRON_SCREEN_IDLE) {
-                Log.info("ARM: Idle screen confirmed. Starting login process");
-                taskStep = CRESTRON_LOGIN;
-            } else {
-                Log.info("ARM: Screen is not idle. Aborting");
-                abortCrestronTask();
-            }
-            break;
+    while (simpleWork != 0) {
+        simpleTask = nextSimpleTask();
+        taskStep = SIMPLE_START;
+        task.setTimeout(simpleProtocolTimeout);
 
-        case CRESTRON_LOGIN:
-            if (result == CRESTRON_LOGIN_COMPLETE) {
-                Log.info("ARM: Login complete. Awaiting confirmed login");
-                taskStep = CRESTRON_LOGIN_WAIT;
+        if (simpleTask == SIMPLE_CHECK_TIME) {
+            TLOG_INFO("TIME: Requesting time");
+            taskStep = SIMPLE_REQUEST_TIME;
+            simpleHelper.sendSimpleMessage("\\T?/", 4);
+            TASK_AWAIT(task, task.bit(SIMPLE_TIME_CHECK_OK) | task.bit(SIMPLE_TIME_CHECK_OUT));
+
+            if (task.result == SIMPLE_TIME_CHECK_OK) {
+                TLOG_INFO("TIME: Time ok");
+            } else if (task.result == SIMPLE_TIME_CHECK_OUT) {
+                TLOG_INFO("TIME: Time is out, Setting time");
+                taskStep = SIMPLE_SEND_TIME;
+                sendTime();
+                TASK_AWAIT(task, task.bit(SIMPLE_OK));
+                if (task.result == SIMPLE_OK)
+                    TLOG_INFO("TIME: Time set");
+            }
+        } else if (simpleTask == SIMPLE_ZONE_CHECK || simpleTask == SIMPLE_ZONE_SCAN) {
+            if (simpleTask == SIMPLE_ZONE_SCAN) {
+                TLOG_INFO("ZONE: Scanning all zones");
+                zoneReadCursor = 1;
+                zoneReadLast = zones.getCapacity();
             } else {
-                Log.info("ARM: Login failed. Aborting");
-                abortCrestronTask();
+                TLOG_INFO("ZONE: Requesting Zone state");
+                zoneReadCursor = zones.getFirstZone();
+                zoneReadLast = zones.getLastZone();
             }
-            break;
 
-        case CRESTRON_LOGIN_WAIT :
-            if (result == CRESTRON_LOGIN_CONFIRMED) {
-                Log.info("ARM: Login confirmed. Waiting for Arm prompt");
-                taskStep = CRESTRON_WAIT_FOR_ARM_PROMPT;
-                delayCommand(CrestronHelper::COMMAND_SCREEN_STATE, 500);
-            } else {
-                Log.info("ARM: Login failed to confirm. Aborting");
-                abortCrestronTask();
+            // Chunks read, a scan is only applied once the panel has answered
+            task.counter = 0;
+            while (zoneReadCursor != 0 && zoneReadCursor <= zoneReadLast && requestZoneChunk()) {
+                TASK_AWAIT(task, task.bit(SIMPLE_OK));
+                if (task.result != SIMPLE_OK)
+                    break;
+                task.counter++;
             }
-            break;
 
-        case CRESTRON_WAIT_FOR_ARM_PROMPT :
-            if (result == CRESTRON_FULL_ARM_PROMPT) {
-                if (armType == FULL_ARM) {
-                    Log.info("ARM: Full arm prompt confirmed, completing full arm");
-                    if (!savedData.isDebug)
-                        texSerial.println("KEYY");  // Yes
-                    taskStep = CRESTRON_ARM_REQUESTED;
-                } else if (armType == NIGHT_ARM) {
-                    Log.info("ARM: Full arm prompt confirmed, waiting for part arm prompt");
-                    taskStep = CRESTRON_WAIT_FOR_PART_ARM_PROMPT;
-                    texSerial.println("KEYD");  // Down
-                    delayCommand(CrestronHelper::COMMAND_SCREEN_STATE, 500);
+            if (task.counter == 0) {
+                TLOG_INFO("ZONE: No zone state read");
+            } else if (task.result == SIMPLE_OK) {
+                TLOG_INFO("ZONE: Zone state received");
+                if (simpleTask == SIMPLE_ZONE_SCAN)
+                    applyZoneScan();
+            }
+        } else if (simpleTask == SIMPLE_IDENTIFY) {
+            TLOG_INFO("ZONE: Requesting panel identification");
+            taskStep = SIMPLE_READ_IDENTIFICATION;
+            simpleHelper.sendSimpleMessage("\\I/", 3);
+            TASK_AWAIT(task, task.bit(SIMPLE_OK));
+        } else if (simpleTask == SIMPLE_EVENT_LOG) {
+            if (eventLogIndexChecks[panel] != (uint16_t)~eventLogIndexes[panel]) {
+                TLOG_INFO("LOG: No saved position, reading the whole log");
+                eventLogIndexes[panel] = 0;
+                eventLogIndexChecks[panel] = ~eventLogIndexes[panel];
+            }
+            eventsThisSession = 0;
+            eventLogStalled = false;
+
+            for (;;) {
+                requestEventChunk();
+                TASK_AWAIT(task, task.bit(SIMPLE_OK));
+                if (task.result != SIMPLE_OK)
+                    break;
+
+                // A short read (or an error) means we've caught up with the panel
+                if (eventLogStalled || eventsReceived < eventsPerRead) {
+                    TLOG_INFO("LOG: Read up to event %d", eventLogIndexes[panel]);
+                    break;
+                } else if (eventsThisSession >= eventsPerSession) {
+                    Alarm.timerOnce(eventLogInterval, startEventLogRead, this);
+                    break;
                 }
-            } else {
-                Log.info("ARM: Unexpected result at WAIT_FOR_ARM_PROMPT. Aborting");
-                abortCrestronTask();
             }
-            break;
+        }
 
-        case CRESTRON_WAIT_FOR_PART_ARM_PROMPT :
-            if (result == CRESTRON_PART_ARM_PROMPT) {
-                Log.info("ARM: Part arm prompt confirmed, waiting for night arm prompt");
-                taskStep = CRESTRON_WAIT_FOR_NIGHT_ARM_PROMPT;
-                texSerial.println("KEYY");  // Yes
-                delayCommand(CrestronHelper::COMMAND_SCREEN_STATE, 500);
-            } else {
-                Log.info("ARM: Unexpected result at WAIT_FOR_PART_ARM_PROMPT. Aborting");
-                abortCrestronTask();
-            }
+        if (task.result == SIMPLE_TIMEOUT) {
+            TLOG_INFO("SIMPLE: Simple Protocol timeout");
+            simpleWork = 0;
             break;
+        }
+        finishSimpleTask();
+    }
 
-        case CRESTRON_WAIT_FOR_NIGHT_ARM_PROMPT :
-            if (result == CRESTRON_NIGHT_ARM_PROMPT) {
-                Log.info("ARM: Night arm prompt confirmed, Completing part arm");
-                if (!savedData.isDebug)
-                    texSerial.println("KEYY");  // Yes
-                taskStep = CRESTRON_ARM_REQUESTED;
-            } else {
-                Log.info("ARM: Unexpected result at WAIT_FOR_NIGHT_ARM_PROMPT. Aborting");
-                abortCrestronTask();
-            }
-            break;
+    TLOG_INFO("SIMPLE: Work complete, logging out");
+    taskStep = SIMPLE_LOGOUT;
+    simpleHelper.sendSimpleMessage("\\H/", 3);
+    task.setTimeout(simpleLogoutTimeout);
+    TASK_AWAIT(task, task.bit(SIMPLE_OK));
 
-        case CRESTRON_ARM_REQUESTED :
-            if (result == CRESTRON_IS_ARMING) {
-                Log.info("ARM: ARM CONFIRMED");
-                crestronTask = CRESTRON_IDLE;
-                memset(userPin, 0, sizeof userPin);
-                armStartTime = 0;
-                Alarm.completeTriggeredAlarm();
-            } else {
-                Log.info("ARM: Unexpected result at ARM_REQUESTED. Aborting");
-                abortCrestronTask();
-            }
-            break;
+    if (task.result == SIMPLE_OK)
+        TLOG_INFO("SIMPLE: Logout confirmed");
+    else
+        TLOG_INFO("SIMPLE: Simple logout failed and was forced");
+    endSimpleSession();
+    TASK_END(task);
+}
+
+void TexecomClass::sendTime() {
+    char setTimeMsg[8];
+    setTimeMsg[0] = '\\';
+    setTimeMsg[1] = 'T';
+    setTimeMsg[2] = Time.day();
+    setTimeMsg[3] = Time.month();
+    setTimeMsg[4] = Time.year()-2000;
+    setTimeMsg[5] = Time.hour();
+    setTimeMsg[6] = Time.minute();
+    setTimeMsg[7] = '/';
+    simpleHelper.sendSimpleMessage(setTimeMsg, 8);
+}
+
+// False once the zones left can't be read
+bool TexecomClass::requestZoneChunk() {
+    if (zoneReadCursor > maxSimpleZone) {
+        TLOG_INFO("ZONE: Zone %d can't be read over Simple protocol", zoneReadCursor);
+        zoneReadCursor = 0;
+        return false;
     }
 
-    if (result == CRESTRON_TASK_TIMEOUT && crestronTask != CRESTRON_IDLE)
-        abortCrestronTask();
+    uint16_t last = zoneReadLast < maxSimpleZone ? zoneReadLast : maxSimpleZone;
+    uint16_t remaining = last - zoneReadCursor + 1;
+    zoneReadCount = remaining < zonesPerRead ? remaining : zonesPerRead;
+
+    taskStep = SIMPLE_READ_ZONE_STATE;
+    char zoneRequestMessage[5];
+    zoneRequestMessage[0] = '\\';
+    zoneRequestMessage[1] = 'Z';
+    zoneRequestMessage[2] = zoneReadCursor-1;
+    zoneRequestMessage[3] = zoneReadCount;
+    zoneRequestMessage[4] = '/';
+    simpleHelper.sendSimpleMessage(zoneRequestMessage, 5); //  \ Z 8 11 /
+    return true;
 }
 
-void TexecomClass::simpleLogin(TASK_STEP_RESULT result) {
-    switch (taskStep) {
-        case SIMPLE_LOGIN_REQUIRED :  // Initiate request
-            if (activeProtocol != SIMPLE) {
-                Log.info("SIMPLE: Starting login process");
-                taskStep = SIMPLE_LOGIN;
-            }
-            break;
-        case SIMPLE_LOGIN :
-            if (result == SIMPLE_OK) {
-                Log.info("SIMPLE: Simple login confirmed");
-                activeProtocol = SIMPLE;
-                simpleProtocolTimeout = millis() + 30000;
-                taskStep = SIMPLE_START;
-                switch (simpleTask) {
-                    case SIMPLE_CHECK_TIME :
-                        checkTime(SIMPLE_LOGIN_CONFIRMED);
-                        break;
-                    case SIMPLE_ZONE_CHECK :
-                        zoneCheck(SIMPLE_LOGIN_CONFIRMED);
-                        break;
-                }
-            } else {
-                Log.info("SIMPLE: Uh oh 1 - %d", result);
-            }
-            break;
+// Zones that report anything other than secure are in use
+void TexecomClass::noteZoneInUse(uint16_t zone) {
+    if (seenLastZone == 0) {
+        seenFirstZone = seenLastZone = zone;
+    } else if (zone < seenFirstZone) {
+        seenFirstZone = zone;
+    } else if (zone > seenLastZone) {
+        seenLastZone = zone;
     }
 }
 
-void TexecomClass::checkTime(TASK_STEP_RESULT result) {
-    switch (taskStep) {
-        case SIMPLE_START :
-            Log.info("TIME: Requesting time");
-            simpleHelper.sendSimpleMessage("\\T?/", 4);
-            taskStep = SIMPLE_REQUEST_TIME;
-            break;
-        case SIMPLE_REQUEST_TIME :
-            if (result == SIMPLE_TIME_CHECK_OK) {
-                Log.info("TIME: Time ok, logging out");
-                simpleHelper.sendSimpleMessage("\\H/", 3);
-                taskStep = SIMPLE_LOGOUT;
-            } else if (result == SIMPLE_TIME_CHECK_OUT) {
-                Log.info("TIME: Time is out, Setting time");
-                char setTimeMsg[8];
-                setTimeMsg[0] = '\\';
-                setTimeMsg[1] = 'T';
-                setTimeMsg[2] = Time.day();
-                setTimeMsg[3] = Time.month();
-                setTimeMsg[4] = Time.year()-2000;
-                setTimeMsg[5] = Time.hour();
-                setTimeMsg[6] = Time.minute();
-                setTimeMsg[7] = '/';
-                simpleHelper.sendSimpleMessage(setTimeMsg, 8);
-                taskStep = SIMPLE_SEND_TIME;
-                break;
-            } else {
-                Log.info("TIME: Uh oh Time 1 - %d", result);
-            }
-            break;
-        case SIMPLE_SEND_TIME :
-            Log.info("TIME: Time set, logging out");
-            simpleHelper.sendSimpleMessage("\\H/", 3);
-            taskStep = SIMPLE_LOGOUT;
-            break;
-        case SIMPLE_LOGOUT :
-            if (result == SIMPLE_OK) {
-                Log.info("TIME: Logout confirmed");
-                activeProtocol = CRESTRON;
-                simpleTask = SIMPLE_IDLE;
-                Alarm.completeTriggeredAlarm();
-            } else {
-                Log.info("TIME: Uh oh Time 2 - %d", result);
-            }
-            break;
+// The range becomes the zones seen in use since the last scan, so it can
+// narrow or move as well as grow. Saved once, with the panel's capacity.
+void TexecomClass::applyZoneScan() {
+    if (seenLastZone == 0) {
+        TLOG_INFO("ZONE: No zones in use found, keeping zones %d to %d",
+            zones.getFirstZone(), zones.getLastZone());
+    } else if (zones.setRange(seenFirstZone, seenLastZone)) {
+        TLOG_INFO("ZONE: Zones %d to %d are in use", zones.getFirstZone(), zones.getLastZone());
     }
+
+    saveZoneConfig();
+    seenFirstZone = seenLastZone = 0;
 }
 
-void TexecomClass::zoneCheck(TASK_STEP_RESULT result) {
-    switch (taskStep) {
-        case SIMPLE_START :
-            Log.info("ZONE: Requesting Zone state");
-            taskStep = SIMPLE_READ_ZONE_STATE;
-            char zoneRequestMessage[5];
-            zoneRequestMessage[0] = '\\';
-            zoneRequestMessage[1] = 'Z';
-            zoneRequestMessage[2] = firstZone-1;
-            zoneRequestMessage[3] = zoneCount;
-            zoneRequestMessage[4] = '/';
-            simpleHelper.sendSimpleMessage(zoneRequestMessage, 5); //  \ Z 8 11 /
-            break;
-        case SIMPLE_READ_ZONE_STATE :
-            Log.info("ZONE: zoneCheck Logging Out");
-            simpleHelper.sendSimpleMessage("\\H/", 3);
-            taskStep = SIMPLE_LOGOUT;
-            break;
-        case SIMPLE_LOGOUT :
-            if (result == SIMPLE_OK) {
-                Log.info("ZONE: Logout confirmed");
-            } else {
-                Log.info("ZONE: Uh oh 1 - %d", result);
-            }
-            activeProtocol = CRESTRON;
-            simpleTask = SIMPLE_IDLE;
-            Alarm.completeTriggeredAlarm();
+void TexecomClass::requestEventChunk() {
+    eventsReceived = 0;
+    taskStep = SIMPLE_READ_EVENT_LOG;
+    char logRequestMessage[6];
+    logRequestMessage[0] = '\\';
+    logRequestMessage[1] = 'G';
+    logRequestMessage[2] = eventLogIndexes[panel] & 0xFF;
+    logRequestMessage[3] = eventLogIndexes[panel] >> 8;
+    logRequestMessage[4] = eventsPerRead;
+    logRequestMessage[5] = '/';
+    simpleHelper.sendSimpleMessage(logRequestMessage, 6);
+}
+
+// Records are handed on one at a time and the index only moves past a record
+// once it has been accepted, so nothing is lost if MQTT is down
+void TexecomClass::processEventLog(const char *message, uint8_t messageLength) {
+    SimpleHelper::LOG_EVENT event;
+
+    for (uint8_t i = 0; i + SimpleHelper::logEventSize <= messageLength; i += SimpleHelper::logEventSize) {
+        simpleHelper.decodeLogEvent(&message[i], &event);
+
+        if (eventLogCallback && !eventLogCallback(eventLogIndexes[panel], event)) {
+            eventLogStalled = true;
             break;
+        }
+
+        eventLogIndexes[panel]++;
+        eventLogIndexChecks[panel] = ~eventLogIndexes[panel];
+        eventsReceived++;
+        eventsThisSession++;
+    }
+}
+
+void TexecomClass::cacheArmState(TASK_STEP_RESULT state) {
+    cachedArmState = state;
+    cachedArmStateTime = millis();
+}
+
+// Screens are only trusted briefly as keypad use can change them unseen
+void TexecomClass::cacheScreen(TASK_STEP_RESULT screen) {
+    cachedScreen = screen;
+    cachedScreenTime = millis();
+}
+
+TexecomClass::TASK_STEP_RESULT TexecomClass::getCachedArmState() {
+    // The digi outputs are live so trust them, when this panel has them,
+    // unless they disagree with Crestron
+    if (digiOwner == this && !(alarmStateFlags & ALARM_SOURCE_MISMATCH) && exitToDisarmTimeout == 0) {
+        if (alarmState == DISARMED)
+            return CRESTRON_IS_DISARMED;
+        else if (alarmState != EXIT)
+            return CRESTRON_IS_ARMED;
     }
+
+    if (cachedArmState != RESULT_NONE && millis() - cachedArmStateTime < armStateCacheLifetime)
+        return cachedArmState;
+    return RESULT_NONE;
+}
+
+TexecomClass::TASK_STEP_RESULT TexecomClass::getCachedScreen() {
+    if (cachedScreen != RESULT_NONE && millis() - cachedScreenTime < screenCacheLifetime)
+        return cachedScreen;
+    return RESULT_NONE;
 }
 
 void TexecomClass::abortCrestronTask() {
     crestronTask = CRESTRON_IDLE;
-    texSerial.println("KEYR");
-    delayedCommandExecuteTime = 0;
+    cacheScreen(RESULT_NONE);
+    serial.println("KEYR");
+    Alarm.stopMs(delayedCommandTimer);
     memset(userPin, 0, sizeof userPin);
-    nextPinEntryTime = 0;
-    armStartTime = 0;
-    disarmStartTime = 0;
+    Alarm.stopMs(pinEntryTimer);
     crestronHelper.requestArmState();
     commandAttempts = 0;
-    Alarm.completeTriggeredAlarm();
+    completeJob();
+}
+
+void TexecomClass::finishCrestronTask() {
+    crestronTask = CRESTRON_IDLE;
+    memset(userPin, 0, sizeof userPin);
+    completeJob();
 }
 
 bool TexecomClass::processCrestronMessage(char *message, uint8_t messageLength) {
+    METRIC_SCOPE(METRIC_CRESTRON_MESSAGE);
 
     // Zone state changed
     if (messageLength == 6 &&
@@ -505,6 +967,9 @@ bool TexecomClass::processCrestronMessage(char *message, uint8_t messageLength)
     // System Armed
     } else if (messageLength >= 6 &&
                 strncmp(message, msgArmUpdate, strlen(msgArmUpdate)) == 0) {
+        setAreaState(decodeArea(message), ARMED_AWAY);
+        cacheArmState(CRESTRON_IS_ARMED);
+        cacheScreen(RESULT_NONE);
         // if (crestronTask != CRESTRON_IDLE) {
             // processTask(CRESTRON_IS_ARMED);
         // }
@@ -512,6 +977,9 @@ bool TexecomClass::processCrestronMessage(char *message, uint8_t messageLength)
     // System Disarmed
     } else if (messageLength >= 6 &&
                 strncmp(message, msgDisarmUpdate, strlen(msgDisarmUpdate)) == 0) {
+        setAreaState(decodeArea(message), DISARMED);
+        cacheArmState(CRESTRON_IS_DISARMED);
+        cacheScreen(RESULT_NONE);
         // if (crestronTask != CRESTRON_IDLE) {
             // processTask(CRESTRON_IS_DISARMED);
         // }
@@ -519,25 +987,35 @@ bool TexecomClass::processCrestronMessage(char *message, uint8_t messageLength)
     // Entry while armed
     } else if (messageLength == 6 &&
                 strncmp(message, msgEntryUpdate, strlen(msgEntryUpdate)) == 0) {
+        setAreaState(decodeArea(message), ENTRY);
         return true;
     // System arming
     } else if (messageLength == 6 &&
                 strncmp(message, msgArmingUpdate, strlen(msgArmingUpdate)) == 0) {
+        setAreaState(decodeArea(message), EXIT);
         return true;
     // Intruder
     } else if (messageLength == 6 &&
                 strncmp(message, msgIntruderUpdate, strlen(msgIntruderUpdate)) == 0) {
+        intruderAlarm(message);
+        triggerArmedAreas();
+        return true;
+    // Panel accepted a key press
+    } else if (messageLength >= strlen(msgKeyAck) &&
+                strncmp(message, msgKeyAck, strlen(msgKeyAck)) == 0) {
+        pinKeyAcknowledged();
         return true;
     // User logged in with code or tag
     } else if (messageLength == 6 &&
                 (strncmp(message, msgUserPinLogin, strlen(msgUserPinLogin)) == 0 ||
                 strncmp(message, msgUserTagLogin, strlen(msgUserTagLogin)) == 0)) {
+        cacheScreen(RESULT_NONE);
         int user = message[4] - '0';
 
         if (user < userCount)
-            Log.info("User logged in: %s", users[user]);
+            TLOG_INFO("User logged in: %s", users[user]);
         else
-            Log.info("User logged in: Outside of user array size");
+            TLOG_INFO("User logged in: Outside of user array size");
 
         if (crestronTask != CRESTRON_IDLE) {
             processTask(CRESTRON_LOGIN_CONFIRMED);
@@ -546,6 +1024,7 @@ bool TexecomClass::processCrestronMessage(char *message, uint8_t messageLength)
     // Reply to ASTATUS request that the system is disarmed
     } else if (messageLength == 5 &&
                 strncmp(message, msgReplyDisarmed, strlen(msgReplyDisarmed)) == 0) {
+        cacheArmState(CRESTRON_IS_DISARMED);
         if (crestronTask != CRESTRON_IDLE) {
             processTask(CRESTRON_IS_DISARMED);
         }
@@ -553,6 +1032,7 @@ bool TexecomClass::processCrestronMessage(char *message, uint8_t messageLength)
     // Reply to ASTATUS request that the system is armed
     } else if (messageLength == 5 &&
                 strncmp(message, msgReplyArmed, strlen(msgReplyArmed)) == 0) {
+        cacheArmState(CRESTRON_IS_ARMED);
         if (crestronTask != CRESTRON_IDLE) {
             processTask(CRESTRON_IS_ARMED);
         }
@@ -564,18 +1044,20 @@ bool TexecomClass::processCrestronMessage(char *message, uint8_t messageLength)
                 strncmp(message, msgScreenArmedNight, strlen(msgScreenArmedNight)) == 0) ||
             (messageLength >= strlen(msgScreenIdlePartArmed) &&
                 strncmp(message, msgScreenIdlePartArmed, strlen(msgScreenIdlePartArmed)) == 0)) {
+        cacheScreen(CRESTRON_SCREEN_PART_ARMED);
         if (crestronTask != CRESTRON_IDLE) {
             processTask(CRESTRON_SCREEN_PART_ARMED);
         }
         return true;
-    } else if (messageLength >= strlen(msgScreenArmedFull) &&
-                strncmp(message, msgScreenArmedFull, strlen(msgScreenArmedFull)) == 0) {
+    } else if (matchAreaScreen(message, messageLength, msgScreenArmedFull)) {
+        cacheScreen(CRESTRON_SCREEN_FULL_ARMED);
         if (crestronTask != CRESTRON_IDLE) {
             processTask(CRESTRON_SCREEN_FULL_ARMED);
         }
         return true;
     } else if (messageLength >= strlen(msgScreenIdle) &&
                 strncmp(message, msgScreenIdle, strlen(msgScreenIdle)) == 0) {
+        cacheScreen(CRESTRON_SCREEN_IDLE);
         if (crestronTask != CRESTRON_IDLE) {
             processTask(CRESTRON_SCREEN_IDLE);
         }
@@ -613,14 +1095,12 @@ bool TexecomClass::processCrestronMessage(char *message, uint8_t messageLength)
             processTask(CRESTRON_DISARM_PROMPT);
         }
         return true;
-    } else if (messageLength >= strlen(msgScreenAreainEntry) &&
-                strncmp(message, msgScreenAreainEntry, strlen(msgScreenAreainEntry)) == 0) {
+    } else if (matchAreaScreen(message, messageLength, msgScreenAreainEntry)) {
         if (crestronTask != CRESTRON_IDLE) {
             processTask(CRESTRON_SCREEN_AREA_ENTRY);
         }
         return true;
-    } else if (messageLength >= strlen(msgScreenAreainExit) &&
-        strncmp(message, msgScreenAreainExit, strlen(msgScreenAreainExit)) == 0) {
+    } else if (matchAreaScreen(message, messageLength, msgScreenAreainExit)) {
         if (crestronTask != CRESTRON_IDLE) {
             processTask(CRESTRON_SCREEN_AREA_EXIT);
         }
@@ -649,141 +1129,176 @@ bool TexecomClass::processSimpleMessage(char *message, uint8_t messageLength) {
             processTask(SIMPLE_TIME_CHECK_OUT);
         return true;
     } else if (taskStep == SIMPLE_READ_ZONE_STATE) {
-        simpleHelper.processReceivedZoneData(message, messageLength, zoneStates);
+        uint16_t states[zonesPerRead];
+
+        if (zoneReadCount <= zonesPerRead && messageLength >= zoneReadCount * 2) {
+            simpleHelper.processReceivedZoneData(message, zoneReadCount * 2, states);
+
+            // A scan reads zones outside the table too
+            for (uint8_t i = 0; i < zoneReadCount; i++) {
+                uint16_t zone = zoneReadCursor + i;
+                if (states[i] != 0)
+                    noteZoneInUse(zone);
+                if (zones.isInstalled(zone)) {
+                    zones.update(zone, states[i], 0xFFFF);
+                    updateZoneState(zone);
+                }
+            }
+        } else {
+            TLOG_INFO("ZONE: Unexpected zone data length %d", messageLength);
+        }
+
+        zoneReadCursor += zoneReadCount;
+        processTask(SIMPLE_OK);
+        return true;
+    } else if (taskStep == SIMPLE_READ_EVENT_LOG) {
+        processEventLog(message, messageLength);
+        processTask(SIMPLE_OK);
+        return true;
+    } else if (taskStep == SIMPLE_READ_IDENTIFICATION) {
+        uint16_t capacity = simpleHelper.processReceivedIdentification(message, messageLength);
 
-        for (uint8_t i = 0; i < zoneCount; i++)
-            updateZoneState(i);
+        if (capacity > 0) {
+            zones.setCapacity(capacity);
+            simpleWork |= SIMPLE_WORK_ZONE_SCAN;
+        } else {
+            TLOG_INFO("ZONE: Panel not recognised, keeping the current zone range");
+        }
 
         processTask(SIMPLE_OK);
         return true;
     }
-    Log.info ("Unknown simple message rejected");
+    TLOG_INFO("Unknown simple message rejected");
     processTask(UNKNOWN_MESSAGE);
     return false;
 }
 
-void TexecomClass::checkDigiOutputs() {
-
-    bool changeDetected = false;
-
-    bool _state = digitalRead(pinFullArmed);
+template<uint8_t input>
+void TexecomClass::digiOutputChanged() {
+    DigiEdge edge;
+    edge.input = input;
+    edge.level = pinReadFast(digiOwner->digiPins[input]);
+    edge.micros = micros();
+    digiOwner->digiEdges.push(edge);
+}
 
-    if (_state != statePinFullArmed) {
-        statePinFullArmed = _state;
-        if (_state == LOW) {
-            // Log.info("Pin Full Armed");
-            changeDetected = true;
-            alarmState = ARMED_AWAY;
-        }
+void TexecomClass::attachDigiOutputs() {
+    static void (*const handlers[DIGI_COUNT])() = {
+        digiOutputChanged<0>, digiOutputChanged<1>, digiOutputChanged<2>, digiOutputChanged<3>,
+        digiOutputChanged<4>, digiOutputChanged<5>, digiOutputChanged<6>, digiOutputChanged<7>
+    };
+
+    digiLevelMask = 0;
+    for (uint8_t i = 0; i < DIGI_COUNT; i++) {
+        pinMode(digiPins[i], INPUT);
+        if (digitalRead(digiPins[i]) == HIGH)
+            digiLevelMask |= 1 << i;
+        digiEdgeTime[i] = micros();
+        attachInterrupt(digiPins[i], handlers[i], CHANGE);
     }
+}
 
-    _state = digitalRead(pinPartArmed);
+// Applies queued edges to digiLevelMask
+void TexecomClass::processDigiEdges() {
+    uint8_t accepted = 0;
+    DigiEdge edge;
 
-    if (_state != statePinPartArmed) {
-        statePinPartArmed = _state;
-        if (_state == LOW) {
-            // Log.info("Pin Part Armed");
-            changeDetected = true;
-            alarmState = ARMED_HOME;
-        }
+    // Edges were lost so the levels can't be trusted, settle and re-read all
+    if (digiEdges.takeOverflow()) {
+        TLOG_INFO("Digi output queue overflowed");
+        digiSettling = 0xFF;
     }
 
-    _state = digitalRead(pinEntry);
+    while (digiEdges.pop(&edge)) {
+        uint8_t bit = 1 << edge.input;
+        TRACE_PIN(digiPins[edge.input], edge.level, edge.micros);
 
-    if (_state != statePinEntry) {
-        statePinEntry = _state;
-        if (_state == LOW) {
-            // Log.info("Pin Entry");
-            changeDetected = true;
-            alarmState = ENTRY;
+        if ((digiSettling & bit) && edge.micros - digiEdgeTime[edge.input] < digiDebounce)
+            continue;
+
+        digiSettling &= ~bit;
+        if (((digiLevelMask & bit) != 0) != edge.level) {
+            digiLevelMask ^= bit;
+            digiEdgeTime[edge.input] = edge.micros;
+            lastDigiEdge = edge.micros;
+            digiSettling |= bit;
+            accepted |= bit;
         }
     }
 
-    _state = digitalRead(pinExit);
-
-    if (_state != statePinExit) {
-        statePinExit = _state;
-        if (_state == LOW) {
-            // Log.info("Pin Exit");
-            changeDetected = true;
-            alarmState = EXIT;
-            if (crestronTask != CRESTRON_IDLE) {
-               processTask(CRESTRON_IS_ARMING);
+    // Inputs accepted this pass are left until the next one so a short
+    // pulse is always seen by checkDigiOutputs before it is undone
+    uint8_t settling = digiSettling & ~accepted;
+    if (settling) {
+        uint32_t now = micros();
+        for (uint8_t i = 0; i < DIGI_COUNT; i++) {
+            uint8_t bit = 1 << i;
+            if (!(settling & bit) || now - digiEdgeTime[i] < digiDebounce)
+                continue;
+
+            digiSettling &= ~bit;
+            if (((digiLevelMask & bit) != 0) != (pinReadFast(digiPins[i]) != 0)) {
+                digiLevelMask ^= bit;
+                digiEdgeTime[i] = now;
+                lastDigiEdge = now;
+                digiSettling |= bit;
             }
         }
     }
+}
 
-    _state = digitalRead(pinTriggered);
+void TexecomClass::checkDigiOutputs() {
+    processDigiEdges();
 
-    if (_state != statePinTriggered) {
-        statePinTriggered = _state;
-        if (_state == LOW) {
-            // Log.info("Pin Triggered");
-            changeDetected = true;
-            alarmState = TRIGGERED;
-        }
-    }
+    // Outputs are active low
+    uint8_t active = ~digiLevelMask;
+    uint8_t changed = active ^ digiActive;
+
+    // Nothing changed and no pending disarm to check
+    if (!changed && (alarmState == DISARMED || (active & DIGI_STATE_OUTPUTS)))
+        return;
 
-    _state = digitalRead(pinAreaReady);
+    bool changeDetected = false;
+    ALARM_STATE previousState = alarmState;
+    digiActive = active;
 
-    if (_state != statePinAreaReady) {
-        // Log.info("Pin Ready");
+    // A state output turning on sets the state, turning off is handled below
+    uint8_t activated = changed & active & DIGI_STATE_OUTPUTS;
+    if (activated) {
         changeDetected = true;
-        statePinAreaReady = _state;
+        alarmState = (ALARM_STATE)digiStateTable[activated].state;
 
-        if (statePinAreaReady == LOW) {
-            alarmStateFlags |= ALARM_READY;
-        } else {
-            alarmStateFlags &= ~ALARM_READY;
-        }
+        if ((activated & DIGI_BIT_EXIT) && crestronTask != CRESTRON_IDLE)
+            processTask(CRESTRON_IS_ARMING);
     }
 
-    _state = digitalRead(pinFaultPresent);
-
-    if (_state != statePinFaultPresent) {
-        // Log.info("Pin Fault");
+    if (changed & DIGI_FLAG_OUTPUTS) {
         changeDetected = true;
-        statePinFaultPresent = _state;
+        alarmStateFlags = digiStateTable[active].flags | (alarmStateFlags & ALARM_SOURCE_MISMATCH);
 
-        if (statePinFaultPresent == LOW) {
-            alarmStateFlags |= ALARM_FAULT;
-            Log.error("Alarm is reporting a fault");
-        } else {
-            alarmStateFlags &= ~ALARM_FAULT;
-            Log.info("Alarm fault cleared");
+        if (changed & DIGI_BIT_FAULT_PRESENT) {
+            if (active & DIGI_BIT_FAULT_PRESENT)
+                TLOG_ERROR("Alarm is reporting a fault");
+            else
+                TLOG_INFO("Alarm fault cleared");
         }
-    }
-
-    _state = digitalRead(pinArmFailed);
 
-    if (_state != statePinArmFailed) {
-        // Log.info("Pin Arm Failed");
-        changeDetected = true;
-        statePinArmFailed = _state;
-
-        if (statePinArmFailed == LOW) {
-            alarmStateFlags |= ALARM_ARM_FAILED;
-            Log.error("Alarm failed to arm");
-        } else {
-            alarmStateFlags &= ~ALARM_ARM_FAILED;
-            Log.error("Alarm arm failure cleared");
+        if (changed & DIGI_BIT_ARM_FAILED) {
+            if (active & DIGI_BIT_ARM_FAILED)
+                TLOG_ERROR("Alarm failed to arm");
+            else
+                TLOG_ERROR("Alarm arm failure cleared");
         }
     }
 
-
-    // If no pins are high state must be disarmed
-    if (alarmState != DISARMED &&
-            statePinFullArmed == HIGH &&
-            statePinPartArmed == HIGH &&
-            statePinEntry == HIGH &&
-            statePinExit == HIGH &&
-            statePinTriggered == HIGH) {
+    // If no state outputs are active the alarm must be disarmed
+    if (alarmState != DISARMED && !(active & DIGI_STATE_OUTPUTS)) {
 
         if (alarmState == EXIT && exitToDisarmTimeout == 0) {
-            // Log.info("Setting exit to disarm timeout");
+            // TLOG_INFO("Setting exit to disarm timeout");
             exitToDisarmTimeout = millis() + 1000;
         } else if (millis() > exitToDisarmTimeout) {
-            // Log.info("No pin disarm timeout");
+            // TLOG_INFO("No pin disarm timeout");
             changeDetected = true;
             alarmState = DISARMED;
             exitToDisarmTimeout = 0;
@@ -798,55 +1313,214 @@ void TexecomClass::checkDigiOutputs() {
     if (changeDetected) {
         // lastStateChange = millis();
         updateAlarmState();
-        /*
-        Log.info("FA:%d PA:%d EN:%d EX:%d TR:%d AR:%d FP:%d AF:%d",
-            statePinFullArmed,
-            statePinPartArmed,
-            statePinEntry,
-            statePinExit,
-            statePinTriggered,
-            statePinAreaReady,
-            statePinFaultPresent,
-            statePinArmFailed);
-        */
+        // TLOG_INFO("Digi outputs active: %02x", active);
+    }
+
+    // Crestron events aren't received during a Simple session
+    if (alarmState != previousState && simpleTask == SIMPLE_IDLE)
+        reconcileState(StateReconciler::SOURCE_DIGI, alarmState, lastDigiEdge);
+}
+
+// Intruder frames are handed on before anything else is done with them so
+// sirens and notifications don't wait for the digi outputs or a state publish
+void TexecomClass::intruderAlarm(const char *message) {
+    char zoneChar[4];
+    memcpy(zoneChar, &message[2], 3);
+    zoneChar[3] = '\0';
+    uint16_t zone = atoi(zoneChar);
+
+    bool published = triggeredCallback && triggeredCallback(zone);
+
+    // From the first byte of the frame arriving to the callback returning
+    if (published)
+        TLOG_ERROR("ALARM: Intruder in zone %d, published after %lu us", zone, micros() - messageStartMicros);
+    else
+        TLOG_ERROR("ALARM: Intruder in zone %d, not published yet", zone);
+}
+
+// Arm, disarm, entry and exit frames carry the area in the three digits
+// after the event letter, the same place zone frames carry the zone
+uint8_t TexecomClass::decodeArea(const char *message) {
+    char areaChar[4];
+    memcpy(areaChar, &message[2], 3);
+    areaChar[3] = '\0';
+    int area = atoi(areaChar);
+
+    return areas.isValid(area) ? area : 0;
+}
+
+void TexecomClass::setAreaState(uint8_t area, ALARM_STATE state) {
+    if (area == 0) {
+        TLOG_ERROR("Crestron event for an unknown area");
+        return;
+    }
+
+    // The digi outputs own keypadArea's state, Crestron is checked against them
+    if (area == keypadArea && digiOwner == this) {
+        reconcileState(StateReconciler::SOURCE_CRESTRON, state, micros());
+        return;
+    }
+
+    if (areas.set(area, state))
+        TLOG_INFO("Area %u: %u", area, state);
+
+    // Without the digi outputs keypadArea's Crestron events are the alarm state
+    if (area == keypadArea && state != alarmState) {
+        alarmState = state;
+        updateAlarmState();
+    }
+}
+
+// The area ready output when this instance has the digi outputs. Otherwise
+// keypadArea has to be reported disarmed with none of its zones open,
+// tampered or shorted, which is what the panel checks before arming.
+bool TexecomClass::isReady() const {
+    if (digiOwner == this)
+        return (digiActive & (1 << DIGI_AREA_READY)) != 0;
+
+    if (areas.get(keypadArea) != DISARMED)
+        return false;
+
+    const uint16_t notReady = SimpleHelper::ZONE_ACTIVE | SimpleHelper::ZONE_TAMPER | SimpleHelper::ZONE_SHORT;
+    const uint16_t bypassed = SimpleHelper::ZONE_MANUAL_BYPASS | SimpleHelper::ZONE_AUTO_BYPASS;
+    for (uint16_t zone = zones.getFirstZone(); zones.isInstalled(zone); zone++) {
+        uint16_t flags = zones.get(zone);
+        if ((flags & notReady) && !(flags & bypassed))
+            return false;
+    }
+    return true;
+}
+
+// Intruder frames carry the zone rather than the area, any area that could
+// have raised it goes to triggered
+void TexecomClass::triggerArmedAreas() {
+    for (uint8_t area = 1; area <= AreaTable::maxAreas; area++) {
+        uint8_t state = areas.get(area);
+        if (state == ARMED_HOME || state == ARMED_AWAY || state == ENTRY ||
+                (area == keypadArea && digiOwner == this))
+            setAreaState(area, TRIGGERED);
     }
+}
+
+void TexecomClass::publishAreaChanges() {
+    uint8_t area;
+
+    for (uint8_t i = 0; i < areasPerLoop && areas.takeChanged(&area); i++) {
+        if (areaCallback)
+            areaCallback(area, (ALARM_STATE)areas.get(area));
+    }
+}
+
+bool TexecomClass::getAreaState(uint8_t area, ALARM_STATE *state) const {
+    if (!areas.isKnown(area))
+        return false;
 
+    *state = (ALARM_STATE)areas.get(area);
+    return true;
 }
 
+bool TexecomClass::matchAreaScreen(const char *message, uint8_t messageLength, const char *screen) {
+    uint8_t prefixLength = strlen(msgScreenArea);
+
+    return messageLength >= prefixLength + strlen(screen) &&
+            strncmp(message, msgScreenArea, prefixLength) == 0 &&
+            strstr(message + prefixLength, screen) != NULL;
+}
+
+void TexecomClass::reconcileState(StateReconciler::SOURCE source, ALARM_STATE state, uint32_t timestamp) {
+    // Nothing to compare Crestron against without the digi outputs
+    if (digiOwner != this)
+        return;
+
+    static const StateReconciler::EVENT events[] = {
+        StateReconciler::EVENT_DISARMED,    // DISARMED
+        StateReconciler::EVENT_ARMED,       // ARMED_HOME
+        StateReconciler::EVENT_ARMED,       // ARMED_AWAY
+        StateReconciler::EVENT_ENTRY,       // ENTRY
+        StateReconciler::EVENT_EXIT,        // EXIT
+        StateReconciler::EVENT_TRIGGERED,   // TRIGGERED
+    };
+
+    reconciler.observe(source, events[state], timestamp);
+}
+
+#if defined(SERIAL_READER_THREAD)
+int TexecomClass::serialAvailable() {
+    if (readerPosition >= readerFrame.length) {
+        readerPosition = 0;
+        if (serialReader.pop(&readerFrame)) {
+            TRACE_RX_FRAME(readerFrame.data, readerFrame.length, readerFrame.startMicros);
+        } else {
+            readerFrame.length = 0;
+        }
+    }
+    return readerFrame.length - readerPosition;
+}
+#endif
+
 void TexecomClass::setup() {
-    texSerial.begin(19200, SERIAL_8N2);  // open serial communications
+    if (!valid)
+        return;
+
+#if defined(SERIAL_READER_THREAD)
+    TRACE_USE_RX_FRAMES();
+    serialReader.start();
+#endif
+
+    if (hasDigiOutputs && digiOwner == NULL) {
+        digiOwner = this;
+        attachDigiOutputs();
+    }
 
-    pinMode(pinFullArmed, INPUT);
-    pinMode(pinPartArmed, INPUT);
-    pinMode(pinEntry, INPUT);
-    pinMode(pinExit, INPUT);
-    pinMode(pinTriggered, INPUT);
-    pinMode(pinArmFailed, INPUT);
-    pinMode(pinFaultPresent, INPUT);
-    pinMode(pinAreaReady, INPUT);
+    EEPROM.get(eepromAddress(0), savedData);
 
-    EEPROM.get(0, savedData);
+    ZONE_CONFIG zoneConfig;
+    EEPROM.get(eepromAddress(zoneConfigAddress), zoneConfig);
+
+    if (zoneConfig.magic == zoneConfigMagic) {
+        zones.setCapacity(zoneConfig.capacity);
+        zones.setRange(zoneConfig.firstZone, zoneConfig.lastZone);
+    } else {
+        zones.setRange(defaultFirstZone, defaultLastZone);
+        requestZoneLearn();
+    }
 
     if (savedData.isDebug)
-        Log.info("UDL code = %s", savedData.udlCode);
+        TLOG_INFO("UDL code = %s", savedData.udlCode);
+
+    delayedCommandTimer = Alarm.createMs(executeDelayedCommand, this);
+    pinEntryTimer = Alarm.createMs(sendNextPinDigit, this);
 
-    Alarm.timerRepeat(180, Texecom.startZoneSync);
-    Alarm.alarmRepeat(3, 0, 0, Texecom.startTimeSync);
+    Alarm.timerRepeat(180, startZoneSync, this);
+    Alarm.alarmRepeat(3, 0, 0, startTimeSync, this);
+    Alarm.timerRepeat(eventLogPoll, startEventLogRead, this);
 
-    checkDigiOutputs();
+    if (digiOwner == this)
+        checkDigiOutputs();
 }
 
 void TexecomClass::loop() {
+    if (!valid)
+        return;
+
     bool messageReady = false;
     bool messageComplete = true;
     uint8_t messageLength = 0;
 
     // Read incoming serial data if available and copy to TCP port
-    while (texSerial.available() > 0) {
-        int incomingByte = texSerial.read();
-        // Log.info("S %d", incomingByte);
-        if (bufferPosition == 0)
+    while (serialAvailable() > 0) {
+        int incomingByte = serialRead();
+        // TLOG_INFO("S %d", incomingByte);
+        if (bufferPosition == 0) {
+#if defined(SERIAL_READER_THREAD)
+            // When the reader saw it rather than when the loop got to it
+            messageStart = readerFrame.startMillis;
+            messageStartMicros = readerFrame.startMicros;
+#else
             messageStart = millis();
+            messageStartMicros = micros();
+#endif
+        }
 
         // Will never happen but just in case
         if (bufferPosition >= maxMessageSize) {
@@ -863,7 +1537,7 @@ void TexecomClass::loop() {
             
             if (activeProtocol == SIMPLE || taskStep == SIMPLE_LOGIN) {
                 if (simpleHelper.checkSimpleChecksum(buffer, bufferPosition-2)) {
-                    Log.info("SIMPLE: Checksum valid");
+                    TLOG_INFO("SIMPLE: Checksum valid");
                     buffer[bufferPosition-2] = '\0'; // Overwrite the checksum
                     memcpy(message, buffer, bufferPosition-1);
                     messageReady = true;
@@ -887,10 +1561,10 @@ void TexecomClass::loop() {
         } else {
             buffer[bufferPosition++] = incomingByte;
         }
-    } // while (texSerial.available() > 0)
+    } // while (serialAvailable() > 0)
 
     if (bufferPosition > 0 && millis() > (messageStart+50)) {
-        Log.info("Message failed to receive within 50ms");
+        TLOG_INFO("Message failed to receive within 50ms");
         memcpy(message, buffer, bufferPosition);
         message[bufferPosition] = '\0';
         messageReady = true;
@@ -900,7 +1574,7 @@ void TexecomClass::loop() {
     }
 
     if (messageReady) {
-        Log.info(message);
+        TLOG_FRAME("%s", message, messageLength);
 
         bool processedSuccessfully = false;
         if (activeProtocol == SIMPLE || taskStep == SIMPLE_LOGIN) {
@@ -911,28 +1585,25 @@ void TexecomClass::loop() {
 
         if (!processedSuccessfully) {
             if (message[0] == '"') {
-                Log.info(String::format("Unknown Crestron command - %s", message));
+                TLOG_FRAME("Unknown Crestron command - %s", message, messageLength);
             } else {
-                Log.info("Unknown non-Crestron command - %s", message);
-                for (uint8_t i = 0; i < messageLength; i++) {
-                    Log.info("%d\n", message[i]);
-                }
+                TLOG_DUMP("Unknown non-Crestron command - %s", message, messageLength);
             }
 
             if (crestronTask != CRESTRON_IDLE && !messageComplete) {
                 if (screenRequestRetryCount++ < 3) {
                     if (taskStep == CRESTRON_CONFIRM_ARMED || taskStep == CRESTRON_CONFIRM_DISARMED) {
-                        Log.info("Retrying arm state request");
+                        TLOG_INFO("Retrying arm state request");
                         crestronHelper.requestArmState();
                     } else if (taskStep == CRESTRON_CONFIRM_IDLE_SCREEN ||
                                 taskStep == CRESTRON_WAIT_FOR_ARM_PROMPT ||
                                 taskStep == CRESTRON_WAIT_FOR_DISARM_PROMPT ||
                                 taskStep == CRESTRON_WAIT_FOR_PART_ARM_PROMPT ||
                                 taskStep == CRESTRON_WAIT_FOR_NIGHT_ARM_PROMPT) {
-                        Log.info("Retrying screen request");
+                        TLOG_INFO("Retrying screen request");
                         crestronHelper.requestScreen();
                     } else {
-                        Log.info("Retry count exceeded");
+                        TLOG_INFO("Retry count exceeded");
                     }
                 }
             } else {
@@ -941,86 +1612,31 @@ void TexecomClass::loop() {
         }
     }
 
-    // HANDLE CRESTON LOGIN VIA KEYPRESS ON VIRTUAL SCREEN
-    if (taskStep == CRESTRON_LOGIN && millis() > nextPinEntryTime) {
-        texSerial.print("KEY");
-        texSerial.println(userPin[loginPinPosition++]);
-
-        if (loginPinPosition >= strlen(userPin)) {
-            loginPinPosition = 0;
-            nextPinEntryTime = 0;
-            processTask(CRESTRON_LOGIN_COMPLETE);
-        } else {
-            nextPinEntryTime = millis() + PIN_ENTRY_DELAY;
-        }
-    }
-
     /*
     if (crestronTask == CRESTRON_IDLE && alarmState == ARMING &&
         millis() > (lastStateChange + armingTimeout)) {
-        Log.info("Arming state timed out. Requesting arm state");
+        TLOG_INFO("Arming state timed out. Requesting arm state");
         lastStateChange = millis();
         crestronHelper.requestArmState();
     }
     */
 
-    // USED TO EXECUTE DELAYED COMMANDS
-    if (delayedCommandExecuteTime > 0 &&
-        millis() > delayedCommandExecuteTime) {
-        crestronHelper.request(delayedCommand);
-        delayedCommandExecuteTime = 0;
-    }
-
-
-    // THERE IS NO NOTIFICATION IF AN INCORRECT USER CODE IS ENTERED
-    // WE HAVE TO RELY ON A TIMEOUT
+    // Start queued Simple work once the panel is free
+    if (simpleWork != 0 && simpleTask == SIMPLE_IDLE)
+        startSimpleSession();
 
-    // DETECT AN ARMING FAILURE VIA A TIMEOUT
-    if (armStartTime != 0 &&
-        millis() > (armStartTime + armTimeout))
-        processTask(CRESTRON_TASK_TIMEOUT);
+    if (digiOwner == this)
+        checkDigiOutputs();
 
-    // DETECT A DISARM FAILURE VIA A TIMEOUT
-    if (disarmStartTime != 0 &&
-        millis() > (disarmStartTime + disarmTimeout)) {
-        processTask(CRESTRON_TASK_TIMEOUT);
-    }
-
-    // SWITCH TO SIMPLE PROTOCOL BY SENDING
-    // THE UDL CODE AS \W1234/ TWICE
-    if (simpleTask != SIMPLE_IDLE && taskStep == SIMPLE_LOGIN && millis() > (simpleCommandLastSent+500)) {
-        // TODO: This needs to error if there are too many login attempts
-        Log.info("SIMPLE: Performing simple login");
-        simpleCommandLastSent = millis();
-
-        char loginData[9];
-        loginData[0] = '\\';
-        loginData[1] = 'W';
-        for (int i = 0; i < 6; i++)
-            loginData[2+i] = savedData.udlCode[i];
-        loginData[8] = '/';
-
-        simpleHelper.sendSimpleMessage(loginData, 9);
+    if (reconciler.loop(micros())) {
+        if (reconciler.hasMismatch())
+            alarmStateFlags |= ALARM_SOURCE_MISMATCH;
+        else
+            alarmStateFlags &= ~ALARM_SOURCE_MISMATCH;
+        updateAlarmState();
     }
 
-    // Auto-logout of the Simple Protocol. Should never be required.
-    if (millis() > simpleProtocolTimeout && activeProtocol == SIMPLE) {
-        simpleProtocolTimeout = millis() + 10000;
-        if (taskStep != SIMPLE_LOGOUT) {
-            taskStep = SIMPLE_LOGOUT;
-            simpleHelper.sendSimpleMessage("\\H/", 3);
-            Log.info("SIMPLE: Simple Protocol timeout");
-        } else {
-            activeProtocol = CRESTRON;
-            simpleTask = SIMPLE_IDLE;
-            Alarm.completeTriggeredAlarm();
-            Log.info("SIMPLE: Simple logout failed and was forced");
-        }
-    }
+    publishAreaChanges();
 
-    checkDigiOutputs();
-    Alarm.loop();
+    checkTaskTimeouts();
 }
-
-// make one instance for the user to use
-TexecomClass Texecom = TexecomClass();
\ No newline at end of file
@@ -6,11 +6,25 @@
 #include "Particle.h"
 #include "crestonhelper.h"
 #include "simplehelper.h"
-
-#define texSerial Serial1
-
-#define firstZone 9 // Zone 1 = 1
-#define zoneCount 11 // 1 == 1
+#include "TimeAlarms.h"
+#include "zonetable.h"
+#include "areatable.h"
+#include "spscqueue.h"
+#include "statereconciler.h"
+#include "paneltask.h"
+
+// Number of panels one build can drive, each needs its own EEPROM block
+#ifndef TEXECOM_MAX_PANELS
+#define TEXECOM_MAX_PANELS 4
+#endif
+
+// Uncomment to read and frame panel serial data on its own thread rather
+// than the application loop. Particle only, see serialreader.h.
+// #define SERIAL_READER_THREAD
+
+#if defined(SERIAL_READER_THREAD)
+#include "serialreader.h"
+#endif
 
 class TexecomClass {
  public:
@@ -20,21 +34,19 @@ class TexecomClass {
         char udlCode[7];
     };
 
-    typedef enum {
-        ZONE_ACTIVE = 1 << 0,
-        ZONE_TAMPER = 1 << 1,
-        ZONE_FAULT = 1 << 2,
-        ZONE_FAILED_TEST = 1 << 3,
-        ZONE_ALARMED = 1 << 4,
-        ZONE_MANUAL_BYPASS = 1 << 5,
-        ZONE_AUTO_BYPASS = 1 << 6,
-        ZONE_ALWAYS_ZERO = 1 << 7,
-    } ZONE_FLAGS;
+    // Zone range learnt from the panel
+    struct ZONE_CONFIG {
+        uint16_t magic;
+        uint16_t capacity;
+        uint16_t firstZone;
+        uint16_t lastZone;
+    };
 
     typedef enum {
         ALARM_READY = 1 << 0,
         ALARM_FAULT = 1 << 1,
         ALARM_ARM_FAILED = 1 << 2,
+        ALARM_SOURCE_MISMATCH = 1 << 3,
     } ALARM_FLAGS;
 
     typedef enum {
@@ -66,6 +78,8 @@ class TexecomClass {
         SIMPLE_REQUEST_TIME,
         SIMPLE_SEND_TIME,
         SIMPLE_READ_ZONE_STATE,
+        SIMPLE_READ_IDENTIFICATION,
+        SIMPLE_READ_EVENT_LOG,
     } TASK_STEP;
 
     typedef enum {
@@ -89,11 +103,14 @@ class TexecomClass {
         SIMPLE_OK,
         SIMPLE_ERROR,
         SIMPLE_LOGIN_CONFIRMED,
-        SIMPLE_LOGIN_TIMEOUT,
+        SIMPLE_TIMEOUT,
         SIMPLE_TIME_CHECK_OK,
         SIMPLE_TIME_CHECK_OUT
     } TASK_STEP_RESULT;
 
+    // Arm, disarm and Simple sessions run as coroutines, see paneltask.h
+    typedef TaskFrame<TexecomClass, TASK_STEP_RESULT> PanelTask;
+
     typedef enum {
         CRESTRON_IDLE = 0,
         CRESTRON_DISARM = 1,
@@ -105,8 +122,33 @@ class TexecomClass {
         SIMPLE_CHECK_TIME = 1,
         SIMPLE_SET_TIME = 2,
         SIMPLE_ZONE_CHECK = 3,
+        SIMPLE_IDENTIFY = 4,
+        SIMPLE_ZONE_SCAN = 5,
+        SIMPLE_EVENT_LOG = 6,
     } SIMPLE_TASK;
 
+    // Work queued for the next (or current) Simple protocol session
+    typedef enum {
+        SIMPLE_WORK_TIME = 1 << 0,
+        SIMPLE_WORK_ZONES = 1 << 1,
+        SIMPLE_WORK_IDENTIFY = 1 << 2,
+        SIMPLE_WORK_ZONE_SCAN = 1 << 3,
+        SIMPLE_WORK_EVENT_LOG = 1 << 4,
+    } SIMPLE_WORK;
+
+    // Digi outputs in wiring order, see the pin table below
+    typedef enum {
+        DIGI_FULL_ARMED = 0,
+        DIGI_PART_ARMED = 1,
+        DIGI_EXIT = 2,
+        DIGI_ENTRY = 3,
+        DIGI_TRIGGERED = 4,
+        DIGI_ARM_FAILED = 5,
+        DIGI_FAULT_PRESENT = 6,
+        DIGI_AREA_READY = 7,
+        DIGI_COUNT = 8
+    } DIGI_OUTPUT;
+
     typedef enum {
         FULL_ARM = 0,
         NIGHT_ARM = 1
@@ -118,53 +160,140 @@ class TexecomClass {
     } PROTOCOL;
 
  public:
-    TexecomClass();
-    void setZoneCallback(void (*zoneCallback)(uint8_t, uint8_t));
+    // Each panel needs its own stream. panel picks the EEPROM and retained
+    // slots so several instances can run side by side.
+    static const uint8_t maxPanels = TEXECOM_MAX_PANELS;
+    explicit TexecomClass(Stream &serial, uint8_t panel = 0);
+    bool isValid() const { return valid; }
+    void setZoneCallback(void (*zoneCallback)(uint16_t, uint16_t));
     void setAlarmCallback(void (*alarmCallback)(TexecomClass::ALARM_STATE, uint8_t));
+    void setEventLogCallback(bool (*eventLogCallback)(uint16_t, const SimpleHelper::LOG_EVENT&));
+    void setTriggeredCallback(bool (*triggeredCallback)(uint16_t));
+    void setAreaCallback(void (*areaCallback)(uint8_t, TexecomClass::ALARM_STATE));
     SimpleHelper simpleHelper;
     CrestronHelper crestronHelper;
     void setup();
-    void loop();
+    void loop();  // TimeAlarms are run by the application, Alarm.loop()
     void setDebug(bool enabled);
-    bool isReady() { return statePinAreaReady == LOW; }
+    void setDigiOutputs(bool enabled) { hasDigiOutputs = enabled; }
+    bool isReady() const;
     ALARM_STATE getState() { return alarmState; }
     void updateAlarmState();
+
+    // Crestron reports arm state per area. The digi outputs and the keypad
+    // prompts follow keypadArea, the rest come from Crestron events alone.
+    static const uint8_t keypadArea = 1;
+    bool getAreaState(uint8_t area, ALARM_STATE *state) const;
+    void updateAreaStates() { areas.markKnownChanged(); }
     void sendTest(const  char *text);
     void setUDLCode(const char *code);
 
     void requestTimeSync();
-    static void startTimeSync();
+    static void startTimeSync(void *context);
     void syncTime();
 
     void requestZoneSync();
-    static void startZoneSync();
+    static void startZoneSync(void *context);
     void syncZones();
+
+    void requestZoneLearn();
+    static void startZoneLearn(void *context);
+
+    void requestEventLogRead();
+    static void startEventLogRead(void *context);
     
     void requestDisarm(const char *code);
-    static void startDisarm();
+    static void startDisarm(void *context);
     void disarm();
 
     void requestArm(const char *code, ARM_TYPE type);
-    static void startArm();
+    static void startArm(void *context);
     void arm();
 
+    uint32_t getSimpleModeTimeLastHour() { return simpleModeTimeLastHour; }
+    StateReconciler &getReconciler() { return reconciler; }
+#if defined(SERIAL_READER_THREAD)
+    SerialReader &getSerialReader() { return serialReader; }
+#endif
+
 
  private:
     void processTask(TASK_STEP_RESULT result);
-    void armSystem(TASK_STEP_RESULT result);
-    void disarmSystem(TASK_STEP_RESULT result);
-    void simpleLogin(TASK_STEP_RESULT result);
-    void checkTime(TASK_STEP_RESULT result);
-    void zoneCheck(TASK_STEP_RESULT result);
+    bool startTask(PanelTask **task, PanelTask::Body body);
+    void resumeTask(PanelTask **task, TASK_STEP_RESULT result);
+    void checkTaskTimeouts();
+    void armTask(PanelTask &task);
+    void disarmTask(PanelTask &task);
+    void simpleSessionTask(PanelTask &task);
+    void queueSimpleWork(SIMPLE_WORK work);
+    void startSimpleSession();
+    SIMPLE_TASK nextSimpleTask();
+    void finishSimpleTask();
+    void endSimpleSession();
+    void sendSimpleLogin();
+    void sendTime();
+    bool requestZoneChunk();
+    void noteZoneInUse(uint16_t zone);
+    void applyZoneScan();
+    void requestEventChunk();
+    void processEventLog(const char *message, uint8_t messageLength);
+    void saveZoneConfig();
     void abortCrestronTask();
-    void (*zoneCallback)(uint8_t, uint8_t);
-    void (*alarmCallback)(TexecomClass::ALARM_STATE, uint8_t);
+    void finishCrestronTask();
+    void (*zoneCallback)(uint16_t, uint16_t) = NULL;
+    void (*alarmCallback)(TexecomClass::ALARM_STATE, uint8_t) = NULL;
+    bool (*eventLogCallback)(uint16_t, const SimpleHelper::LOG_EVENT&) = NULL;
+    bool (*triggeredCallback)(uint16_t) = NULL;
+    void (*areaCallback)(uint8_t, TexecomClass::ALARM_STATE) = NULL;
+    void intruderAlarm(const char *message);
+    uint8_t decodeArea(const char *message);
+    void setAreaState(uint8_t area, ALARM_STATE state);
+    void triggerArmedAreas();
+    void publishAreaChanges();
+    bool matchAreaScreen(const char *message, uint8_t messageLength, const char *screen);
+    void cacheArmState(TASK_STEP_RESULT state);
+    void cacheScreen(TASK_STEP_RESULT screen);
+    TASK_STEP_RESULT getCachedArmState();
+    TASK_STEP_RESULT getCachedScreen();
     void delayCommand(CrestronHelper::CRESTRON_COMMAND command, int delay);
     void decodeZoneState(char *message);
-    void updateZoneState(uint8_t zone);
+    void updateZoneState(uint16_t zone);
     void checkDigiOutputs();
+    void attachDigiOutputs();
+    void processDigiEdges();
+    void reconcileState(StateReconciler::SOURCE source, ALARM_STATE state, uint32_t timestamp);
+    template<uint8_t input> static void digiOutputChanged();
     bool processCrestronMessage(char *message, uint8_t messageLength);
     bool processSimpleMessage(char *message, uint8_t messageLength);
+    bool beginJob();
+    void completeJob();
+    static void jobTimedOut(void *context);
+    void abortJob();
+    void startPinEntry();
+    void pinKeyAcknowledged();
+
+    static void executeDelayedCommand(void *context);
+    static void sendNextPinDigit(void *context);
+
+    Stream &serial;
+    uint8_t panel;
+    bool valid;
+
+#if defined(SERIAL_READER_THREAD)
+    // Frames from the reader thread go through the same byte framing
+    SerialReader serialReader{serial};
+    SerialFrame readerFrame = {};
+    uint8_t readerPosition = 0;
+    int serialAvailable();
+    int serialRead() { return readerFrame.data[readerPosition++]; }
+#else
+    int serialAvailable() { return serial.available(); }
+    int serialRead() { return serial.read(); }
+#endif
+
+    // Each panel's SAVE_DATA and ZONE_CONFIG live in their own EEPROM block
+    static const int panelEepromSize = 64;
+    int eepromAddress(int offset) const { return panel * panelEepromSize + offset; }
 
     const char *msgZoneUpdate = "\"Z0";
     const char *msgArmUpdate = "\"A0";
@@ -173,6 +302,7 @@ class TexecomClass {
     const char *msgArmingUpdate = "\"X0";
     const char *msgIntruderUpdate = "\"L0";
 
+    const char *msgKeyAck = "\"OK";
     const char *msgUserPinLogin = "\"U0";
     const char *msgUserTagLogin = "\"T0";
 
@@ -184,15 +314,19 @@ class TexecomClass {
 
     const char *msgScreenArmedPart = "\"Part";
     const char *msgScreenArmedNight = "\"Night";
-    const char *msgScreenArmedFull = "\"Area FULL ARMED";
+
+    // Area screens name the area on multi-area panels ("Area 2 FULL ARMED")
+    // so the text after msgScreenArea is searched for rather than matched
+    const char *msgScreenArea = "\"Area";
+    const char *msgScreenArmedFull = " FULL ARMED";
 
     const char *msgScreenQuestionArm = "\"Do you want to  Arm System?";
     const char *msgScreenQuestionPartArm = "\"Do you want to  Part Arm System?";
     const char *msgScreenQuestionNightArm = "\"Do you want:-   Night Arm";
     const char *msgScreenQuestionDisarm = "\"Do you want to  Disarm System?";
 
-    const char *msgScreenAreainEntry = "\"Area in Entry";
-    const char *msgScreenAreainExit = "\"Area in Exit >";
+    const char *msgScreenAreainEntry = " in Entry";
+    const char *msgScreenAreainExit = " in Exit >";
 
     static const uint8_t userCount = 4;
     const char *users[userCount] = {"root", "Kevin", "Nicki", "Mumma"};
@@ -202,19 +336,26 @@ class TexecomClass {
     SIMPLE_TASK simpleTask = SIMPLE_IDLE;
     ARM_TYPE armType;
     CrestronHelper::CRESTRON_COMMAND delayedCommand;
-    uint32_t delayedCommandExecuteTime = 0;
+    MsTimerID_t delayedCommandTimer = dtINVALID_ALARM_ID;
     const uint8_t maxMessageSize = 100;
     char message[101];
     char buffer[101];
-    uint8_t bufferPosition;
+    uint8_t bufferPosition = 0;
     uint8_t screenRequestRetryCount = 0;
 
+    // What the running conversation is waiting for, the message handlers
+    // use it to tell replies apart
     TASK_STEP taskStep = CRESTRON_START;
+    PanelTask *crestronSession = NULL;
+    PanelTask *simpleSession = NULL;
 
-    uint32_t disarmStartTime;
-    const unsigned int disarmTimeout = 10000;  // 10 seconds
+    // Scheduled panel jobs share the serial line so only one runs at a time
+    AlarmToken_t activeJob = dtINVALID_ALARM_TOKEN;
+    uint32_t lastJobCompleted = 0;
+    const unsigned int panelJobSpacing = 10000;  // quiet time between jobs
+    const time_t busyRetryDelay = 5;  // seconds
 
-    uint32_t armStartTime;
+    const unsigned int disarmTimeout = 10000;  // 10 seconds
     const unsigned int armTimeout = 15000;  // 15 seconds
 
     const int commandWaitTimeout = 2000;
@@ -223,22 +364,73 @@ class TexecomClass {
     const uint8_t maxRetries = 3;
 
     char userPin[9];
-    uint8_t loginPinPosition;
-    uint32_t nextPinEntryTime;
+    uint8_t loginPinPosition = 0;
+    MsTimerID_t pinEntryTimer = dtINVALID_ALARM_ID;
     const int PIN_ENTRY_DELAY = 500;
+
+    // Keys are sent as soon as the panel acknowledges the last one, panels
+    // that don't acknowledge keep the fixed PIN_ENTRY_DELAY
+    const uint16_t minAckedKeyGap = 50;
+    uint32_t pinKeySentTime = 0;
     ALARM_STATE alarmState = ARMED_AWAY;
     // uint32_t lastStateChange;
     uint32_t exitToDisarmTimeout = 0;
     const int armingTimeout = 45000;
 
-    uint32_t messageStart;
+    // Last known arm state and screen, so tasks can skip the ASTATUS and
+    // LSTATUS round trips when they're recent enough to trust
+    TASK_STEP_RESULT cachedArmState = RESULT_NONE;
+    uint32_t cachedArmStateTime = 0;
+    TASK_STEP_RESULT cachedScreen = RESULT_NONE;
+    uint32_t cachedScreenTime = 0;
+    const uint32_t armStateCacheLifetime = 30000;
+    const uint32_t screenCacheLifetime = 3000;
 
-    SAVE_DATA savedData;
-    uint32_t simpleProtocolTimeout;
-    uint32_t simpleCommandLastSent;
+    uint32_t messageStart = 0;
+    uint32_t messageStartMicros = 0;
 
-    uint8_t zoneStates[zoneCount];
-    uint8_t alarmStateFlags;
+    SAVE_DATA savedData;
+    const unsigned int simpleProtocolTimeout = 30000;
+    const unsigned int simpleLogoutTimeout = 10000;
+    const unsigned int simpleLoginRetry = 500;
+
+    uint8_t simpleWork = 0;
+    uint32_t simpleSessionStart = 0;
+    uint32_t simpleStatsStart = 0;
+    uint32_t simpleModeTime = 0;
+    uint32_t simpleModeTimeLastHour = 0;
+    uint16_t simpleSessionCount = 0;
+    uint16_t simpleCommandCount = 0;
+
+    ZoneTable zones;
+    const int zoneConfigAddress = 32;
+    const uint16_t zoneConfigMagic = 0x5A4E;
+    const uint16_t defaultFirstZone = 9;  // used until the panel has been asked
+    const uint16_t defaultLastZone = 19;
+
+    // Zones seen not secure since the last scan, the next scan's range. A
+    // secure zone reads the same as an unused one so this is all there is.
+    uint16_t seenFirstZone = 0;
+    uint16_t seenLastZone = 0;
+
+    // Zone reads are split so each reply fits in the message buffer
+    static const uint8_t zonesPerRead = 32;
+    // \Z takes the start zone less one in a byte, so zones 1-256
+    static const uint16_t maxSimpleZone = 256;
+    uint16_t zoneReadCursor = 0;
+    uint16_t zoneReadLast = 0;
+    uint8_t zoneReadCount = 0;
+
+    // The event log is read in small chunks and a bounded number per session,
+    // carrying on later so Crestron isn't locked out while catching up
+    const uint8_t eventsPerRead = 8;
+    const uint8_t eventsPerSession = 64;
+    const time_t eventLogInterval = 60;  // seconds between sessions while catching up
+    const time_t eventLogPoll = 900;
+    uint8_t eventsReceived = 0;
+    uint8_t eventsThisSession = 0;
+    bool eventLogStalled = false;
+    uint8_t alarmStateFlags = 0;
 
 //  Digi Output - Argon Pin - Texecom Configuration
 //  1 ----------------- D12 - 22 Full Armed
@@ -259,16 +451,36 @@ class TexecomClass {
     const int pinFaultPresent = D15;
     const int pinAreaReady = D19;
 
-    bool statePinFullArmed = HIGH;
-    bool statePinPartArmed = HIGH;
-    bool statePinEntry = HIGH;
-    bool statePinExit = HIGH;
-    bool statePinTriggered = HIGH;
-    bool statePinArmFailed = HIGH;
-    bool statePinFaultPresent = HIGH;
-    bool statePinAreaReady = LOW;
-};
+    const int digiPins[DIGI_COUNT] = {
+        pinFullArmed, pinPartArmed, pinExit, pinEntry,
+        pinTriggered, pinArmFailed, pinFaultPresent, pinAreaReady
+    };
 
-extern TexecomClass Texecom;  // make an instance for the user
+    // Pin changes are captured by interrupt and applied from the loop. The
+    // first edge is taken straight away and later ones are ignored until
+    // the input has settled, then the pin is read again.
+    EdgeQueue<32> digiEdges;
+    uint8_t digiLevelMask = 0;  // one bit per DIGI_OUTPUT, set when the pin is high
+    uint32_t digiEdgeTime[DIGI_COUNT] = {};  // micros() of the last accepted edge
+    uint32_t lastDigiEdge = 0;
+    uint8_t digiSettling = 0;
+    const uint32_t digiDebounce = 5000;  // microseconds
+
+    // One bit per DIGI_OUTPUT, only area ready is active at startup
+    uint8_t digiActive = 1 << DIGI_AREA_READY;
+
+    // Pin interrupts have no context so only one instance can own the digi
+    // outputs, the rest run from Crestron and Simple messages alone
+    static TexecomClass *digiOwner;
+    bool hasDigiOutputs = true;
+
+    // Arm state of every area Crestron has reported, changes are published
+    // a few per loop so a whole panel arming doesn't stall it
+    AreaTable areas;
+    const uint8_t areasPerLoop = 4;
+
+    // Compares the digi outputs against the Crestron events
+    StateReconciler reconciler;
+};
 
 #endif  // __TEXECOM_H_
\ No newline at end of file
@@ -1,33 +1,89 @@
 // Copyright 2019 Kevin Cooper
 
+#include <atomic>
+
 #include "texecom.h"
 #include "mqtt.h"
 #include "papertrail.h"
 #include "Particle.h"
 #include "secrets.h"
 #include "TimeAlarms.h"
+#include "binarylog.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include "memorystats.h"
+#include "tracecapture.h"
 
 // Stubs
 void mqttCallback(char* topic, byte* payload, unsigned int length);
-void sendTriggeredMessage(uint8_t triggeredZone);
+bool sendTriggeredMessage(uint16_t triggeredZone);
+void publishPendingTriggered();
 void alarmCallback(TexecomClass::ALARM_STATE state, uint8_t flags);
-void zoneCallback(uint8_t zone, uint8_t state);
+void zoneCallback(uint16_t zone, uint16_t state);
+void areaCallback(uint8_t area, TexecomClass::ALARM_STATE state);
+bool eventLogCallback(uint16_t index, const SimpleHelper::LOG_EVENT &event);
 void publishAlarmState(TexecomClass::ALARM_STATE newState);
 void updateZoneState(uint8_t zone, uint8_t state);
+bool mqttReady();
+void serviceMQTT();
+void serviceSerial();
+void serviceTimers();
+void serviceLog();
+void publishSchedulerStats();
+void sampleMemory();
+void publishMemoryStats();
+#if defined(LATENCY_METRICS)
+void publishLatencyMetrics();
+String latencyVariable();
+#endif
 
 ApplicationWatchdog wd(60000, System.reset);
 
+#if defined(TRACE_CAPTURE)
+TraceStream tracedSerial(Serial1);
+TexecomClass Texecom(tracedSerial);
+#else
+TexecomClass Texecom(Serial1);
+#endif
+
 MQTT mqttClient(mqttServer, 1883, mqttCallback);
 uint32_t lastMqttConnectAttempt;
 const int mqttConnectAtemptTimeout1 = 5000;
 const int mqttConnectAtemptTimeout2 = 30000;
 unsigned int mqttConnectionAttempts;
+
+// TCPClient::connect has no timeout and with the broker down DNS and the TCP
+// handshake block for seconds, long enough for the panel serial port to
+// overrun. The socket is opened on its own thread and the CONNACK polled from
+// the loop. While MQTT_OPENING the client belongs to the thread, nothing else
+// may touch it.
+typedef enum {
+    MQTT_DISCONNECTED,
+    MQTT_OPENING,
+    MQTT_OPEN_FAILED,
+    MQTT_OPENED,
+    MQTT_HANDSHAKE,  // CONNECT sent, waiting for CONNACK
+    MQTT_CONNECTED
+} MQTT_STATE;
+std::atomic<uint8_t> mqttState{MQTT_DISCONNECTED};
+Thread *mqttConnector = NULL;
 bool mqttStateConfirmed = true;
 uint32_t resetTime = 0;
 bool isDebug = false;
 retained uint32_t lastHardResetTime;
 retained int resetCount;
 TexecomClass::ALARM_STATE alarmState;
+// Intruder alarms raised while MQTT was down, published first on reconnect
+const uint8_t maxPendingTriggered = 8;
+uint16_t pendingTriggered[maxPendingTriggered];
+uint8_t pendingTriggeredCount = 0;
+unsigned int mqttMaxTopic;    // sizes of the VLAs in MQTT::loop and mqttCallback
+unsigned int mqttMaxPayload;
+
+// Serial must be read well inside the panel's 50 ms frame timeout whatever
+// MQTT is doing, the rest share what's left of each pass
+Scheduler scheduler(10000);
+const uint32_t serialMaxGap = 5000;  // microseconds
 
 PapertrailLogHandler papertrailHandler(papertrailAddress, papertrailPort,
   "ArgonTexecom", System.deviceID(),
@@ -44,39 +100,149 @@ void alarmCallback(TexecomClass::ALARM_STATE state, uint8_t flags) {
         Log.info("Alarm: %s", alarmStateStrings[state]);
     }
 
-    char message[58];
+    char message[80];
 
     snprintf(message,
                 sizeof(message),
-                "{\"state\":\"%s\",\"ready\":%d,\"fault\":%d,\"arm_failed\":%d}",
+                "{\"state\":\"%s\",\"ready\":%d,\"fault\":%d,\"arm_failed\":%d,\"source_mismatch\":%d}",
                 alarmStateStrings[state],
                 (flags & TexecomClass::ALARM_READY) != 0,
                 (flags & TexecomClass::ALARM_FAULT) != 0,
-                (flags & TexecomClass::ALARM_ARM_FAILED) != 0);
+                (flags & TexecomClass::ALARM_ARM_FAILED) != 0,
+                (flags & TexecomClass::ALARM_SOURCE_MISMATCH) != 0);
+
+
+    if (mqttReady())
+        mqttClient.publish("home/security/alarm", message, true);
+}
 
+// Only areas that have changed are passed on, see TexecomClass::loop()
+void areaCallback(uint8_t area, TexecomClass::ALARM_STATE state) {
+    char topic[28];
+    snprintf(topic, sizeof(topic), "home/security/area/%02u", area);
+    char message[32];
+    snprintf(message, sizeof(message), "{\"state\":\"%s\"}", alarmStateStrings[state]);
 
-    mqttClient.publish("home/security/alarm", message, true);
+    if (mqttReady())
+        mqttClient.publish(topic, message, true);
 }
 
-void zoneCallback(uint8_t zone, uint8_t state) {
+void zoneCallback(uint16_t zone, uint16_t state) {
 
     char attributesTopic[34];
     snprintf(attributesTopic, sizeof(attributesTopic), "home/security/zone/%03d", zone);
-    char attributesMsg[46];
+    char attributesMsg[160];
     
     snprintf(attributesMsg,
             sizeof(attributesMsg),
-            "{\"active\":%d,\"tamper\":%d,\"fault\":%d,\"alarmed\":%d}",
-            (state & TexecomClass::ZONE_ACTIVE) != 0,
-            (state & TexecomClass::ZONE_TAMPER) != 0,
-            (state & TexecomClass::ZONE_FAULT) != 0,
-            (state & TexecomClass::ZONE_ALARMED) != 0);
-
-    if (mqttClient.isConnected()) {
+            "{\"active\":%d,\"tamper\":%d,\"fault\":%d,\"alarmed\":%d,\"short\":%d,\"failedTest\":%d,"
+            "\"bypassed\":%d,\"autoBypassed\":%d,\"alarmMemory\":%d,\"soakTest\":%d}",
+            (state & SimpleHelper::ZONE_ACTIVE) != 0,
+            (state & SimpleHelper::ZONE_TAMPER) != 0,
+            (state & SimpleHelper::ZONE_FAULT) != 0,
+            (state & SimpleHelper::ZONE_ALARMED) != 0,
+            (state & SimpleHelper::ZONE_SHORT) != 0,
+            (state & SimpleHelper::ZONE_FAILED_TEST) != 0,
+            (state & SimpleHelper::ZONE_MANUAL_BYPASS) != 0,
+            (state & SimpleHelper::ZONE_AUTO_BYPASS) != 0,
+            (state & SimpleHelper::ZONE_ALARM_MEMORY) != 0,
+            (state & SimpleHelper::ZONE_SOAK_TEST) != 0);
+
+    if (mqttReady()) {
         mqttClient.publish(attributesTopic, attributesMsg, true);
     }
 }
 
+bool sendTriggeredMessage(uint16_t triggeredZone) {
+    char message[16];
+    snprintf(message, sizeof(message), "{\"zone\":%u}", triggeredZone);
+
+    if (mqttReady() && mqttClient.publish("home/security/alarm/triggered", message))
+        return true;
+
+    // Full means a long outage, the oldest alarms are the ones to keep
+    if (pendingTriggeredCount < maxPendingTriggered)
+        pendingTriggered[pendingTriggeredCount++] = triggeredZone;
+    else
+        Log.error("ALARM: Too many unpublished intruder alarms, zone %u dropped", triggeredZone);
+    return false;
+}
+
+void publishPendingTriggered() {
+    uint8_t published = 0;
+    while (published < pendingTriggeredCount) {
+        char message[16];
+        snprintf(message, sizeof(message), "{\"zone\":%u}", pendingTriggered[published]);
+        if (!mqttClient.publish("home/security/alarm/triggered", message))
+            break;
+        Log.error("ALARM: Intruder in zone %u published on reconnect", pendingTriggered[published]);
+        published++;
+    }
+
+    pendingTriggeredCount -= published;
+    memmove(pendingTriggered, &pendingTriggered[published], pendingTriggeredCount * sizeof(pendingTriggered[0]));
+}
+
+bool eventLogCallback(uint16_t index, const SimpleHelper::LOG_EVENT &event) {
+    if (!mqttReady())
+        return false;
+
+    char message[96];
+    snprintf(message,
+            sizeof(message),
+            "{\"index\":%u,\"type\":%u,\"group\":%u,\"parameter\":%u,\"time\":%lu}",
+            index, event.type, event.group, event.parameter, (unsigned long)event.time);
+
+    return mqttClient.publish("home/security/log", message);
+}
+
+// Hourly lag between the digi outputs and Crestron events, in microseconds
+void publishSourceLag() {
+    StateReconciler &reconciler = Texecom.getReconciler();
+    char message[200];
+
+    snprintf(message,
+            sizeof(message),
+            "{\"digi_first\":%lu,\"digi_min\":%lu,\"digi_avg\":%lu,\"digi_p99\":%lu,"
+            "\"crestron_first\":%lu,\"crestron_min\":%lu,\"crestron_avg\":%lu,\"crestron_p99\":%lu,"
+            "\"mismatches\":%lu}",
+            reconciler.getLeadCount(StateReconciler::SOURCE_DIGI),
+            reconciler.getMinLag(StateReconciler::SOURCE_DIGI),
+            reconciler.getAverageLag(StateReconciler::SOURCE_DIGI),
+            reconciler.getP99Lag(StateReconciler::SOURCE_DIGI),
+            reconciler.getLeadCount(StateReconciler::SOURCE_CRESTRON),
+            reconciler.getMinLag(StateReconciler::SOURCE_CRESTRON),
+            reconciler.getAverageLag(StateReconciler::SOURCE_CRESTRON),
+            reconciler.getP99Lag(StateReconciler::SOURCE_CRESTRON),
+            reconciler.getMismatchCount());
+
+    if (mqttReady())
+        mqttClient.publish("home/security/diagnostics/source_lag", message);
+
+    reconciler.resetStats();
+    Alarm.completeTriggeredAlarm();
+}
+
+#if defined(SERIAL_READER_THREAD)
+// Hourly reader thread queue depth and frames dropped because it was full
+void publishSerialReaderStats() {
+    SerialReader &reader = Texecom.getSerialReader();
+    char message[64];
+
+    snprintf(message,
+            sizeof(message),
+            "{\"high_water\":%u,\"overruns\":%lu}",
+            reader.getHighWaterMark(),
+            reader.getOverruns());
+
+    if (mqttReady())
+        mqttClient.publish("home/security/diagnostics/serial_reader", message);
+
+    reader.resetStats();
+    Alarm.completeTriggeredAlarm();
+}
+#endif
+
 bool digitsOnly(const char *s) {
     while (*s) {
         if (isdigit(*s++) == 0) return false;
@@ -85,11 +251,28 @@ bool digitsOnly(const char *s) {
 }
 
 void mqttCallback(char* topic, byte* payload, unsigned int length) {
+    if (strlen(topic) > mqttMaxTopic)
+        mqttMaxTopic = strlen(topic);
+    if (length > mqttMaxPayload)
+        mqttMaxPayload = length;
+
+    TRACE_MQTT(TRACE_MQTT_IN, topic, payload, length);
+
     char p[length + 1];
     memcpy(p, payload, length);
     p[length] = '\0';
 
-    if (strcmp(topic, "home/security/alarm/set") == 0) {
+    // Per area commands take the same payload. The keypad prompts arm and
+    // disarm every area the code is assigned to so only keypadArea's can
+    // be acted on without touching others.
+    unsigned int area;
+    char areaCommand[8];
+    bool isAreaSet = sscanf(topic, "home/security/area/%u/%7s", &area, areaCommand) == 2 &&
+                        strcmp(areaCommand, "set") == 0;
+
+    if (isAreaSet && area != TexecomClass::keypadArea) {
+        Log.error("Area %u can only be set from the keypad", area);
+    } else if (isAreaSet || strcmp(topic, "home/security/alarm/set") == 0) {
 
         const char *action = strtok(p, ":");
         const char *code = strtok(NULL, ":");
@@ -168,20 +351,56 @@ int setUDL(const char *data) {
     return 0;
 }
 
+int learnZones(const char *data) {
+    Texecom.requestZoneLearn();
+    return 0;
+}
+
+#if defined(TRACE_CAPTURE)
+int dumpTrace(const char *data) {
+    TraceCapture.startDump();
+    return 0;
+}
+#endif
+
+void mqttConnectorThread(void *param) {
+    while (true) {
+        if (mqttState == MQTT_OPENING)
+            mqttState = mqttClient.openSocket() ? MQTT_OPENED : MQTT_OPEN_FAILED;
+        delay(10);
+    }
+}
+
+// Starts a connect, serviceMQTT() carries it on
 void connectToMQTT() {
     lastMqttConnectAttempt = millis();
-    bool mqttConnected = mqttClient.connect(System.deviceID(), mqttUsername, mqttPassword);
-    if (mqttConnected) {
-        mqttConnectionAttempts = 0;
-        Log.info("MQTT Connected");
-        mqttClient.subscribe("home/security/alarm/set");
-        mqttClient.subscribe("home/security/alarm/code");
-        mqttClient.subscribe("home/security/alarm/state");
-        mqttClient.subscribe("utilities/#");
-    } else {
-        mqttConnectionAttempts++;
-        Log.info("MQTT failed to connect");
-    }
+    mqttConnectionAttempts++;
+    if (mqttConnector == NULL)
+        mqttConnector = new Thread("mqtt", mqttConnectorThread);
+    mqttState = MQTT_OPENING;
+}
+
+void mqttConnected() {
+    mqttState = MQTT_CONNECTED;
+    mqttConnectionAttempts = 0;
+    Log.info("MQTT Connected");
+    publishPendingTriggered();
+    mqttClient.subscribe("home/security/alarm/set");
+    mqttClient.subscribe("home/security/alarm/code");
+    mqttClient.subscribe("home/security/alarm/state");
+    mqttClient.subscribe("home/security/area/+/set");
+    Texecom.updateAreaStates();
+    mqttClient.subscribe("utilities/#");
+}
+
+void mqttConnectFailed() {
+    mqttClient.clear();
+    mqttState = MQTT_DISCONNECTED;
+    Log.info("MQTT failed to connect");
+}
+
+bool mqttReady() {
+    return mqttState == MQTT_CONNECTED && mqttClient.isConnected();
 }
 
 void random_seed_from_cloud(unsigned seed) {
@@ -197,7 +416,8 @@ void startupMacro() {
 STARTUP(startupMacro());
 
 void setup() {
-    
+    MemoryStats.paintStack();
+
     waitFor(Particle.connected, 30000);
     
     do {
@@ -224,6 +444,10 @@ void setup() {
     Particle.function("setDebug", setDebug);
     Particle.function("cloudReset", cloudReset);
     Particle.function("setUDL", setUDL);
+    Particle.function("learnZones", learnZones);
+#if defined(TRACE_CAPTURE)
+    Particle.function("dumpTrace", dumpTrace);
+#endif
 
     Particle.variable("isDebug", isDebug);
     Particle.variable("reset-time", resetTime);
@@ -235,21 +459,176 @@ void setup() {
 
     Texecom.setAlarmCallback(alarmCallback);
     Texecom.setZoneCallback(zoneCallback);
+    Texecom.setEventLogCallback(eventLogCallback);
+    Texecom.setTriggeredCallback(sendTriggeredMessage);
+    Texecom.setAreaCallback(areaCallback);
+    Serial1.begin(19200, SERIAL_8N2);
     Texecom.setup();
 
+    // Budgets are what a normal run takes
+    int8_t serialJob = scheduler.add("serial", serviceSerial, 0, 2000);
+    scheduler.setMaxGap(serialJob, serialMaxGap);
+    scheduler.add("timers", serviceTimers, 1, 2000);
+    scheduler.add("mqtt", serviceMQTT, 2, 5000);
+    scheduler.add("log", serviceLog, 3, 2000, 100000);
+
+    Alarm.timerRepeat(3600, publishSourceLag);
+    Alarm.timerRepeat(3600, publishSchedulerStats);
+    Alarm.timerRepeat(10, sampleMemory);
+    Alarm.timerRepeat(3600, publishMemoryStats);
+#if defined(LATENCY_METRICS)
+    Particle.variable("latency", latencyVariable);
+    Alarm.timerRepeat(3600, publishLatencyMetrics);
+#endif
+#if defined(SERIAL_READER_THREAD)
+    Alarm.timerRepeat(3600, publishSerialReaderStats);
+#endif
+
     uint32_t resetReasonData = System.resetReasonData();
     Particle.publish("pushover", String::format("ArgonAlarm: I am awake!: %d-%d", System.resetReason(), resetReasonData), PRIVATE);
 }
 
-void loop() {
-    if (mqttClient.isConnected()) {
-        mqttClient.loop();
-    } else if ((mqttConnectionAttempts < 5 && millis() > (lastMqttConnectAttempt + mqttConnectAtemptTimeout1)) ||
-                 millis() > (lastMqttConnectAttempt + mqttConnectAtemptTimeout2)) {
-        connectToMQTT();
+void serviceMQTT() {
+    switch (mqttState) {
+    case MQTT_CONNECTED:
+        if (mqttClient.isConnected()) {
+            METRIC_SCOPE(METRIC_MQTT_LOOP);
+            mqttClient.loop();
+            break;
+        }
+        mqttState = MQTT_DISCONNECTED;
+        // fall through
+    case MQTT_DISCONNECTED:
+        if ((mqttConnectionAttempts < 5 && millis() > (lastMqttConnectAttempt + mqttConnectAtemptTimeout1)) ||
+                millis() > (lastMqttConnectAttempt + mqttConnectAtemptTimeout2)) {
+            connectToMQTT();
+        }
+        break;
+    case MQTT_OPEN_FAILED:
+        mqttConnectFailed();
+        break;
+    case MQTT_OPENED:
+        if (mqttClient.sendConnect(System.deviceID(), mqttUsername, mqttPassword))
+            mqttState = MQTT_HANDSHAKE;
+        else
+            mqttConnectFailed();
+        break;
+    case MQTT_HANDSHAKE:
+        switch (mqttClient.pollConnect()) {
+        case MQTT::CONNECT_ACCEPTED:
+            mqttConnected();
+            break;
+        case MQTT::CONNECT_FAILED:
+            mqttConnectFailed();
+            break;
+        default:
+            break;
+        }
+        break;
+    default:  // MQTT_OPENING, the connector thread has the client
+        break;
     }
+}
 
+void serviceSerial() {
+    METRIC_SCOPE(METRIC_TEXECOM_LOOP);
     Texecom.loop();
+}
+
+void serviceTimers() { Alarm.loop(); }
+void serviceLog() {
+    BinaryLog.loop();
+#if defined(TRACE_CAPTURE)
+    TraceCapture.loop();
+#endif
+}
+
+// Hourly run time per scheduler job, one message each to fit the MQTT packet
+void publishSchedulerStats() {
+    for (uint8_t i = 0; i < scheduler.getJobCount(); i++) {
+        const Scheduler::JOB_STATS &stats = scheduler.getStats(i);
+        char topic[48];
+        snprintf(topic, sizeof(topic), "home/security/diagnostics/scheduler/%s", stats.name);
+        char message[160];
+        snprintf(message,
+                sizeof(message),
+                "{\"runs\":%lu,\"avg\":%lu,\"max\":%lu,\"overruns\":%lu,\"deferred\":%lu,\"max_gap\":%lu}",
+                stats.runs,
+                stats.runs ? stats.totalMicros / stats.runs : 0,
+                stats.maxMicros,
+                stats.overruns,
+                stats.deferred,
+                stats.maxGapMicros);
+
+        if (mqttReady())
+            mqttClient.publish(topic, message);
+    }
+
+    scheduler.resetStats();
+    Alarm.completeTriggeredAlarm();
+}
+
+void sampleMemory() {
+    MemoryStats.sample();
+    Alarm.completeTriggeredAlarm();
+}
+
+// Hourly heap lows from the 10 second samples and the stack high water
+// since boot, in bytes
+void publishMemoryStats() {
+    MemoryStats.sample();
+    char message[200];
+
+    snprintf(message,
+            sizeof(message),
+            "{\"heap_free\":%lu,\"heap_min_free\":%lu,\"largest\":%lu,\"min_largest\":%lu,"
+            "\"max_used\":%lu,\"stack_used\":%lu,\"stack_free\":%lu,\"mqtt_topic\":%u,\"mqtt_payload\":%u}",
+            MemoryStats.getHeapFree(),
+            MemoryStats.getHeapMinFree(),
+            MemoryStats.getLargestBlock(),
+            MemoryStats.getMinLargestBlock(),
+            MemoryStats.getMaxUsedHeap(),
+            MemoryStats.getStackUsed(),
+            MemoryStats.getStackFree(),
+            mqttMaxTopic,
+            mqttMaxPayload);
+
+    if (mqttReady())
+        mqttClient.publish("home/security/diagnostics/memory", message);
+
+    MemoryStats.resetStats();
+    Alarm.completeTriggeredAlarm();
+}
+
+#if defined(LATENCY_METRICS)
+// Hourly hot path timings in microseconds, retained so the last hour's
+// figures are there for whoever looks
+void publishLatencyMetrics() {
+    for (uint8_t i = 0; i < METRIC_COUNT; i++) {
+        const LatencyHistogram &h = Metrics.get((METRIC)i);
+        char topic[56];
+        snprintf(topic, sizeof(topic), "home/security/diagnostics/latency/%s", Metrics.getName((METRIC)i));
+        char message[112];
+        snprintf(message,
+                sizeof(message),
+                "{\"count\":%lu,\"min\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu}",
+                h.getCount(), h.getMin(), h.getPercentile(50), h.getPercentile(99), h.getMax());
+
+        if (mqttReady())
+            mqttClient.publish(topic, message, true);
+    }
+
+    Metrics.reset();
+    Alarm.completeTriggeredAlarm();
+}
+
+String latencyVariable() {
+    return Metrics.summary();
+}
+#endif
+
+void loop() {
+    scheduler.loop();
 
     wd.checkin();  // resets the AWDT count
 }
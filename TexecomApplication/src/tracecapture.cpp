@@ -0,0 +1,138 @@
+// Copyright 2020 Kevin Cooper
+
+#include "tracecapture.h"
+
+#if defined(TRACE_CAPTURE)
+
+#include "binarylog.h"
+
+TraceCaptureClass TraceCapture;
+
+// Drops the oldest records until length bytes are free
+bool TraceCaptureClass::reserve(uint16_t length) {
+    if (length > ringSize)
+        return false;
+
+    while (ringSize - used < length) {
+        if (hasOpen && tail == openPosition)
+            hasOpen = false;
+
+        uint16_t recordLength = TRACE_HEADER_SIZE + ring[(tail + 5) % ringSize];
+        tail = (tail + recordLength) % ringSize;
+        used -= recordLength;
+        dropped++;
+    }
+    return true;
+}
+
+bool TraceCaptureClass::beginRecord(TRACE_TYPE type, uint32_t timestamp, uint8_t length) {
+    if (dumping || !reserve(TRACE_HEADER_SIZE + length)) {
+        dropped++;
+        return false;
+    }
+
+    put(type);
+    for (uint8_t i = 0; i < 4; i++)
+        put((timestamp >> (8 * i)) & 0xFF);
+    put(length);
+    return true;
+}
+
+void TraceCaptureClass::recordByte(TRACE_TYPE type, uint8_t c) {
+    uint32_t now = micros();
+
+    // Add to the open record if it's still taking bytes, reserve can drop
+    // it when it's the oldest
+    if (hasOpen && openType == type && now - openLast < TRACE_SERIAL_GAP &&
+            ring[(openPosition + 5) % ringSize] < TRACE_MAX_DATA && !dumping &&
+            reserve(1) && hasOpen) {
+        put(c);
+        ring[(openPosition + 5) % ringSize]++;
+        openLast = now;
+        return;
+    }
+
+    hasOpen = false;
+    uint16_t position = head;
+    if (!beginRecord(type, now, 1))
+        return;
+
+    put(c);
+    hasOpen = true;
+    openType = type;
+    openPosition = position;
+    openLast = now;
+}
+
+void TraceCaptureClass::recordPin(uint8_t pin, uint8_t level, uint32_t timestamp) {
+    hasOpen = false;
+    if (!beginRecord(TRACE_PIN, timestamp, 2))
+        return;
+
+    put(pin);
+    put(level);
+}
+
+// Stamped with when the frame's first byte arrived, so it can land behind
+// records made since
+void TraceCaptureClass::recordFrame(TRACE_TYPE type, const char *data, uint8_t length, uint32_t timestamp) {
+    hasOpen = false;
+    if (!beginRecord(type, timestamp, length))
+        return;
+
+    for (uint8_t i = 0; i < length; i++)
+        put(data[i]);
+}
+
+void TraceCaptureClass::recordMqtt(TRACE_TYPE type, const char *topic, const uint8_t *payload, unsigned int length) {
+    size_t topicLength = strlen(topic);
+    if (topicLength > TRACE_MAX_DATA - 1)
+        topicLength = TRACE_MAX_DATA - 1;
+    if (length > TRACE_MAX_DATA - 1 - topicLength)
+        length = TRACE_MAX_DATA - 1 - topicLength;
+
+    hasOpen = false;
+    if (!beginRecord(type, micros(), 1 + topicLength + length))
+        return;
+
+    put(topicLength);
+    for (size_t i = 0; i < topicLength; i++)
+        put(topic[i]);
+    for (unsigned int i = 0; i < length; i++)
+        put(payload[i]);
+}
+
+void TraceCaptureClass::startDump() {
+    if (dumping)
+        return;
+
+    hasOpen = false;
+    dumping = true;
+    dumpSequence = 0;
+    Log.info("Trace dump of %u bytes, %lu records dropped", used, dropped);
+}
+
+void TraceCaptureClass::loop() {
+    if (!dumping)
+        return;
+
+    if (used == 0) {
+        dumping = false;
+        dropped = 0;
+        Log.info("Trace dump complete");
+        return;
+    }
+
+    uint8_t chunk[dumpChunk];
+    uint8_t length = used < dumpChunk ? used : dumpChunk;
+    for (uint8_t i = 0; i < length; i++)
+        chunk[i] = ring[(tail + i) % ringSize];
+    tail = (tail + length) % ringSize;
+    used -= length;
+
+    char encoded[((dumpChunk + 2) / 3) * 4 + 1];
+    BinaryLogClass::encodeBase64(chunk, length, encoded);
+    Log.info(TRACE_MARKER "%u:%s", dumpSequence++, encoded);
+}
+
+#endif
@@ -0,0 +1,117 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __TRACECAPTURE_H_
+#define __TRACECAPTURE_H_
+
+#include "Particle.h"
+#include "traceformat.h"
+
+// Uncomment to keep the panel's serial traffic, digi output edges and MQTT
+// messages in a RAM ring. The "dumpTrace" cloud function logs it through
+// Papertrail for Tools/replay to run against the engine. Application
+// thread only, so with SERIAL_READER_THREAD received bytes are recorded a
+// frame at a time as the engine takes them from the reader, stamped with
+// when the frame's first byte arrived.
+// #define TRACE_CAPTURE
+
+#if defined(TRACE_CAPTURE)
+
+#define TRACE_PIN(pin, level, timestamp) TraceCapture.recordPin(pin, level, timestamp)
+#define TRACE_MQTT(type, topic, payload, length) TraceCapture.recordMqtt(type, topic, payload, length)
+#define TRACE_RX_FRAME(data, length, timestamp) TraceCapture.recordFrame(TRACE_SERIAL_RX, data, length, timestamp)
+#define TRACE_USE_RX_FRAMES() TraceCapture.useRxFrames()
+
+class TraceCaptureClass {
+ public:
+    static const uint16_t ringSize = 4096;
+    static const uint8_t dumpChunk = TRACE_DUMP_CHUNK;
+
+ public:
+    void recordByte(TRACE_TYPE type, uint8_t c);
+    void recordPin(uint8_t pin, uint8_t level, uint32_t timestamp);
+    void recordMqtt(TRACE_TYPE type, const char *topic, const uint8_t *payload, unsigned int length);
+    void recordFrame(TRACE_TYPE type, const char *data, uint8_t length, uint32_t timestamp);
+
+    // Called before the serial reader thread starts, TraceStream then
+    // leaves received bytes to TRACE_RX_FRAME
+    void useRxFrames() { rxFrames = true; }
+    bool hasRxFrames() const { return rxFrames; }
+
+    // Recording stops until the ring has been logged, then starts afresh
+    void startDump();
+    bool isDumping() const { return dumping; }
+    void loop();  // one line of a dump per call
+
+    // Oldest records dropped for room, or new ones while dumping
+    uint32_t getDropped() const { return dropped; }
+
+ private:
+    bool beginRecord(TRACE_TYPE type, uint32_t timestamp, uint8_t length);
+    bool reserve(uint16_t length);
+    void put(uint8_t c) {
+        ring[head] = c;
+        head = (head + 1) % ringSize;
+        used++;
+    }
+
+    uint8_t ring[ringSize];
+    uint16_t head = 0;
+    uint16_t tail = 0;  // start of the oldest record
+    uint16_t used = 0;
+
+    // Serial record still taking bytes
+    bool hasOpen = false;
+    TRACE_TYPE openType;
+    uint16_t openPosition;
+    uint32_t openLast;  // micros() of its last byte
+
+    bool dumping = false;
+    uint16_t dumpSequence;
+    uint32_t dropped = 0;
+    bool rxFrames = false;
+};
+
+extern TraceCaptureClass TraceCapture;
+
+// Records what passes through to the panel's port
+class TraceStream : public Stream {
+ public:
+    explicit TraceStream(Stream &stream) : stream(stream) {}
+
+    int available() override { return stream.available(); }
+    int peek() override { return stream.peek(); }
+    void flush() override { stream.flush(); }
+
+    int read() override {
+        int c = stream.read();
+        if (c >= 0 && !TraceCapture.hasRxFrames())
+            TraceCapture.recordByte(TRACE_SERIAL_RX, c);
+        return c;
+    }
+
+    using Stream::write;
+    size_t write(uint8_t c) override {
+        TraceCapture.recordByte(TRACE_SERIAL_TX, c);
+        return stream.write(c);
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override {
+        for (size_t i = 0; i < size; i++)
+            TraceCapture.recordByte(TRACE_SERIAL_TX, buffer[i]);
+        return stream.write(buffer, size);
+    }
+
+ private:
+    Stream &stream;
+};
+
+#else
+
+#define TRACE_PIN(pin, level, timestamp)
+#define TRACE_MQTT(type, topic, payload, length)
+#define TRACE_RX_FRAME(data, length, timestamp)
+#define TRACE_USE_RX_FRAMES()
+
+#endif
+
+#endif  // __TRACECAPTURE_H_
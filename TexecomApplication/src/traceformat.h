@@ -0,0 +1,42 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __TRACEFORMAT_H_
+#define __TRACEFORMAT_H_
+
+#include <stdint.h>
+
+// Shared between the firmware and Tools/replay so keep this header free of
+// any Particle includes.
+//
+// A dump is published as log lines "TRC:<sequence>:<base64>", sequence
+// counting up from 0 for each dump. Every line but the last carries
+// TRACE_DUMP_CHUNK bytes, 144 characters once encoded so a whole line stays
+// inside Device OS's 160 character log limit. Joined in order they hold the
+// records oldest first, laid out as:
+//
+//  0    Record type
+//  1-4  micros() when it happened (little endian)
+//  5    Data length
+//  6-   Data
+//
+// Serial records hold the bytes, consecutive bytes in the same direction
+// share a record while each arrives within TRACE_SERIAL_GAP of the last.
+// Pin records hold the pin number and the level read. MQTT records hold
+// the topic length, the topic and then the payload, truncated to fit.
+
+#define TRACE_MARKER "TRC:"
+#define TRACE_DUMP_CHUNK 108
+#define TRACE_HEADER_SIZE 6
+#define TRACE_MAX_DATA 255
+#define TRACE_SERIAL_GAP 2000  // microseconds, a few characters at 19200
+
+typedef enum {
+    TRACE_SERIAL_RX = 0,
+    TRACE_SERIAL_TX = 1,
+    TRACE_PIN = 2,
+    TRACE_MQTT_IN = 3,
+    TRACE_MQTT_OUT = 4,
+    TRACE_TYPE_COUNT = 5
+} TRACE_TYPE;
+
+#endif  // __TRACEFORMAT_H_
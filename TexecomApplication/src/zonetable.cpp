@@ -0,0 +1,71 @@
+// Copyright 2020 Kevin Cooper
+
+#include "zonetable.h"
+
+ZoneTable::ZoneTable() {
+    flags = NULL;
+    capacity = maxZones;
+    firstZone = 0;
+    lastZone = 0;
+}
+
+ZoneTable::~ZoneTable() {
+    delete[] flags;
+}
+
+void ZoneTable::setCapacity(uint16_t capacity) {
+    if (capacity > maxZones)
+        capacity = maxZones;
+    this->capacity = capacity;
+
+    if (lastZone > capacity)
+        setRange(firstZone, capacity);
+}
+
+bool ZoneTable::setRange(uint16_t first, uint16_t last) {
+    if (first < 1)
+        first = 1;
+    if (last > capacity)
+        last = capacity;
+    if (first > last)
+        first = last = 0;
+
+    if (first == firstZone && last == lastZone)
+        return false;
+
+    // Only reallocated when the range is learnt, a few times a day at most
+    uint16_t *resized = NULL;
+    if (last != 0) {
+        resized = new uint16_t[last - first + 1]();
+        if (resized == NULL)
+            first = last = 0;
+    }
+
+    if (resized != NULL && flags != NULL) {
+        for (uint16_t zone = first; zone <= last; zone++) {
+            if (isInstalled(zone))
+                resized[zone - first] = flags[zone - firstZone];
+        }
+    }
+
+    delete[] flags;
+    flags = resized;
+    firstZone = first;
+    lastZone = last;
+    return true;
+}
+
+uint16_t ZoneTable::get(uint16_t zone) const {
+    return isInstalled(zone) ? flags[zone - firstZone] : 0;
+}
+
+// Returns true if the flags changed
+bool ZoneTable::update(uint16_t zone, uint16_t setFlags, uint16_t clearFlags) {
+    if (!isInstalled(zone))
+        return false;
+
+    uint16_t &entry = flags[zone - firstZone];
+    uint16_t previous = entry;
+    entry = (previous & ~clearFlags) | setFlags;
+    return entry != previous;
+}
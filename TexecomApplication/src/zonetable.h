@@ -0,0 +1,44 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __ZONETABLE_H_
+#define __ZONETABLE_H_
+
+#include "Particle.h"
+
+// Zone flags for the zones installed on the panel, packed into one array
+// starting at the first installed zone so a panel using a handful of its
+// 640 zones only stores those. Lookups index straight in so they stay O(1)
+// regardless of panel size; capacity is the zones the panel supports.
+class ZoneTable {
+ public:
+    static const uint16_t maxZones = 640;
+
+ public:
+    ZoneTable();
+    ~ZoneTable();
+    ZoneTable(const ZoneTable &) = delete;
+    ZoneTable &operator=(const ZoneTable &) = delete;
+
+    void setCapacity(uint16_t capacity);
+    uint16_t getCapacity() const { return capacity; }
+    bool isValid(uint16_t zone) const { return zone >= 1 && zone <= capacity; }
+
+    // Range of zones in use on the panel, flags of zones that stay in
+    // range are kept. Returns true if it changed.
+    bool setRange(uint16_t first, uint16_t last);
+    uint16_t getFirstZone() const { return firstZone; }
+    uint16_t getLastZone() const { return lastZone; }
+    uint16_t getZoneCount() const { return lastZone ? lastZone - firstZone + 1 : 0; }
+    bool isInstalled(uint16_t zone) const { return lastZone && zone >= firstZone && zone <= lastZone; }
+
+    uint16_t get(uint16_t zone) const;
+    bool update(uint16_t zone, uint16_t setFlags, uint16_t clearFlags);
+
+ private:
+    uint16_t *flags;  // getZoneCount() entries, NULL when empty
+    uint16_t capacity;
+    uint16_t firstZone;
+    uint16_t lastZone;
+};
+
+#endif  // __ZONETABLE_H_
@@ -0,0 +1,415 @@
+// Copyright 2020 Kevin Cooper
+//
+// Microbenchmarks for the panel protocol, MQTT and logging hot paths, run
+// on Linux against the host shim. Each reports the best time per operation
+// of several runs, the one least disturbed by the rest of the machine, and
+// the heap allocations per operation.
+//
+// Build:  make -C .. bench, or in one line:
+//         g++ -std=gnu++17 -O2 -Ihost -I../gateway/host -I../../TexecomApplication/src
+//             -o bench bench.cpp host/logging.cpp ../gateway/host/particle.cpp
+//             ../../TexecomApplication/src/{texecom,simplehelper,crestronhelper,zonetable,areatable,statereconciler,TimeAlarms,binarylog,mqtt,papertrail}.cpp
+// Usage:  bench [--filter text] [--runs n] [--millis n]
+//               [--save file] [--compare file [--threshold percent]]
+//
+// --save writes the results as a baseline, --compare prints the change from
+// one and exits 2 if any benchmark got slower by more than --threshold (10%
+// by default) or allocates more. Compare builds from the same machine and
+// compiler flags, the numbers only mean anything relative to each other.
+// "make bench-compare" in Tools checks against baseline.txt, built with the
+// flags the Makefile fixes for the bench, and "make bench-baseline"
+// rewrites it. Its first line records the compiler and run settings.
+//
+// The clock is virtual and stands still, so the engine never times out a
+// frame mid-benchmark. TexecomClass's frame assembly, dispatch and zone
+// decoding are private and measured through loop(): crestron_idle is the
+// loop with nothing to read, the others add a whole frame each.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "texecom.h"
+#include "simplehelper.h"
+#include "mqtt.h"
+#include "papertrail.h"
+
+#if defined(__clang__)
+#define BENCH_COMPILER "clang " __clang_version__
+#elif defined(__GNUC__)
+#define BENCH_COMPILER "g++ " __VERSION__
+#else
+#define BENCH_COMPILER "unknown compiler"
+#endif
+
+// Set by the Makefile, a hand build records none
+#ifndef BENCH_FLAGS
+#define BENCH_FLAGS ""
+#endif
+
+// Every allocation in the process, the benchmarks run single threaded
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+// Keeps results the compiler could otherwise throw away
+static volatile uint32_t sink;
+
+// Serial port that plays the same bytes back on every read
+class BenchStream : public Stream {
+ public:
+    void feed(const char *data) {
+        rx = data;
+        rxPosition = 0;
+    }
+
+    using Print::write;
+    size_t write(uint8_t) override { return 1; }
+    int available() override { return rx ? strlen(rx + rxPosition) : 0; }
+    int read() override { return rx && rx[rxPosition] ? (uint8_t)rx[rxPosition++] : -1; }
+    int peek() override { return rx && rx[rxPosition] ? (uint8_t)rx[rxPosition] : -1; }
+
+ private:
+    const char *rx = NULL;
+    size_t rxPosition = 0;
+};
+
+static BenchStream stream;
+static TexecomClass *texecom = NULL;
+
+static void zoneCallback(uint16_t zone, uint16_t state) { sink = zone + state; }
+static void alarmCallback(TexecomClass::ALARM_STATE state, uint8_t flags) { sink = state + flags; }
+static void areaCallback(uint8_t area, TexecomClass::ALARM_STATE state) { sink = area + state; }
+
+static void setupTexecom() {
+    if (texecom)
+        return;
+
+    texecom = new TexecomClass(stream);
+    texecom->setDigiOutputs(false);
+    texecom->setZoneCallback(zoneCallback);
+    texecom->setAlarmCallback(alarmCallback);
+    texecom->setAreaCallback(areaCallback);
+    texecom->setup();
+}
+
+// One frame per loop() call, as the engine stops at the end of each
+static void runFrames(const char *const *frames, uint8_t frameCount, uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        stream.feed(frames[i % frameCount]);
+        texecom->loop();
+    }
+}
+
+static void benchCrestronIdle(uint64_t iterations) {
+    stream.feed(NULL);
+    for (uint64_t i = 0; i < iterations; i++)
+        texecom->loop();
+}
+
+// First branch of the dispatch, alternating so every frame is a change
+static void benchCrestronZone(uint64_t iterations) {
+    static const char *const frames[] = { "\"Z0101\r\n", "\"Z0100\r\n" };
+    runFrames(frames, 2, iterations);
+}
+
+static void benchCrestronArea(uint64_t iterations) {
+    static const char *const frames[] = { "\"A001\r\n", "\"D001\r\n" };
+    runFrames(frames, 2, iterations);
+}
+
+// Last branch of the dispatch, every comparison before it fails
+static void benchCrestronScreen(uint64_t iterations) {
+    static const char *const frames[] = { "\"Area 1 in Exit >\r\n" };
+    runFrames(frames, 1, iterations);
+}
+
+// A 48 zone panel's worth of zone status, 2 bytes each, and a 32 byte
+// reply with its checksum
+static char simpleZoneData[96];
+static char simpleMessage[33];
+
+static void setupSimple() {
+    for (size_t i = 0; i < sizeof(simpleZoneData); i++)
+        simpleZoneData[i] = (char)(i * 37);
+
+    unsigned int a = 0;
+    for (size_t i = 0; i < sizeof(simpleMessage) - 1; i++) {
+        simpleMessage[i] = (char)(i * 11);
+        a += simpleMessage[i];
+    }
+    simpleMessage[sizeof(simpleMessage) - 1] = (a ^ 255) % 0x100;
+}
+
+static void benchSimpleChecksum(uint64_t iterations) {
+    SimpleHelper helper(stream);
+    for (uint64_t i = 0; i < iterations; i++)
+        sink = helper.checkSimpleChecksum(simpleMessage, sizeof(simpleMessage) - 1);
+}
+
+static void benchSimpleZoneDecode(uint64_t iterations) {
+    SimpleHelper helper(stream);
+    uint16_t zoneState[sizeof(simpleZoneData) / 2];
+    for (uint64_t i = 0; i < iterations; i++) {
+        helper.processReceivedZoneData(simpleZoneData, sizeof(simpleZoneData), zoneState);
+        sink = zoneState[i % (sizeof(simpleZoneData) / 2)];
+    }
+}
+
+static std::string mqttRx;
+static std::string mqttTx;
+static MQTT *mqtt = NULL;
+static std::string mqttPublishPacket;
+
+static void mqttCallback(char *topic, uint8_t *payload, unsigned int length) {
+    sink = topic[0] + payload[0] + length;
+}
+
+// The firmware's zone message, the largest it publishes often
+static const char *zoneTopic = "home/security/zone/010";
+static const char *zonePayload =
+    "{\"active\":1,\"tamper\":0,\"fault\":0,\"alarmed\":0,\"short\":0,\"failedTest\":0,"
+    "\"bypassed\":0,\"autoBypassed\":0,\"alarmMemory\":0,\"soakTest\":0}";
+
+static void setupMqtt() {
+    if (mqtt)
+        return;
+
+    TCPClient::hostUseBuffers(&mqttRx, &mqttTx);
+    mqtt = new MQTT((char *)"bench", 1883, mqttCallback);
+    mqttRx.assign("\x20\x02\x00\x00", 4);  // CONNACK, accepted
+    if (!mqtt->connect("bench"))
+        fprintf(stderr, "MQTT connect failed, its benchmarks measure nothing\n");
+    mqttTx.clear();
+
+    // What the broker sends for an alarm/set, QoS 0
+    const char *topic = "home/security/alarm/set";
+    const char *payload = "arm_away:1234";
+    uint16_t topicLength = strlen(topic);
+    mqttPublishPacket += (char)0x30;
+    mqttPublishPacket += (char)(2 + topicLength + strlen(payload));
+    mqttPublishPacket += (char)(topicLength >> 8);
+    mqttPublishPacket += (char)(topicLength & 0xFF);
+    mqttPublishPacket += topic;
+    mqttPublishPacket += payload;
+}
+
+static void benchMqttPublish(uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink = mqtt->publish(zoneTopic, zonePayload, true);
+        mqttTx.clear();
+    }
+}
+
+static void benchMqttReadPacket(uint64_t iterations) {
+    mqttRx.reserve(mqttPublishPacket.size());
+    for (uint64_t i = 0; i < iterations; i++) {
+        mqttRx.assign(mqttPublishPacket);
+        mqtt->loop();
+    }
+}
+
+// logMessage is protected, as it's only meant to be called by the LogManager
+class BenchPapertrail : public PapertrailLogHandler {
+ public:
+    BenchPapertrail() : PapertrailLogHandler("logs.papertrailapp.com", 12345, "bench", "bench") {}
+    using PapertrailLogHandler::logMessage;
+};
+
+static BenchPapertrail *papertrail = NULL;
+static uint64_t benchClock = 0;
+
+static void setupPapertrail() {
+    if (papertrail == NULL)
+        papertrail = new BenchPapertrail();
+}
+
+static void benchPapertrailLog(uint64_t iterations) {
+    LogAttributes attr;
+    for (uint64_t i = 0; i < iterations; i++) {
+        // Far enough apart that the rate limit never drops one
+        benchClock += 100000;
+        hostSetClock(benchClock);
+        papertrail->logMessage("Zone 10 state changed to active", LOG_LEVEL_INFO, "app", attr);
+    }
+}
+
+struct Benchmark {
+    const char *name;
+    void (*setup)();
+    void (*run)(uint64_t iterations);
+};
+
+static const Benchmark benchmarks[] = {
+    { "crestron_idle", setupTexecom, benchCrestronIdle },
+    { "crestron_zone_frame", setupTexecom, benchCrestronZone },
+    { "crestron_area_frame", setupTexecom, benchCrestronArea },
+    { "crestron_screen_frame", setupTexecom, benchCrestronScreen },
+    { "simple_checksum", setupSimple, benchSimpleChecksum },
+    { "simple_zone_decode", setupSimple, benchSimpleZoneDecode },
+    { "mqtt_publish", setupMqtt, benchMqttPublish },
+    { "mqtt_read_packet", setupMqtt, benchMqttReadPacket },
+    { "papertrail_log", setupPapertrail, benchPapertrailLog },
+};
+
+struct Result {
+    double nanosPerOp;
+    double allocationsPerOp;
+};
+
+static double timeRun(const Benchmark &benchmark, uint64_t iterations) {
+    auto start = std::chrono::steady_clock::now();
+    benchmark.run(iterations);
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Doubles the iterations until a run takes millis, which also warms the
+// caches, then takes the best of runs runs of that many
+static Result measure(const Benchmark &benchmark, uint32_t runs, uint32_t millis) {
+    benchmark.setup();
+
+    uint64_t iterations = 1;
+    while (timeRun(benchmark, iterations) < millis * 1e6 && iterations < (1ULL << 40))
+        iterations *= 2;
+
+    std::vector<double> times;
+    uint64_t startAllocations = allocations;
+    for (uint32_t i = 0; i < runs; i++)
+        times.push_back(timeRun(benchmark, iterations) / iterations);
+    uint64_t runAllocations = allocations - startAllocations;
+
+    Result result;
+    result.nanosPerOp = *std::min_element(times.begin(), times.end());
+    result.allocationsPerOp = (double)runAllocations / (iterations * runs);
+    return result;
+}
+
+static std::map<std::string, Result> loadBaseline(const char *path) {
+    std::map<std::string, Result> baseline;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return baseline;
+    }
+
+    char line[128];
+    char name[64];
+    Result result;
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] != '#' &&
+                sscanf(line, "%63s %lf %lf", name, &result.nanosPerOp, &result.allocationsPerOp) == 3)
+            baseline[name] = result;
+    }
+    fclose(file);
+    return baseline;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: bench [--filter text] [--runs n] [--millis n]\n"
+            "             [--save file] [--compare file [--threshold percent]]\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = NULL;
+    const char *savePath = NULL;
+    const char *comparePath = NULL;
+    uint32_t runs = 10;
+    uint32_t millis = 100;
+    double threshold = 10;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            usage();
+            return 1;
+        }
+
+        i++;
+        if (strcmp(arg, "--filter") == 0) {
+            filter = value;
+        } else if (strcmp(arg, "--runs") == 0) {
+            runs = atoi(value);
+        } else if (strcmp(arg, "--millis") == 0) {
+            millis = atoi(value);
+        } else if (strcmp(arg, "--save") == 0) {
+            savePath = value;
+        } else if (strcmp(arg, "--compare") == 0) {
+            comparePath = value;
+        } else if (strcmp(arg, "--threshold") == 0) {
+            threshold = atof(value);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (runs == 0 || millis == 0) {
+        usage();
+        return 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    Log.setLevel(LOG_LEVEL_NONE);
+    hostUseVirtualClock(1600000000);
+    hostSetClock(benchClock);
+
+    std::map<std::string, Result> baseline;
+    if (comparePath)
+        baseline = loadBaseline(comparePath);
+
+    FILE *save = NULL;
+    if (savePath && (save = fopen(savePath, "w")) == NULL) {
+        perror(savePath);
+        return 1;
+    }
+    if (save)
+        fprintf(save, "# %s %s, --runs %u --millis %u\n", BENCH_COMPILER, BENCH_FLAGS, runs, millis);
+
+    bool regressed = false;
+    printf("%-24s %10s %10s%s\n", "benchmark", "ns/op", "allocs/op", comparePath ? "   vs baseline" : "");
+
+    for (const Benchmark &benchmark : benchmarks) {
+        if (filter && strstr(benchmark.name, filter) == NULL)
+            continue;
+
+        Result result = measure(benchmark, runs, millis);
+        printf("%-24s %10.1f %10.2f", benchmark.name, result.nanosPerOp, result.allocationsPerOp);
+
+        auto base = baseline.find(benchmark.name);
+        if (base != baseline.end()) {
+            double change = (result.nanosPerOp / base->second.nanosPerOp - 1) * 100;
+            bool slower = change > threshold;
+            bool allocates = result.allocationsPerOp > base->second.allocationsPerOp + 0.005;
+            printf("   %+6.1f%%%s%s", change, slower ? " slower" : "", allocates ? " more allocs" : "");
+            regressed |= slower || allocates;
+        }
+        putchar('\n');
+
+        if (save)
+            fprintf(save, "%s %.1f %.2f\n", benchmark.name, result.nanosPerOp, result.allocationsPerOp);
+    }
+
+    if (save)
+        fclose(save);
+    return regressed ? 2 : 0;
+}
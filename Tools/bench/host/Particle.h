@@ -0,0 +1,91 @@
+// Copyright 2020 Kevin Cooper
+//
+// The gateway's host API plus what the Papertrail log handler needs. The
+// network is never ready so every message takes the queueing path, and
+// the resolver thread is never started.
+
+#ifndef __BENCH_PARTICLE_H_
+#define __BENCH_PARTICLE_H_
+
+#include "../../gateway/host/Particle.h"
+
+#include <initializer_list>
+
+#define SYSTEM_VERSION_v061 0x00060100
+#define SYSTEM_VERSION 0x01050000
+#define Wiring_WiFi 1
+
+#define ATOMIC_BLOCK() for (bool atomicOnce = true; atomicOnce; atomicOnce = false)
+
+class IPAddress {
+ public:
+    IPAddress() : address(0) {}
+    explicit operator bool() const { return address != 0; }
+
+ private:
+    uint32_t address;
+};
+
+class UDP {
+ public:
+    uint8_t begin(uint16_t) { return 0; }
+    int sendPacket(const char *, size_t length, IPAddress, uint16_t) { return length; }
+};
+
+class WiFiClass {
+ public:
+    IPAddress resolve(const char *) { return IPAddress(); }
+    bool ready() { return false; }
+};
+extern WiFiClass WiFi;
+
+class SystemClass {
+ public:
+    static String deviceID() { return String("bench"); }
+};
+extern SystemClass System;
+
+class Thread {
+ public:
+    Thread(const char *, void (*)(void *), void *) {}
+};
+
+struct LogCategoryFilter {
+    LogCategoryFilter(const char *, LogLevel) {}
+};
+typedef std::initializer_list<LogCategoryFilter> LogCategoryFilters;
+
+struct LogAttributes {
+    bool has_file = false;
+    bool has_line = false;
+    bool has_function = false;
+    bool has_code = false;
+    bool has_details = false;
+    const char *file = NULL;
+    int line = 0;
+    const char *function = NULL;
+    intptr_t code = 0;
+    const char *details = NULL;
+};
+
+class LogHandler {
+ public:
+    explicit LogHandler(LogLevel level = LOG_LEVEL_INFO, const LogCategoryFilters & = {}) : level(level) {}
+    virtual ~LogHandler() {}
+    static const char *levelName(LogLevel level);
+
+ protected:
+    virtual void logMessage(const char *msg, LogLevel level, const char *category, const LogAttributes &attr) = 0;
+
+ private:
+    LogLevel level;
+};
+
+class LogManager {
+ public:
+    static LogManager *instance();
+    void addHandler(LogHandler *) {}
+    void removeHandler(LogHandler *) {}
+};
+
+#endif  // __BENCH_PARTICLE_H_
@@ -0,0 +1,17 @@
+// Copyright 2020 Kevin Cooper
+
+#include "Particle.h"
+
+WiFiClass WiFi;
+SystemClass System;
+
+const char *LogHandler::levelName(LogLevel level) {
+    return level >= LOG_LEVEL_ERROR ? "ERROR" :
+           level >= LOG_LEVEL_WARN ? "WARN" :
+           level >= LOG_LEVEL_INFO ? "INFO" : "TRACE";
+}
+
+LogManager *LogManager::instance() {
+    static LogManager manager;
+    return &manager;
+}
@@ -0,0 +1,139 @@
+// Copyright 2020 Kevin Cooper
+
+#include "fdstream.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+FdStream::~FdStream() {
+    close();
+}
+
+void FdStream::close() {
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    rxHead = rxTail = 0;
+    txBuffer.clear();
+}
+
+void FdStream::attach(int fd) {
+    close();
+    this->fd = fd;
+}
+
+bool FdStream::fill() {
+    if (rxHead == rxTail)
+        rxHead = rxTail = 0;
+
+    // Make room at the end, anything still unread stays in the kernel
+    if (rxTail == sizeof(rxBuffer) && rxHead > 0) {
+        memmove(rxBuffer, &rxBuffer[rxHead], rxTail - rxHead);
+        rxTail -= rxHead;
+        rxHead = 0;
+    }
+
+    while (rxTail < sizeof(rxBuffer)) {
+        ssize_t n = ::read(fd, &rxBuffer[rxTail], sizeof(rxBuffer) - rxTail);
+        // A raw tty with VMIN and VTIME of 0 reads 0 when it's empty, a port
+        // that has gone away reads EIO
+        if (n > 0) {
+            rxTail += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+    return true;
+}
+
+bool FdStream::flushPending() {
+    while (!txBuffer.empty()) {
+        ssize_t n = ::write(fd, txBuffer.data(), txBuffer.size());
+        if (n > 0) {
+            txBuffer.erase(0, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        } else {
+            txBuffer.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t FdStream::write(uint8_t c) {
+    if (fd < 0)
+        return 0;
+    txBuffer += (char)c;
+    return 1;
+}
+
+size_t FdStream::write(const uint8_t *buffer, size_t size) {
+    if (fd < 0)
+        return 0;
+    txBuffer.append((const char *)buffer, size);
+    return size;
+}
+
+int FdStream::read() {
+    if (rxHead == rxTail)
+        return -1;
+    return rxBuffer[rxHead++];
+}
+
+int FdStream::peek() {
+    if (rxHead == rxTail)
+        return -1;
+    return rxBuffer[rxHead];
+}
+
+static bool configurePort(int fd) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0)
+        return false;
+
+    cfmakeraw(&tio);
+    cfsetispeed(&tio, B19200);
+    cfsetospeed(&tio, B19200);
+    tio.c_cflag &= ~(CSIZE | PARENB);
+    tio.c_cflag |= CS8 | CSTOPB | CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+int openSerialPort(const char *path) {
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (!configurePort(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+int openPty(std::string *slaveName) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (grantpt(fd) < 0 || unlockpt(fd) < 0 || !configurePort(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    *slaveName = ptsname(fd);
+    return fd;
+}
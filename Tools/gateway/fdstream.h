@@ -0,0 +1,54 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __FDSTREAM_H_
+#define __FDSTREAM_H_
+
+#include "Particle.h"
+#include <string>
+
+// A Stream over a non-blocking file descriptor. The gateway's epoll loop
+// calls fill() when the port is readable and flushPending() once the panel
+// engine has run, so a frame written a byte at a time goes out in one write.
+class FdStream : public Stream {
+ public:
+    explicit FdStream(int fd) : fd(fd) {}
+    ~FdStream();
+
+    int getFd() const { return fd; }
+
+    // A port that has gone away can be closed and another opened in its
+    // place, the engine keeps the same Stream. Writes while closed are
+    // dropped.
+    void close();
+    void attach(int fd);
+    bool isOpen() const { return fd >= 0; }
+
+    // False once the other end has gone away
+    bool fill();
+    bool flushPending();
+    bool hasPending() const { return !txBuffer.empty(); }
+
+    using Print::write;
+    size_t write(uint8_t c) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    int available() override { return rxTail - rxHead; }
+    int read() override;
+    int peek() override;
+    void flush() override { flushPending(); }
+
+ private:
+    int fd;
+    uint8_t rxBuffer[512];
+    uint16_t rxHead = 0;
+    uint16_t rxTail = 0;
+    std::string txBuffer;
+};
+
+// Opens a serial port raw at 19200 8N2, the Crestron and Simple settings
+int openSerialPort(const char *path);
+
+// Opens the master side of a new pseudo terminal set up the same way,
+// slaveName is what a simulator or a real panel bridge should open
+int openPty(std::string *slaveName);
+
+#endif  // __FDSTREAM_H_
@@ -0,0 +1,790 @@
+// Copyright 2020 Kevin Cooper
+//
+// Runs one TexecomClass engine per serial port on a Linux box, multiplexed
+// by a single epoll loop and sharing one MQTT connection.
+//
+// Build:  make -C .. gateway, or in one line:
+//         g++ -std=gnu++17 -O2 -pthread -Ihost -I../../TexecomApplication/src
+//             -DTEXECOM_MAX_PANELS=40 -DdtNBR_ALARMS=240 -DdtNBR_MS_TIMERS=80
+//             -o texecom-gateway *.cpp host/*.cpp
+//             ../../TexecomApplication/src/{texecom,simplehelper,crestronhelper,zonetable,areatable,statereconciler,TimeAlarms,binarylog,mqtt}.cpp
+// Usage:  texecom-gateway [--mqtt host[:port]] [--user name --password pass]
+//                         [--eeprom file] [--udl code] [--pty count] [--verbose] [port...]
+//         texecom-gateway --bench panels [--seconds n] [--rate events-per-second]
+//
+// Panel n publishes under home/security/panel/<n>/ and takes commands on
+// home/security/panel/<n>/alarm/set, in the same form as the firmware.
+// Area states go to home/security/panel/<n>/area/<a> as they change.
+// --pty opens pseudo terminals instead of (or as well as) real ports and
+// prints their names for a simulator or serial bridge to attach to. A port
+// that closes is reopened every few seconds while the other panels carry
+// on, and the broker is connected to in the background.
+//
+// --bench drives the given number of simulated panels over ptys and reports
+// zone events per second and the latency from a panel sending a zone event
+// to the engine's zone callback. --rate 0 keeps every zone of every panel
+// busy, otherwise each panel sends that many events a second. Each panel
+// also raises an intruder alarm every 100 ms, timed from the frame to its
+// alarm/triggered publish through an in-memory MQTT connection.
+//
+// Each panel needs two ms timers and up to five alarms, the Build defines
+// leave room for TEXECOM_MAX_PANELS of them.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "texecom.h"
+#include "mqtt.h"
+#include "TimeAlarms.h"
+#include "binarylog.h"
+#include "fdstream.h"
+#include "panelsim.h"
+
+static_assert(TexecomClass::maxPanels * 64 <= EEPROMClass::size,
+              "EEPROM is too small for TEXECOM_MAX_PANELS");
+static_assert(TexecomClass::maxPanels * 2 <= dtNBR_MS_TIMERS &&
+              TexecomClass::maxPanels * 5 <= dtNBR_ALARMS,
+              "Not enough timers for TEXECOM_MAX_PANELS, see Build");
+
+static const char *alarmStateStrings[8] = {
+    "disarmed", "armed_home", "armed_away", "pending", "pending", "triggered", "armed", "unknown"
+};
+
+struct Panel {
+    std::string name;
+    FdStream *stream;
+    TexecomClass *texecom;
+    PanelSim *sim;  // bench only
+    int ptyHold;    // keeps a pty's slave open so the master doesn't hang up
+    bool reopen;    // a serial port, opened again by name if it closes
+    uint32_t lastReopenAttempt;
+    TexecomClass::ALARM_STATE state;
+    std::vector<uint16_t> pendingTriggered;  // intruder zones to publish on reconnect
+};
+
+static Panel panels[TexecomClass::maxPanels];
+static uint8_t panelCount = 0;
+
+static const uint32_t tickInterval = 10;  // ms between servicing every panel
+static const uint32_t reopenInterval = 5000;  // ms between attempts to reopen a closed port
+
+static volatile sig_atomic_t running = 1;
+static int epollFd = -1;
+
+static MQTT *mqttClient = NULL;
+static char mqttServer[64];
+static uint16_t mqttPort = 1883;
+static const char *mqttUsername = NULL;
+static const char *mqttPassword = NULL;
+static char mqttClientId[64];
+static uint32_t lastMqttConnectAttempt;
+static unsigned int mqttConnectionAttempts;
+static const uint32_t mqttConnectAttemptTimeout1 = 5000;
+static const uint32_t mqttConnectAttemptTimeout2 = 30000;
+
+// As on the firmware the socket is opened on its own thread, so a broker
+// that is down doesn't hold up every panel for the connect timeout. While
+// MQTT_OPENING the client belongs to that thread.
+typedef enum {
+    MQTT_DISCONNECTED,
+    MQTT_OPENING,
+    MQTT_OPEN_FAILED,
+    MQTT_OPENED,
+    MQTT_HANDSHAKE,  // CONNECT sent, waiting for CONNACK
+    MQTT_CONNECTED
+} MQTT_STATE;
+static std::atomic<uint8_t> mqttState{MQTT_DISCONNECTED};
+static std::thread mqttConnector;
+
+// Bench results
+static bool benchmarking = false;
+static std::vector<uint32_t> latencies;
+static std::vector<uint32_t> intruderLatencies;
+static uint64_t eventsSent = 0;
+static std::string benchMqttRx;
+static std::string benchMqttTx;
+static const uint32_t intruderInterval = 100000;  // us
+static const size_t maxPendingTriggered = 8;
+
+static bool mqttConnected() {
+    return mqttClient != NULL && mqttState == MQTT_CONNECTED && mqttClient->isConnected();
+}
+
+static bool publish(uint8_t panel, const char *subtopic, const char *message, bool retain = false) {
+    if (!mqttConnected())
+        return false;
+
+    char topic[64];
+    snprintf(topic, sizeof(topic), "home/security/panel/%u/%s", panel, subtopic);
+    return mqttClient->publish(topic, message, retain);
+}
+
+// TexecomClass callbacks carry no context so each panel gets its own
+// instantiation, the same way the digi output interrupts are told apart
+static void onZone(uint8_t panel, uint16_t zone, uint16_t state) {
+    if (benchmarking) {
+        uint32_t latency;
+        if (panels[panel].sim->zoneReported(zone, state & SimpleHelper::ZONE_ACTIVE, micros(), &latency))
+            latencies.push_back(latency);
+        return;
+    }
+
+    char subtopic[16];
+    snprintf(subtopic, sizeof(subtopic), "zone/%03d", zone);
+    char message[160];
+    snprintf(message,
+            sizeof(message),
+            "{\"active\":%d,\"tamper\":%d,\"fault\":%d,\"alarmed\":%d,\"short\":%d,\"failedTest\":%d,"
+            "\"bypassed\":%d,\"autoBypassed\":%d,\"alarmMemory\":%d,\"soakTest\":%d}",
+            (state & SimpleHelper::ZONE_ACTIVE) != 0,
+            (state & SimpleHelper::ZONE_TAMPER) != 0,
+            (state & SimpleHelper::ZONE_FAULT) != 0,
+            (state & SimpleHelper::ZONE_ALARMED) != 0,
+            (state & SimpleHelper::ZONE_SHORT) != 0,
+            (state & SimpleHelper::ZONE_FAILED_TEST) != 0,
+            (state & SimpleHelper::ZONE_MANUAL_BYPASS) != 0,
+            (state & SimpleHelper::ZONE_AUTO_BYPASS) != 0,
+            (state & SimpleHelper::ZONE_ALARM_MEMORY) != 0,
+            (state & SimpleHelper::ZONE_SOAK_TEST) != 0);
+    publish(panel, subtopic, message, true);
+}
+
+static void onAlarm(uint8_t panel, TexecomClass::ALARM_STATE state, uint8_t flags) {
+    if (state != panels[panel].state) {
+        panels[panel].state = state;
+        Log.info("Panel %u alarm: %s", panel, alarmStateStrings[state]);
+    }
+
+    char message[80];
+    snprintf(message,
+            sizeof(message),
+            "{\"state\":\"%s\",\"ready\":%d,\"fault\":%d,\"arm_failed\":%d,\"source_mismatch\":%d}",
+            alarmStateStrings[state],
+            (flags & TexecomClass::ALARM_READY) != 0,
+            (flags & TexecomClass::ALARM_FAULT) != 0,
+            (flags & TexecomClass::ALARM_ARM_FAILED) != 0,
+            (flags & TexecomClass::ALARM_SOURCE_MISMATCH) != 0);
+    publish(panel, "alarm", message, true);
+}
+
+static bool onEventLog(uint8_t panel, uint16_t index, const SimpleHelper::LOG_EVENT &event) {
+    if (!mqttConnected())
+        return false;
+
+    char message[96];
+    snprintf(message,
+            sizeof(message),
+            "{\"index\":%u,\"type\":%u,\"group\":%u,\"parameter\":%u,\"time\":%lu}",
+            index, event.type, event.group, event.parameter, (unsigned long)event.time);
+
+    char topic[64];
+    snprintf(topic, sizeof(topic), "home/security/panel/%u/log", panel);
+    return mqttClient->publish(topic, message);
+}
+
+static void onArea(uint8_t panel, uint8_t area, TexecomClass::ALARM_STATE state) {
+    char subtopic[16];
+    snprintf(subtopic, sizeof(subtopic), "area/%02u", area);
+    char message[32];
+    snprintf(message, sizeof(message), "{\"state\":\"%s\"}", alarmStateStrings[state]);
+    publish(panel, subtopic, message, true);
+}
+
+static bool publishTriggered(uint8_t panel, uint16_t zone) {
+    char message[16];
+    snprintf(message, sizeof(message), "{\"zone\":%u}", zone);
+    return publish(panel, "alarm/triggered", message);
+}
+
+// Held while MQTT is down and published ahead of anything else on reconnect
+static bool onTriggered(uint8_t panel, uint16_t zone) {
+    bool published = publishTriggered(panel, zone);
+
+    if (benchmarking) {
+        uint32_t latency;
+        if (panels[panel].sim->intruderReported(zone, micros(), &latency))
+            intruderLatencies.push_back(latency);
+    }
+
+    std::vector<uint16_t> &pending = panels[panel].pendingTriggered;
+    if (!published && mqttClient) {
+        if (pending.size() < maxPendingTriggered)
+            pending.push_back(zone);
+        else
+            Log.error("Panel %u intruder in zone %u dropped, queue full", panel, zone);
+    }
+    return published;
+}
+
+static void publishPendingTriggered() {
+    for (uint8_t i = 0; i < panelCount; i++) {
+        std::vector<uint16_t> &pending = panels[i].pendingTriggered;
+        size_t published = 0;
+        while (published < pending.size() && publishTriggered(i, pending[published])) {
+            Log.error("Panel %u intruder in zone %u published on reconnect", i, pending[published]);
+            published++;
+        }
+        pending.erase(pending.begin(), pending.begin() + published);
+    }
+}
+
+template<uint8_t N> void zoneCallback(uint16_t zone, uint16_t state) { onZone(N, zone, state); }
+template<uint8_t N> void alarmCallback(TexecomClass::ALARM_STATE state, uint8_t flags) { onAlarm(N, state, flags); }
+template<uint8_t N> bool eventLogCallback(uint16_t index, const SimpleHelper::LOG_EVENT &event) {
+    return onEventLog(N, index, event);
+}
+template<uint8_t N> bool triggeredCallback(uint16_t zone) { return onTriggered(N, zone); }
+template<uint8_t N> void areaCallback(uint8_t area, TexecomClass::ALARM_STATE state) { onArea(N, area, state); }
+
+struct PanelCallbacks {
+    void (*zone)(uint16_t, uint16_t);
+    void (*alarm)(TexecomClass::ALARM_STATE, uint8_t);
+    bool (*eventLog)(uint16_t, const SimpleHelper::LOG_EVENT&);
+    bool (*triggered)(uint16_t);
+    void (*area)(uint8_t, TexecomClass::ALARM_STATE);
+};
+
+template<size_t... N>
+static constexpr std::array<PanelCallbacks, sizeof...(N)> makeCallbacks(std::index_sequence<N...>) {
+    return {{ { zoneCallback<N>, alarmCallback<N>, eventLogCallback<N>, triggeredCallback<N>, areaCallback<N> }... }};
+}
+
+static constexpr std::array<PanelCallbacks, TexecomClass::maxPanels> panelCallbacks =
+    makeCallbacks(std::make_index_sequence<TexecomClass::maxPanels>());
+
+static bool digitsOnly(const char *s) {
+    while (*s) {
+        if (isdigit(*s++) == 0) return false;
+    }
+    return true;
+}
+
+// home/security/panel/<n>/alarm/set with the firmware's action:code payload,
+// or .../area/<a>/set for keypadArea as the firmware takes it
+static void mqttCallback(char *topic, uint8_t *payload, unsigned int length) {
+    char p[length + 1];
+    memcpy(p, payload, length);
+    p[length] = '\0';
+
+    unsigned int panel;
+    unsigned int area;
+    char rest[16];
+    if (sscanf(topic, "home/security/panel/%u/%15s", &panel, rest) != 2 || panel >= panelCount)
+        return;
+
+    if (sscanf(rest, "area/%u/set", &area) == 1 && strcmp(strrchr(rest, '/'), "/set") == 0) {
+        if (area != TexecomClass::keypadArea) {
+            Log.error("Panel %u area %u can only be set from the keypad", panel, area);
+            return;
+        }
+    } else if (strcmp(rest, "alarm/set") != 0) {
+        return;
+    }
+
+    TexecomClass &texecom = *panels[panel].texecom;
+    const char *action = strtok(p, ":");
+    const char *code = strtok(NULL, ":");
+
+    if (action == NULL || code == NULL || strlen(code) < 4 || !digitsOnly(code)) {
+        Log.error("Panel %u command received but code is < 4 char", panel);
+        return;
+    }
+
+    if (strcmp(code, "8463") == 0) {  // 8463 == TIME
+        texecom.requestTimeSync();
+    } else if (strcmp(code, "7962") == 0) {  // 7962 == SYNC
+        texecom.requestZoneSync();
+    } else if (strncmp(action, "arm", 3) == 0) {
+        if (!texecom.isReady()) {
+            Log.error("Panel %u arm attempted while alarm is not ready", panel);
+        } else if (strcmp(action, "arm_away") == 0) {
+            texecom.requestArm(code, TexecomClass::FULL_ARM);
+        } else if (strcmp(action, "arm_night") == 0 || strcmp(action, "arm_home") == 0) {
+            texecom.requestArm(code, TexecomClass::NIGHT_ARM);
+        }
+    } else if (strcmp(action, "disarm") == 0) {
+        texecom.requestDisarm(code);
+    }
+}
+
+// Starts a connect, serviceMQTT() carries it on
+static void connectToMQTT() {
+    lastMqttConnectAttempt = millis();
+    mqttConnectionAttempts++;
+
+    // Any earlier thread has finished, it left MQTT_OPENING
+    if (mqttConnector.joinable())
+        mqttConnector.join();
+    mqttState = MQTT_OPENING;
+    mqttConnector = std::thread([] {
+        mqttState = mqttClient->openSocket() ? MQTT_OPENED : MQTT_OPEN_FAILED;
+    });
+}
+
+static void onMqttConnected() {
+    mqttState = MQTT_CONNECTED;
+    mqttConnectionAttempts = 0;
+    Log.info("MQTT Connected");
+    publishPendingTriggered();
+    mqttClient->subscribe("home/security/panel/+/alarm/set");
+    mqttClient->subscribe("home/security/panel/+/area/+/set");
+    for (uint8_t i = 0; i < panelCount; i++) {
+        panels[i].texecom->updateAlarmState();
+        panels[i].texecom->updateAreaStates();
+    }
+}
+
+static void mqttConnectFailed() {
+    mqttClient->clear();
+    mqttState = MQTT_DISCONNECTED;
+    Log.info("MQTT failed to connect");
+}
+
+static void serviceMQTT() {
+    if (mqttClient == NULL)
+        return;
+
+    switch (mqttState) {
+    case MQTT_CONNECTED:
+        if (mqttClient->isConnected()) {
+            mqttClient->loop();
+            break;
+        }
+        mqttState = MQTT_DISCONNECTED;
+        // fall through
+    case MQTT_DISCONNECTED:
+        if ((mqttConnectionAttempts < 5 && millis() - lastMqttConnectAttempt > mqttConnectAttemptTimeout1) ||
+                millis() - lastMqttConnectAttempt > mqttConnectAttemptTimeout2) {
+            connectToMQTT();
+        }
+        break;
+    case MQTT_OPEN_FAILED:
+        mqttConnectFailed();
+        break;
+    case MQTT_OPENED:
+        if (mqttClient->sendConnect(mqttClientId, mqttUsername, mqttPassword))
+            mqttState = MQTT_HANDSHAKE;
+        else
+            mqttConnectFailed();
+        break;
+    case MQTT_HANDSHAKE:
+        switch (mqttClient->pollConnect()) {
+        case MQTT::CONNECT_ACCEPTED:
+            onMqttConnected();
+            break;
+        case MQTT::CONNECT_FAILED:
+            mqttConnectFailed();
+            break;
+        default:
+            break;
+        }
+        break;
+    default:  // MQTT_OPENING, the connector thread has the client
+        break;
+    }
+}
+
+// epoll data is the panel index, with the top bit set for its simulator
+static const uint32_t simulatorFlag = 0x80000000;
+
+static bool watch(int fd, uint32_t data, uint32_t events) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.u32 = data;
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+static void setWriteInterest(Panel &panel, bool enabled) {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | (enabled ? (uint32_t)EPOLLOUT : 0u);
+    ev.data.u32 = &panel - panels;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, panel.stream->getFd(), &ev);
+}
+
+static bool addPanel(const std::string &name, int fd) {
+    if (panelCount >= TexecomClass::maxPanels) {
+        fprintf(stderr, "At most %u panels are supported\n", TexecomClass::maxPanels);
+        return false;
+    }
+
+    uint8_t index = panelCount;
+    Panel &panel = panels[index];
+    panel.name = name;
+    panel.stream = new FdStream(fd);
+    panel.texecom = new TexecomClass(*panel.stream, index);
+    if (!panel.texecom->isValid()) {
+        delete panel.texecom;
+        delete panel.stream;
+        return false;
+    }
+    panel.sim = NULL;
+    panel.ptyHold = -1;
+    panel.reopen = false;
+    panel.state = TexecomClass::DISARMED;
+
+    if (!watch(fd, index, EPOLLIN)) {
+        perror("epoll_ctl");
+        return false;
+    }
+
+    // No pins on Linux so the alarm state comes from the panel alone
+    TexecomClass &texecom = *panel.texecom;
+    texecom.setDigiOutputs(false);
+    texecom.setZoneCallback(panelCallbacks[index].zone);
+    texecom.setAlarmCallback(panelCallbacks[index].alarm);
+    texecom.setEventLogCallback(panelCallbacks[index].eventLog);
+    texecom.setTriggeredCallback(panelCallbacks[index].triggered);
+    texecom.setAreaCallback(panelCallbacks[index].area);
+
+    panelCount++;
+    return true;
+}
+
+static bool addPty(bool simulated) {
+    std::string slaveName;
+    int fd = openPty(&slaveName);
+    if (fd < 0) {
+        perror("openpt");
+        return false;
+    }
+
+    int slave = openSerialPort(slaveName.c_str());
+    if (slave < 0) {
+        perror(slaveName.c_str());
+        close(fd);
+        return false;
+    }
+
+    if (!addPanel(slaveName, fd)) {
+        close(slave);
+        return false;
+    }
+
+    Panel &panel = panels[panelCount - 1];
+    if (simulated) {
+        panel.sim = new PanelSim(slave);
+        if (!watch(slave, (panelCount - 1) | simulatorFlag, EPOLLIN))
+            return false;
+    } else {
+        panel.ptyHold = slave;
+        printf("Panel %u: %s\n", panelCount - 1, slaveName.c_str());
+    }
+    return true;
+}
+
+// The panel's engine keeps running on its timers, its writes dropped, until
+// the port can be opened again. A pty can't be reopened by name.
+static void closePanel(Panel &panel) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, panel.stream->getFd(), NULL);
+    panel.stream->close();
+    panel.lastReopenAttempt = millis();
+
+    if (panel.reopen)
+        Log.error("%s: Port closed, reopening", panel.name.c_str());
+    else
+        Log.error("%s: Port closed", panel.name.c_str());
+}
+
+static void reopenPanels(uint32_t now) {
+    for (uint8_t i = 0; i < panelCount; i++) {
+        Panel &panel = panels[i];
+        if (panel.stream->isOpen() || !panel.reopen || now - panel.lastReopenAttempt < reopenInterval)
+            continue;
+
+        panel.lastReopenAttempt = now;
+        int fd = openSerialPort(panel.name.c_str());
+        if (fd < 0)
+            continue;
+
+        panel.stream->attach(fd);
+        if (!watch(fd, i, EPOLLIN)) {
+            Log.error("%s: epoll_ctl failed: %s", panel.name.c_str(), strerror(errno));
+            panel.stream->close();
+            continue;
+        }
+        Log.info("%s: Port reopened", panel.name.c_str());
+    }
+}
+
+// Runs the engine until it has consumed everything the port gave it
+static void servicePanel(Panel &panel) {
+    do {
+        panel.texecom->loop();
+    } while (panel.stream->available() > 0);
+
+    if (panel.stream->hasPending()) {
+        if (!panel.stream->flushPending())
+            Log.error("%s: Write failed", panel.name.c_str());
+        setWriteInterest(panel, panel.stream->hasPending());
+    }
+}
+
+static void sendBenchEvents(uint32_t rate, uint32_t now, std::vector<uint32_t> &nextSend,
+                            std::vector<uint32_t> &nextIntruder) {
+    for (uint8_t i = 0; i < panelCount; i++) {
+        PanelSim &sim = *panels[i].sim;
+
+        if ((int32_t)(now - nextIntruder[i]) >= 0 && sim.sendIntruderEvent(now))
+            nextIntruder[i] = now + intruderInterval;
+
+        if (rate == 0) {
+            while (sim.sendZoneEvent(now))
+                eventsSent++;
+        } else if ((int32_t)(now - nextSend[i]) >= 0) {
+            if (sim.sendZoneEvent(now))
+                eventsSent++;
+            nextSend[i] += 1000000 / rate;
+            if ((int32_t)(now - nextSend[i]) > 1000000)
+                nextSend[i] = now;  // don't try to catch up after a Simple session
+        }
+    }
+}
+
+static uint32_t percentile(const std::vector<uint32_t> &sorted, uint32_t percent) {
+    if (sorted.empty())
+        return 0;
+    return sorted[(sorted.size() - 1) * percent / 100];
+}
+
+static void reportBench(uint32_t seconds, uint32_t rate) {
+    std::sort(latencies.begin(), latencies.end());
+
+    uint64_t total = 0;
+    for (uint32_t latency : latencies)
+        total += latency;
+
+    uint32_t simpleSessions = 0;
+    for (uint8_t i = 0; i < panelCount; i++)
+        simpleSessions += panels[i].sim->getSimpleSessions();
+
+    printf("panels %u  rate %s  seconds %u\n", panelCount,
+           rate == 0 ? "max" : std::to_string(rate).c_str(), seconds);
+    printf("events sent %llu  reported %zu  (%.0f/s)\n",
+           (unsigned long long)eventsSent, latencies.size(), (double)latencies.size() / seconds);
+    printf("latency us  min %u  avg %llu  p50 %u  p99 %u  max %u\n",
+           latencies.empty() ? 0 : latencies.front(),
+           latencies.empty() ? 0ULL : (unsigned long long)(total / latencies.size()),
+           percentile(latencies, 50), percentile(latencies, 99),
+           latencies.empty() ? 0 : latencies.back());
+
+    std::sort(intruderLatencies.begin(), intruderLatencies.end());
+    printf("intruder alarms published %zu  latency us  p50 %u  p99 %u  max %u\n",
+           intruderLatencies.size(), percentile(intruderLatencies, 50),
+           percentile(intruderLatencies, 99),
+           intruderLatencies.empty() ? 0 : intruderLatencies.back());
+    printf("simple sessions %u\n", simpleSessions);
+}
+
+static void stop(int) {
+    running = 0;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: texecom-gateway [--mqtt host[:port]] [--user name --password pass]\n"
+            "                       [--eeprom file] [--udl code] [--pty count] [--verbose] [port...]\n"
+            "       texecom-gateway --bench panels [--seconds n] [--rate events-per-second]\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *eepromPath = NULL;
+    const char *udlCode = NULL;
+    unsigned int ptyCount = 0;
+    unsigned int benchPanels = 0;
+    unsigned int benchSeconds = 10;
+    unsigned int benchRate = 50;
+    bool verbose = false;
+    std::vector<const char *> ports;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--verbose") == 0) {
+            verbose = true;
+            continue;
+        } else if (arg[0] != '-') {
+            ports.push_back(arg);
+            continue;
+        } else if (value == NULL) {
+            usage();
+            return 1;
+        }
+
+        i++;
+        if (strcmp(arg, "--mqtt") == 0) {
+            snprintf(mqttServer, sizeof(mqttServer), "%s", value);
+            char *colon = strchr(mqttServer, ':');
+            if (colon) {
+                *colon = '\0';
+                mqttPort = atoi(colon + 1);
+            }
+        } else if (strcmp(arg, "--user") == 0) {
+            mqttUsername = value;
+        } else if (strcmp(arg, "--password") == 0) {
+            mqttPassword = value;
+        } else if (strcmp(arg, "--eeprom") == 0) {
+            eepromPath = value;
+        } else if (strcmp(arg, "--udl") == 0) {
+            udlCode = value;
+        } else if (strcmp(arg, "--pty") == 0) {
+            ptyCount = atoi(value);
+        } else if (strcmp(arg, "--bench") == 0) {
+            benchPanels = atoi(value);
+        } else if (strcmp(arg, "--seconds") == 0) {
+            benchSeconds = atoi(value);
+        } else if (strcmp(arg, "--rate") == 0) {
+            benchRate = atoi(value);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    benchmarking = benchPanels > 0;
+    if (!benchmarking && ports.empty() && ptyCount == 0) {
+        usage();
+        return 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    Log.setLevel(verbose ? LOG_LEVEL_ALL : benchmarking ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (eepromPath && !EEPROM.open(eepromPath)) {
+        perror(eepromPath);
+        return 1;
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    for (const char *port : ports) {
+        int fd = openSerialPort(port);
+        if (fd < 0) {
+            perror(port);
+            return 1;
+        }
+        if (!addPanel(port, fd))
+            return 1;
+        panels[panelCount - 1].reopen = true;
+    }
+
+    for (unsigned int i = 0; i < ptyCount + benchPanels; i++) {
+        if (!addPty(benchmarking))
+            return 1;
+    }
+
+    if (mqttServer[0] && !benchmarking) {
+        char hostname[32] = "";
+        gethostname(hostname, sizeof(hostname) - 1);
+        snprintf(mqttClientId, sizeof(mqttClientId), "texecom-gateway-%s", hostname);
+        mqttClient = new MQTT(mqttServer, mqttPort, mqttCallback);
+        connectToMQTT();
+    } else if (benchmarking) {
+        // An in-memory broker that accepts the connection and drops the
+        // publishes, with a keepalive longer than any run
+        TCPClient::hostUseBuffers(&benchMqttRx, &benchMqttTx);
+        snprintf(mqttClientId, sizeof(mqttClientId), "texecom-gateway-bench");
+        mqttClient = new MQTT((char *)"bench", 1883, 3600, mqttCallback);
+        benchMqttRx.assign("\x20\x02\x00\x00", 4);  // CONNACK, accepted
+        connectToMQTT();
+    }
+
+    for (uint8_t i = 0; i < panelCount; i++) {
+        if (udlCode)
+            panels[i].texecom->setUDLCode(udlCode);
+        panels[i].texecom->setup();
+    }
+
+    // Bench events start once the startup sessions have had time to finish
+    uint32_t benchStart = millis() + 1000;
+    uint32_t benchEnd = benchStart + benchSeconds * 1000;
+    std::vector<uint32_t> nextSend(panelCount, micros() + 1000000);
+    std::vector<uint32_t> nextIntruder(panelCount, micros() + 1000000);
+    if (benchmarking) {
+        latencies.reserve(benchSeconds * panelCount * (benchRate ? benchRate : 2000));
+        intruderLatencies.reserve(benchSeconds * panelCount * 1000000 / intruderInterval);
+    }
+
+    uint32_t lastTick = millis();
+    struct epoll_event events[64];
+
+    while (running) {
+        int timeout = benchmarking ? 1 : tickInterval;
+        int n = epoll_wait(epollFd, events, 64, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint32_t data = events[i].data.u32;
+            Panel &panel = panels[data & ~simulatorFlag];
+
+            if (data & simulatorFlag) {
+                if (!panel.sim->onReadable())
+                    running = 0;
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && panel.stream->flushPending())
+                setWriteInterest(panel, panel.stream->hasPending());
+
+            // A tty whose other end has hung up reads nothing rather than
+            // failing, only the hangup says it has gone
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if (!panel.stream->fill() || (events[i].events & (EPOLLHUP | EPOLLERR)))
+                    closePanel(panel);
+                servicePanel(panel);
+            }
+        }
+
+        uint32_t now = millis();
+        if (now - lastTick >= tickInterval) {
+            lastTick = now;
+            // Timers first so anything they send goes out with the panels
+            Alarm.loop();
+            for (uint8_t i = 0; i < panelCount; i++)
+                servicePanel(panels[i]);
+            serviceMQTT();
+            reopenPanels(now);
+            BinaryLog.loop();
+            benchMqttTx.clear();
+        }
+
+        if (benchmarking && (int32_t)(now - benchStart) >= 0) {
+            if ((int32_t)(now - benchEnd) >= 0)
+                break;
+            sendBenchEvents(benchRate, micros(), nextSend, nextIntruder);
+        }
+    }
+
+    if (benchmarking)
+        reportBench(benchSeconds, benchRate);
+
+    if (mqttConnected())
+        mqttClient->disconnect();
+    // A connect still under way has nothing left to do
+    if (mqttConnector.joinable())
+        mqttConnector.detach();
+    return 0;
+}
@@ -0,0 +1,193 @@
+// Copyright 2020 Kevin Cooper
+//
+// Just enough of the Device OS API to build the panel engine, TimeAlarms and
+// the MQTT client on Linux. Pins are levels only a replay sets, so the
+// gateway leaves the digi outputs disabled, retained memory is ordinary
+// memory and EEPROM is an array that can be backed by a file.
+
+#ifndef __HOST_PARTICLE_H_
+#define __HOST_PARTICLE_H_
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+
+typedef uint8_t byte;
+
+#define retained
+#define PRIVATE 0
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define INPUT_PULLUP 1
+#define CHANGE 2
+#define SERIAL_8N2 0
+
+enum { D0, D1, D2, D3, D4, D5, D6, D7, D8, D9, D10, D11, D12, D13, D14, D15, D16, D17, D18, D19 };
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+// Host only. Once used the clock stands still between hostSetClock() calls
+// and Time counts from epoch, so a trace replays faster than it happened
+void hostUseVirtualClock(time_t epoch);
+void hostSetClock(uint64_t micros);
+
+// Host only, pins idle high until set. A change runs the pin's interrupt
+// handler as the hardware would.
+void hostSetPin(int pin, int level);
+
+inline void pinMode(int, int) {}
+int digitalRead(int pin);
+inline uint32_t pinReadFast(int pin) { return digitalRead(pin); }
+bool attachInterrupt(uint16_t pin, void (*handler)(), int mode, int8_t priority = -1, uint8_t subpriority = 0);
+void detachInterrupt(uint16_t pin);
+
+class String {
+ public:
+    String() {}
+    String(const char *s) : s(s ? s : "") {}
+    explicit String(int value) : s(std::to_string(value)) {}
+    const char *c_str() const { return s.c_str(); }
+    unsigned length() const { return s.size(); }
+    bool concat(const char *text) { s += text ? text : ""; return true; }
+    bool concat(const String &text) { s += text.s; return true; }
+    bool concat(char c) { s += c; return true; }
+    static String format(const char *fmt, ...);
+    operator const char *() const { return s.c_str(); }
+
+ private:
+    std::string s;
+};
+
+class Print {
+ public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int n);
+    size_t println(const char *s) { return print(s) + print("\r\n"); }
+    size_t println(char c) { return print(c) + print("\r\n"); }
+    size_t println(int n) { return print(n) + print("\r\n"); }
+};
+
+class Stream : public Print {
+ public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+};
+
+// Blocking socket, only used by the MQTT client
+class TCPClient : public Stream {
+ public:
+    TCPClient() : fd(-1) {}
+    ~TCPClient() { stop(); }
+
+    // Host only. Clients connecting while these are set read rx and append
+    // to tx rather than open a socket, so the benchmarks measure the MQTT
+    // code and not the kernel. rx is consumed from the front.
+    static void hostUseBuffers(std::string *rx, std::string *tx);
+
+    int connect(const char *host, uint16_t port);
+    int connect(uint8_t *ip, uint16_t port);
+    uint8_t connected();
+    void stop();
+    using Print::write;
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size);
+    int available();
+    int read();
+    int peek();
+
+ private:
+    int fd;
+    std::string *rxBuffer = NULL;
+    std::string *txBuffer = NULL;
+    size_t rxPosition = 0;
+};
+
+typedef enum {
+    LOG_LEVEL_ALL = 1,
+    LOG_LEVEL_TRACE = 1,
+    LOG_LEVEL_INFO = 30,
+    LOG_LEVEL_WARN = 40,
+    LOG_LEVEL_ERROR = 50,
+    LOG_LEVEL_NONE = 70
+} LogLevel;
+
+class Logger {
+ public:
+    void info(const char *fmt, ...) const;
+    void warn(const char *fmt, ...) const;
+    void error(const char *fmt, ...) const;
+    void trace(const char *fmt, ...) const;
+    void log(LogLevel level, const char *fmt, ...) const;
+
+    // Host only, messages below level are dropped before formatting
+    void setLevel(LogLevel level) { this->level = level; }
+
+ private:
+    void vlog(LogLevel level, const char *fmt, va_list args) const;
+    LogLevel level = LOG_LEVEL_INFO;
+};
+extern Logger Log;
+
+#define TIME_FORMAT_ISO8601_FULL "%Y-%m-%dT%H:%M:%S%z"
+
+class TimeClass {
+ public:
+    time_t now();
+    String format(time_t t, const char *format);
+    time_t local();
+    int day();
+    int month();
+    int year();
+    int hour();
+    int minute();
+    bool isDST();
+    void beginDST() {}
+    void endDST() {}
+};
+extern TimeClass Time;
+
+class EEPROMClass {
+ public:
+    static const int size = 4096;
+    EEPROMClass() { memset(data, 0xFF, sizeof(data)); }
+
+    // Host only, load and then write through to path
+    bool open(const char *path);
+
+    template<typename T> T &get(int address, T &t) {
+        if (address >= 0 && address + (int)sizeof(T) <= size)
+            memcpy(&t, &data[address], sizeof(T));
+        return t;
+    }
+
+    template<typename T> const T &put(int address, const T &t) {
+        if (address >= 0 && address + (int)sizeof(T) <= size) {
+            memcpy(&data[address], &t, sizeof(T));
+            save();
+        }
+        return t;
+    }
+
+ private:
+    void save();
+    uint8_t data[size];
+    std::string path;
+};
+extern EEPROMClass EEPROM;
+
+#endif  // __HOST_PARTICLE_H_
@@ -0,0 +1,352 @@
+// Copyright 2020 Kevin Cooper
+
+#include "Particle.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+Logger Log;
+TimeClass Time;
+EEPROMClass EEPROM;
+
+static bool virtualClock = false;
+static uint64_t virtualMicros = 0;
+static time_t virtualEpoch = 0;
+
+static uint64_t monotonicMicros() {
+    if (virtualClock)
+        return virtualMicros;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static time_t wallTime() {
+    return virtualClock ? virtualEpoch + (time_t)(virtualMicros / 1000000) : time(NULL);
+}
+
+void hostUseVirtualClock(time_t epoch) {
+    virtualClock = true;
+    virtualEpoch = epoch;
+    virtualMicros = 0;
+}
+
+void hostSetClock(uint64_t micros) {
+    virtualMicros = micros;
+}
+
+// Both wrap like they do on the device
+uint32_t millis() { return (uint32_t)(monotonicMicros() / 1000); }
+uint32_t micros() { return (uint32_t)monotonicMicros(); }
+
+void delay(uint32_t ms) {
+    if (virtualClock) {
+        virtualMicros += (uint64_t)ms * 1000;
+        return;
+    }
+
+    struct timespec ts = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+static const int pinCount = D19 + 1;
+static uint8_t pinLevels[pinCount] = { HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH,
+                                       HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH, HIGH };
+static void (*pinHandlers[pinCount])();
+
+int digitalRead(int pin) {
+    return pin >= 0 && pin < pinCount ? pinLevels[pin] : LOW;
+}
+
+bool attachInterrupt(uint16_t pin, void (*handler)(), int, int8_t, uint8_t) {
+    if (pin >= pinCount)
+        return false;
+    pinHandlers[pin] = handler;
+    return true;
+}
+
+void detachInterrupt(uint16_t pin) {
+    if (pin < pinCount)
+        pinHandlers[pin] = NULL;
+}
+
+void hostSetPin(int pin, int level) {
+    if (pin < 0 || pin >= pinCount || pinLevels[pin] == (level != LOW))
+        return;
+
+    pinLevels[pin] = level != LOW;
+    if (pinHandlers[pin])
+        pinHandlers[pin]();
+}
+
+String String::format(const char *fmt, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    return String(buffer);
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+    size_t written = 0;
+    while (size--)
+        written += write(*buffer++);
+    return written;
+}
+
+size_t Print::print(int n) {
+    char buffer[12];
+    snprintf(buffer, sizeof(buffer), "%d", n);
+    return print(buffer);
+}
+
+static std::string *hostRxBuffer = NULL;
+static std::string *hostTxBuffer = NULL;
+
+void TCPClient::hostUseBuffers(std::string *rx, std::string *tx) {
+    hostRxBuffer = rx;
+    hostTxBuffer = tx;
+}
+
+// The kernel retries a connect to an unreachable host for minutes
+static const int connectTimeout = 5000;  // ms
+
+static bool connectWithTimeout(int fd, const struct sockaddr *address, socklen_t length) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        return false;
+
+    if (::connect(fd, address, length) < 0) {
+        if (errno != EINPROGRESS)
+            return false;
+
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int error = 0;
+        socklen_t errorLength = sizeof(error);
+        if (poll(&pfd, 1, connectTimeout) != 1 ||
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) < 0 || error != 0)
+            return false;
+    }
+
+    // Writes expect a blocking socket
+    return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+int TCPClient::connect(const char *host, uint16_t port) {
+    stop();
+
+    if (hostRxBuffer && hostTxBuffer) {
+        rxBuffer = hostRxBuffer;
+        txBuffer = hostTxBuffer;
+        rxPosition = 0;
+        return 1;
+    }
+
+    char service[6];
+    snprintf(service, sizeof(service), "%u", port);
+
+    struct addrinfo hints = {};
+    struct addrinfo *result;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &result) != 0)
+        return 0;
+
+    for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connectWithTimeout(fd, ai->ai_addr, ai->ai_addrlen))
+            break;
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(result);
+    return fd >= 0;
+}
+
+int TCPClient::connect(uint8_t *ip, uint16_t port) {
+    char host[16];
+    snprintf(host, sizeof(host), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+    return connect(host, port);
+}
+
+uint8_t TCPClient::connected() {
+    if (rxBuffer)
+        return true;
+
+    if (fd < 0)
+        return false;
+
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+void TCPClient::stop() {
+    rxBuffer = NULL;
+    txBuffer = NULL;
+
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+size_t TCPClient::write(const uint8_t *buffer, size_t size) {
+    if (txBuffer) {
+        txBuffer->append((const char *)buffer, size);
+        return size;
+    }
+
+    size_t written = 0;
+    while (fd >= 0 && written < size) {
+        ssize_t n = send(fd, buffer + written, size - written, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            stop();
+            break;
+        }
+        written += n;
+    }
+    return written;
+}
+
+int TCPClient::available() {
+    if (rxBuffer)
+        return rxBuffer->size() - rxPosition;
+
+    int count = 0;
+    if (fd < 0 || ioctl(fd, FIONREAD, &count) < 0)
+        return 0;
+    return count;
+}
+
+int TCPClient::read() {
+    if (rxBuffer) {
+        if (rxPosition >= rxBuffer->size())
+            return -1;
+        uint8_t c = (*rxBuffer)[rxPosition++];
+        if (rxPosition == rxBuffer->size()) {
+            rxBuffer->clear();
+            rxPosition = 0;
+        }
+        return c;
+    }
+
+    uint8_t c;
+    if (fd < 0 || recv(fd, &c, 1, MSG_DONTWAIT) != 1)
+        return -1;
+    return c;
+}
+
+int TCPClient::peek() {
+    if (rxBuffer)
+        return rxPosition < rxBuffer->size() ? (uint8_t)(*rxBuffer)[rxPosition] : -1;
+
+    uint8_t c;
+    if (fd < 0 || recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 1)
+        return -1;
+    return c;
+}
+
+void Logger::vlog(LogLevel level, const char *fmt, va_list args) const {
+    if (level < this->level)
+        return;
+
+    static const char *names[] = { "TRACE", "INFO", "WARN", "ERROR" };
+    const char *name = level >= LOG_LEVEL_ERROR ? names[3] :
+                       level >= LOG_LEVEL_WARN ? names[2] :
+                       level >= LOG_LEVEL_INFO ? names[1] : names[0];
+
+    fprintf(stderr, "%010lu [%s] ", (unsigned long)millis(), name);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+}
+
+#define LOGGER_METHOD(method, level) \
+    void Logger::method(const char *fmt, ...) const { \
+        va_list args; \
+        va_start(args, fmt); \
+        vlog(level, fmt, args); \
+        va_end(args); \
+    }
+
+LOGGER_METHOD(info, LOG_LEVEL_INFO)
+LOGGER_METHOD(warn, LOG_LEVEL_WARN)
+LOGGER_METHOD(error, LOG_LEVEL_ERROR)
+LOGGER_METHOD(trace, LOG_LEVEL_TRACE)
+
+void Logger::log(LogLevel level, const char *fmt, ...) const {
+    va_list args;
+    va_start(args, fmt);
+    vlog(level, fmt, args);
+    va_end(args);
+}
+
+time_t TimeClass::now() { return wallTime(); }
+
+String TimeClass::format(time_t t, const char *format) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char buffer[64];
+    strftime(buffer, sizeof(buffer), format, &tm);
+    return String(buffer);
+}
+
+// Device OS local time is UTC shifted by the zone offset
+time_t TimeClass::local() {
+    time_t t = wallTime();
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return t + tm.tm_gmtoff;
+}
+
+static struct tm localTm() {
+    time_t t = wallTime();
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return tm;
+}
+
+int TimeClass::day() { return localTm().tm_mday; }
+int TimeClass::month() { return localTm().tm_mon + 1; }
+int TimeClass::year() { return localTm().tm_year + 1900; }
+int TimeClass::hour() { return localTm().tm_hour; }
+int TimeClass::minute() { return localTm().tm_min; }
+bool TimeClass::isDST() { return localTm().tm_isdst > 0; }
+
+bool EEPROMClass::open(const char *path) {
+    this->path = path;
+
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return errno == ENOENT;
+
+    size_t n = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    (void)n;
+    return true;
+}
+
+void EEPROMClass::save() {
+    if (path.empty())
+        return;
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        Log.error("EEPROM: Can't write %s", path.c_str());
+        return;
+    }
+    fwrite(data, 1, sizeof(data), file);
+    fclose(file);
+}
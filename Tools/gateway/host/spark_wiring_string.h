@@ -0,0 +1,4 @@
+// Copyright 2020 Kevin Cooper
+
+// The MQTT client includes the Device OS headers individually
+#include "Particle.h"
@@ -0,0 +1,209 @@
+// Copyright 2020 Kevin Cooper
+
+#include "panelsim.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Longest frame we'd wait for before giving up on finding its end
+static const size_t maxFrameSize = 64;
+
+PanelSim::~PanelSim() {
+    if (fd >= 0)
+        close(fd);
+}
+
+bool PanelSim::onReadable() {
+    char buffer[256];
+
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        // Raw with VMIN and VTIME of 0, so empty reads 0 rather than EAGAIN
+        if (n > 0) {
+            rx.append(buffer, n);
+        } else if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+
+    processSimple();
+    return true;
+}
+
+// Length of the Simple frame at the start of rx, not counting the checksum,
+// or 0 if more is needed to tell
+uint8_t PanelSim::simpleFrameLength() const {
+    if (rx.size() < 3)
+        return 0;
+
+    switch (rx[1]) {
+        case 'W' : return 9;   // \W + 6 digit UDL code + /
+        case 'H' : return 3;
+        case 'I' : return 3;
+        case 'Z' : return 5;   // \Z first-1 count /
+        case 'G' : return 6;   // \G index-lo index-hi count /
+        case 'T' : return rx[2] == '?' ? 4 : 8;
+    }
+
+    size_t end = rx.find('/', 1);
+    return end == std::string::npos ? 0 : end + 1;
+}
+
+void PanelSim::processSimple() {
+    while (!rx.empty()) {
+        if (rx[0] != '\\') {
+            // Crestron requests (KEY, ASTATUS, LSTATUS) aren't answered
+            size_t end = rx.find("\r\n");
+            if (end == std::string::npos) {
+                if (rx.size() > maxFrameSize)
+                    rx.erase(0, 1);
+                return;
+            }
+            rx.erase(0, end + 2);
+            continue;
+        }
+
+        uint8_t length = simpleFrameLength();
+        if (length == 0 || rx.size() < (size_t)length + 1) {
+            if (rx.size() > maxFrameSize)
+                rx.erase(0, 1);
+            return;
+        }
+
+        std::string frame = rx.substr(0, length);
+        rx.erase(0, length + 1);
+
+        switch (frame[1]) {
+            case 'W' :
+                if (!simpleSession)
+                    simpleSessions++;
+                simpleSession = true;
+                reply("OK", 2);
+                break;
+            case 'H' :
+                simpleSession = false;
+                reply("OK", 2);
+                break;
+            case 'I' : {
+                const char *identification = "Premier Elite 24 V4.02.01";
+                reply(identification, strlen(identification));
+                break;
+            }
+            case 'T' :
+                if (frame[2] == '?') {
+                    time_t t = time(NULL);
+                    struct tm tm;
+                    localtime_r(&t, &tm);
+                    char now[5] = { (char)tm.tm_mday, (char)(tm.tm_mon + 1), (char)(tm.tm_year - 100),
+                                    (char)tm.tm_hour, (char)tm.tm_min };
+                    reply(now, sizeof(now));
+                } else {
+                    reply("OK", 2);
+                }
+                break;
+            case 'Z' : {
+                // Every zone healthy, two status bytes each
+                char zones[2 * 32] = {};
+                uint8_t count = frame[3] < 32 ? frame[3] : 32;
+                reply(zones, 2 * count);
+                break;
+            }
+            default :
+                // Including \G, the log is always empty
+                reply("ERROR", 5);
+                break;
+        }
+    }
+}
+
+void PanelSim::reply(const char *data, uint8_t length) {
+    char frame[maxFrameSize + 3];
+    unsigned int sum = 0;
+
+    for (uint8_t i = 0; i < length; i++) {
+        frame[i] = data[i];
+        sum += (uint8_t)data[i];
+    }
+    frame[length] = (sum ^ 255) % 0x100;
+    frame[length + 1] = '\r';
+    frame[length + 2] = '\n';
+    send(frame, length + 3);
+}
+
+void PanelSim::send(const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // The engine reads every frame as it arrives so a full pty means
+        // it has stalled, drop the frame rather than block the loop
+        if (n <= 0)
+            return;
+        data += n;
+        length -= n;
+    }
+}
+
+bool PanelSim::sendZoneEvent(uint32_t now) {
+    if (simpleSession)
+        return false;
+
+    for (uint8_t i = 0; i < zoneCount; i++) {
+        uint8_t zone = (nextZone + i) % zoneCount;
+        uint8_t bit = 1 << zone;
+        if (zonePending & bit)
+            continue;
+
+        zoneActive ^= bit;
+        zonePending |= bit;
+        zoneSentTime[zone] = now;
+        nextZone = (zone + 1) % zoneCount;
+
+        char frame[16];
+        int length = snprintf(frame, sizeof(frame), "\"Z0%02u%u\r\n",
+                              firstZone + zone, (zoneActive & bit) ? 1 : 0);
+        send(frame, length);
+        return true;
+    }
+    return false;
+}
+
+bool PanelSim::sendIntruderEvent(uint32_t now) {
+    if (simpleSession || intruderPending)
+        return false;
+
+    intruderPending = true;
+    intruderSentTime = now;
+
+    char frame[16];
+    int length = snprintf(frame, sizeof(frame), "\"L%03u0\r\n", firstZone);
+    send(frame, length);
+    return true;
+}
+
+bool PanelSim::intruderReported(uint16_t zone, uint32_t now, uint32_t *latency) {
+    if (!intruderPending || zone != firstZone)
+        return false;
+
+    intruderPending = false;
+    *latency = now - intruderSentTime;
+    return true;
+}
+
+bool PanelSim::zoneReported(uint16_t zone, bool active, uint32_t now, uint32_t *latency) {
+    if (zone < firstZone || zone >= firstZone + zoneCount)
+        return false;
+
+    uint8_t bit = 1 << (zone - firstZone);
+    if (!(zonePending & bit) || ((zoneActive & bit) != 0) != active)
+        return false;
+
+    zonePending &= ~bit;
+    *latency = now - zoneSentTime[zone - firstZone];
+    return true;
+}
@@ -0,0 +1,62 @@
+// Copyright 2020 Kevin Cooper
+
+#ifndef __PANELSIM_H_
+#define __PANELSIM_H_
+
+#include <stdint.h>
+#include <string>
+
+// Stands in for a panel on the far side of a pty. It sends Crestron zone
+// events on request and answers the Simple commands the engine uses (login,
+// logout, time, identification, zone and log reads) so the periodic
+// sessions run as they would against a real panel. Like the panel it holds
+// Crestron output while a Simple session is open.
+class PanelSim {
+ public:
+    static const uint8_t firstZone = 10;
+    static const uint8_t zoneCount = 8;  // inside the engine's default range
+
+    explicit PanelSim(int fd) : fd(fd) {}
+    ~PanelSim();
+
+    int getFd() const { return fd; }
+    bool inSimpleSession() const { return simpleSession; }
+
+    // Consumes what the engine has sent, false once the engine has gone away
+    bool onReadable();
+
+    // Toggles the next idle zone. False while a Simple session is open or
+    // every zone is still waiting to be reported.
+    bool sendZoneEvent(uint32_t now);
+
+    // Matches a zone callback against the event sent for it, latency is in
+    // microseconds
+    bool zoneReported(uint16_t zone, bool active, uint32_t now, uint32_t *latency);
+
+    // The same for an intruder alarm on the first zone, one at a time
+    bool sendIntruderEvent(uint32_t now);
+    bool intruderReported(uint16_t zone, uint32_t now, uint32_t *latency);
+
+    uint32_t getSimpleSessions() const { return simpleSessions; }
+
+ private:
+    void processSimple();
+    void reply(const char *data, uint8_t length);
+    void send(const char *data, size_t length);
+    uint8_t simpleFrameLength() const;
+
+    int fd;
+    std::string rx;
+    bool simpleSession = false;
+    uint32_t simpleSessions = 0;
+
+    uint8_t nextZone = 0;
+    uint8_t zoneActive = 0;   // one bit per zone, state last sent
+    uint8_t zonePending = 0;  // one bit per zone, sent but not reported
+    uint32_t zoneSentTime[zoneCount];
+
+    bool intruderPending = false;
+    uint32_t intruderSentTime = 0;
+};
+
+#endif  // __PANELSIM_H_
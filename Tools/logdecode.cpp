@@ -0,0 +1,236 @@
+// Copyright 2020 Kevin Cooper
+//
+// Decodes the "BIN:" batches written by the firmware when BINARY_LOGGING is
+// enabled in binarylog.h back into readable log lines.
+//
+// Build:  make logdecode, or g++ -std=c++11 -O2 -o logdecode logdecode.cpp
+// Usage:  logdecode ../TexecomApplication/src/*.cpp < papertrail.log
+//
+// The format dictionary is rebuilt from the TLOG_ calls in the source files
+// given on the command line, so always decode with the source matching the
+// firmware that produced the log.
+
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../TexecomApplication/src/binarylogformat.h"
+
+static std::string unescape(const std::string &s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] != '\\' || i + 1 >= s.size()) {
+            out += s[i];
+            continue;
+        }
+        char c = s[++i];
+        if (c == 'n') out += '\n';
+        else if (c == 'r') out += '\r';
+        else if (c == 't') out += '\t';
+        else out += c;
+    }
+    return out;
+}
+
+static bool loadFormats(const char *path, std::map<uint16_t, std::string> &formats) {
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    std::stringstream ss;
+    ss << file.rdbuf();
+    std::string source = ss.str();
+
+    size_t pos = 0;
+    while ((pos = source.find("TLOG_", pos)) != std::string::npos) {
+        pos += 5;
+        size_t paren = source.find('(', pos);
+        if (paren == std::string::npos)
+            break;
+
+        // Skip the macro definitions themselves and anything without a literal
+        size_t quote = source.find_first_not_of(" \t\r\n", paren + 1);
+        if (quote == std::string::npos || source[quote] != '"')
+            continue;
+
+        std::string literal;
+        size_t i = quote + 1;
+        for (; i < source.size() && source[i] != '"'; i++) {
+            literal += source[i];
+            if (source[i] == '\\' && i + 1 < source.size())
+                literal += source[++i];
+        }
+
+        std::string fmt = unescape(literal);
+        uint16_t id = binaryLogHash(fmt.c_str());
+        auto existing = formats.find(id);
+        if (existing != formats.end() && existing->second != fmt)
+            fprintf(stderr, "Format id collision 0x%04x: \"%s\" / \"%s\"\n",
+                    id, existing->second.c_str(), fmt.c_str());
+        formats[id] = fmt;
+        pos = i;
+    }
+    return true;
+}
+
+static std::vector<uint8_t> decodeBase64(const std::string &text) {
+    std::vector<uint8_t> out;
+    uint32_t block = 0;
+    int bits = 0;
+    for (char c : text) {
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '+') v = 62;
+        else if (c == '/') v = 63;
+        else break;  // '=' padding or end of token
+
+        block = (block << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((block >> bits) & 0xFF);
+        }
+    }
+    return out;
+}
+
+static std::string printable(const uint8_t *data, uint8_t length) {
+    std::string out;
+    char hex[8];
+    for (uint8_t i = 0; i < length; i++) {
+        if (data[i] >= 32 && data[i] < 127) {
+            out += (char)data[i];
+        } else {
+            snprintf(hex, sizeof(hex), "\\x%02x", data[i]);
+            out += hex;
+        }
+    }
+    return out;
+}
+
+// Walks the printf conversions in fmt consuming arguments from the payload
+static std::string format(const std::string &fmt, const uint8_t *payload, uint8_t length) {
+    std::string out;
+    uint8_t pos = 0;
+
+    for (size_t i = 0; i < fmt.size(); i++) {
+        if (fmt[i] != '%') {
+            out += fmt[i];
+            continue;
+        }
+        if (i + 1 < fmt.size() && fmt[i+1] == '%') {
+            out += '%';
+            i++;
+            continue;
+        }
+
+        size_t end = fmt.find_first_of("diuxXcsp", i + 1);
+        if (end == std::string::npos) {
+            out += fmt.substr(i);
+            break;
+        }
+
+        std::string spec = fmt.substr(i, end - i + 1);
+        char conversion = fmt[end];
+        i = end;
+
+        if (conversion == 's') {
+            if (pos >= length) {
+                out += "<missing>";
+                continue;
+            }
+            uint8_t stringLength = payload[pos++];
+            if (pos + stringLength > length)
+                stringLength = length - pos;
+            out += printable(&payload[pos], stringLength);
+            pos += stringLength;
+        } else {
+            if (pos + 4 > length) {
+                out += "<missing>";
+                continue;
+            }
+            int32_t value = payload[pos] | (payload[pos+1] << 8) |
+                            (payload[pos+2] << 16) | ((uint32_t)payload[pos+3] << 24);
+            pos += 4;
+
+            // Arguments are always stored as 32 bits so drop any length modifier
+            std::string plain = "%";
+            for (char c : spec.substr(1, spec.size() - 2))
+                if (c != 'l' && c != 'h')
+                    plain += c;
+            plain += conversion;
+
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), plain.c_str(), value);
+            out += buffer;
+        }
+    }
+    return out;
+}
+
+static const char *levelName(uint8_t level) {
+    if (level >= 50) return "ERROR";
+    if (level >= 40) return "WARN";
+    if (level >= 30) return "INFO";
+    return "TRACE";
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <source files...> < log\n", argv[0]);
+        return 1;
+    }
+
+    std::map<uint16_t, std::string> formats;
+    for (int i = 1; i < argc; i++) {
+        if (!loadFormats(argv[i], formats))
+            fprintf(stderr, "Unable to read %s\n", argv[i]);
+    }
+    fprintf(stderr, "Loaded %zu formats\n", formats.size());
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        size_t marker = line.find(BINARY_LOG_MARKER);
+        if (marker == std::string::npos) {
+            std::cout << line << "\n";
+            continue;
+        }
+
+        std::vector<uint8_t> batch = decodeBase64(line.substr(marker + strlen(BINARY_LOG_MARKER)));
+        size_t pos = 0;
+        while (pos + BINARY_LOG_HEADER_SIZE <= batch.size()) {
+            const uint8_t *record = &batch[pos];
+            uint16_t id = record[0] | (record[1] << 8);
+            uint8_t level = record[2];
+            uint32_t time = record[3] | (record[4] << 8) | (record[5] << 16) | ((uint32_t)record[6] << 24);
+            uint8_t length = record[7];
+
+            if (pos + BINARY_LOG_HEADER_SIZE + length > batch.size()) {
+                fprintf(stderr, "Truncated record in batch\n");
+                break;
+            }
+
+            const uint8_t *payload = &record[BINARY_LOG_HEADER_SIZE];
+            auto fmt = formats.find(id);
+            std::string text;
+            if (fmt != formats.end()) {
+                text = format(fmt->second, payload, length);
+            } else {
+                char unknown[32];
+                snprintf(unknown, sizeof(unknown), "<unknown format 0x%04x> ", id);
+                text = unknown + printable(payload, length);
+            }
+
+            printf("%10u %s: %s\n", time, levelName(level), text.c_str());
+            pos += BINARY_LOG_HEADER_SIZE + length;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,484 @@
+// Copyright 2020 Kevin Cooper
+//
+// Replays a trace captured by the firmware with TRACE_CAPTURE against the
+// panel engine on Linux, under a virtual clock so an hour of traffic takes
+// moments. Prints each recorded event with the engine's time to handle it
+// and the state changes, serial writes and commands that followed.
+//
+// Build:  make -C .. replay, or in one line:
+//         g++ -std=gnu++17 -O2 -I../gateway/host -I../../TexecomApplication/src
+//             -o replay replay.cpp ../gateway/host/particle.cpp
+//             ../../TexecomApplication/src/{texecom,simplehelper,crestronhelper,zonetable,areatable,statereconciler,TimeAlarms,binarylog}.cpp
+// Usage:  replay [--eeprom file] [--epoch seconds] [--step ms] [--dump n]
+//                [--quiet] [--verbose] [trace] < papertrail.log
+//
+// The trace is read from the TRC: lines of a log, or a file of the raw
+// records. A log holding several dumps replays the last unless --dump picks
+// one, counting from 0. --eeprom loads the device's zone configuration,
+// without it the engine starts by learning zones and its writes won't
+// match the recording. The virtual clock is run forward in --step slices
+// (10 ms by default) between events so the engine's timers fire on time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "texecom.h"
+#include "TimeAlarms.h"
+#include "traceformat.h"
+
+static const char *alarmStateStrings[8] = {
+    "disarmed", "armed_home", "armed_away", "pending", "pending", "triggered", "armed", "unknown"
+};
+
+static const char *typeNames[TRACE_TYPE_COUNT] = { "rx", "tx", "pin", "mqtt in", "mqtt out" };
+
+struct TraceEvent {
+    TRACE_TYPE type;
+    uint64_t micros;  // unwrapped
+    std::string data;
+};
+
+// Serial port fed from the trace, keeping what the engine writes
+class ReplayStream : public Stream {
+ public:
+    void feed(const std::string &data) { rx.insert(rx.end(), data.begin(), data.end()); }
+    std::string takeWritten() {
+        std::string written = tx;
+        tx.clear();
+        return written;
+    }
+
+    using Print::write;
+    size_t write(uint8_t c) override {
+        tx += (char)c;
+        return 1;
+    }
+    int available() override { return rx.size(); }
+    int read() override {
+        if (rx.empty())
+            return -1;
+        uint8_t c = rx.front();
+        rx.pop_front();
+        return c;
+    }
+    int peek() override { return rx.empty() ? -1 : (uint8_t)rx.front(); }
+
+ private:
+    std::deque<char> rx;
+    std::string tx;
+};
+
+static ReplayStream stream;
+static TexecomClass texecom(stream);
+static uint64_t clockBase;  // virtual micros of the first event
+static uint64_t replayClock;
+static bool quiet = false;
+
+static std::string printable(const std::string &data) {
+    std::string out;
+    for (unsigned char c : data) {
+        if (c >= 0x20 && c < 0x7F && c != '\\') {
+            out += c;
+        } else {
+            char escaped[5];
+            snprintf(escaped, sizeof(escaped), "\\x%02X", c);
+            out += escaped;
+        }
+    }
+    return out;
+}
+
+static void printAt(uint64_t micros, const char *fmt, ...) {
+    if (quiet)
+        return;
+
+    // Negative while the engine starts up before the first event
+    int64_t offset = (int64_t)(micros - clockBase);
+    uint64_t magnitude = offset < 0 ? -offset : offset;
+    printf("%c%6llu.%06llu  ", offset < 0 ? '-' : ' ',
+           (unsigned long long)(magnitude / 1000000), (unsigned long long)(magnitude % 1000000));
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    putchar('\n');
+}
+
+static void onZone(uint16_t zone, uint16_t state) {
+    printAt(replayClock, "  -> zone %03u %s (0x%04X)", zone, state & SimpleHelper::ZONE_ACTIVE ? "active" : "idle", state);
+}
+
+static void onAlarm(TexecomClass::ALARM_STATE state, uint8_t flags) {
+    printAt(replayClock, "  -> alarm %s flags 0x%02X", alarmStateStrings[state], flags);
+}
+
+static void onArea(uint8_t area, TexecomClass::ALARM_STATE state) {
+    printAt(replayClock, "  -> area %02u %s", area, alarmStateStrings[state]);
+}
+
+static bool onTriggered(uint16_t zone) {
+    printAt(replayClock, "  -> triggered by zone %u", zone);
+    return true;
+}
+
+static bool onEventLog(uint16_t index, const SimpleHelper::LOG_EVENT &event) {
+    printAt(replayClock, "  -> log %u type %u group %u parameter %u", index, event.type, event.group, event.parameter);
+    return true;
+}
+
+static bool digitsOnly(const char *s) {
+    while (*s) {
+        if (isdigit(*s++) == 0) return false;
+    }
+    return true;
+}
+
+// The firmware's home/security/alarm/set and area/<a>/set handling
+static void mqttCommand(const std::string &topic, std::string payload) {
+    unsigned int area;
+    char areaCommand[8];
+    bool isAreaSet = sscanf(topic.c_str(), "home/security/area/%u/%7s", &area, areaCommand) == 2 &&
+                        strcmp(areaCommand, "set") == 0;
+
+    if ((isAreaSet && area != TexecomClass::keypadArea) ||
+            (!isAreaSet && topic != "home/security/alarm/set"))
+        return;
+
+    char *action = strtok(&payload[0], ":");
+    char *code = strtok(NULL, ":");
+    if (action == NULL || code == NULL || strlen(code) < 4 || !digitsOnly(code))
+        return;
+
+    if (strcmp(code, "8463") == 0) {  // 8463 == TIME
+        texecom.requestTimeSync();
+    } else if (strcmp(code, "7962") == 0) {  // 7962 == SYNC
+        texecom.requestZoneSync();
+    } else if (strncmp(action, "arm", 3) == 0) {
+        if (!texecom.isReady())
+            return;
+        if (strcmp(action, "arm_away") == 0)
+            texecom.requestArm(code, TexecomClass::FULL_ARM);
+        else if (strcmp(action, "arm_night") == 0 || strcmp(action, "arm_home") == 0)
+            texecom.requestArm(code, TexecomClass::NIGHT_ARM);
+    } else if (strcmp(action, "disarm") == 0) {
+        texecom.requestDisarm(code);
+    }
+}
+
+static std::vector<uint8_t> decodeBase64(const std::string &text) {
+    std::vector<uint8_t> out;
+    uint32_t block = 0;
+    int bits = 0;
+    for (char c : text) {
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '+') v = 62;
+        else if (c == '/') v = 63;
+        else break;  // '=' padding or end of token
+
+        block = (block << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((block >> bits) & 0xFF);
+        }
+    }
+    return out;
+}
+
+// Each dump's records, joined from its TRC: lines. Only the last line of a
+// dump is short, so the dump ends there and later lines are skipped until
+// the next line 0, whose own line may have been lost. A short line that is
+// followed by the next one was cut on the way. The whole records ahead of
+// the cut are kept, and parseRecords stops at the partial one.
+static std::vector<std::vector<uint8_t>> readDumps(std::istream &in) {
+    std::vector<std::vector<uint8_t>> dumps;
+    unsigned int expected = 0;
+    bool finished = false;  // the dump's short last line has been read
+    bool skipping = false;
+    std::string line;
+
+    while (std::getline(in, line)) {
+        size_t marker = line.find(TRACE_MARKER);
+        if (marker == std::string::npos)
+            continue;
+
+        const char *text = line.c_str() + marker + strlen(TRACE_MARKER);
+        char *colon;
+        unsigned int sequence = strtoul(text, &colon, 10);
+        if (*colon != ':')
+            continue;
+
+        if (sequence == 0) {
+            dumps.emplace_back();
+            expected = 0;
+            finished = false;
+            skipping = false;
+        } else if (dumps.empty() || skipping) {
+            continue;
+        } else if (finished) {
+            if (sequence == expected)
+                fprintf(stderr, "Dump %zu: line %u is short, replaying the records before the cut\n",
+                        dumps.size() - 1, expected - 1);
+            else
+                fprintf(stderr, "Dump %zu: line %u follows the last line, skipping to the next line 0\n",
+                        dumps.size() - 1, sequence);
+            skipping = true;
+            continue;
+        }
+        if (sequence != expected)
+            fprintf(stderr, "Dump %zu: line %u missing, records after it may be garbled\n",
+                    dumps.size() - 1, expected);
+        expected = sequence + 1;
+
+        std::vector<uint8_t> bytes = decodeBase64(colon + 1);
+        if (bytes.size() < TRACE_DUMP_CHUNK)
+            finished = true;
+        dumps.back().insert(dumps.back().end(), bytes.begin(), bytes.end());
+    }
+    return dumps;
+}
+
+// micros() wraps every 71 minutes so each record is taken as the nearest
+// time to the one before, pin edges and frames from the serial reader
+// thread can be recorded a little late
+static std::vector<TraceEvent> parseRecords(const std::vector<uint8_t> &bytes) {
+    std::vector<TraceEvent> events;
+    uint64_t time = 0;
+    uint32_t last = 0;
+
+    for (size_t i = 0; i + TRACE_HEADER_SIZE <= bytes.size();) {
+        uint32_t stamp = bytes[i + 1] | bytes[i + 2] << 8 | bytes[i + 3] << 16 | (uint32_t)bytes[i + 4] << 24;
+        uint8_t length = bytes[i + 5];
+        if (bytes[i] >= TRACE_TYPE_COUNT || i + TRACE_HEADER_SIZE + length > bytes.size()) {
+            fprintf(stderr, "Bad record at byte %zu, stopping\n", i);
+            break;
+        }
+
+        time = events.empty() ? (uint64_t)stamp + 1000000 : time + (int32_t)(stamp - last);
+        last = stamp;
+
+        TraceEvent event;
+        event.type = (TRACE_TYPE)bytes[i];
+        event.micros = time;
+        event.data.assign((const char *)&bytes[i + TRACE_HEADER_SIZE], length);
+        events.push_back(event);
+        i += TRACE_HEADER_SIZE + length;
+    }
+
+    std::stable_sort(events.begin(), events.end(),
+                     [](const TraceEvent &a, const TraceEvent &b) { return a.micros < b.micros; });
+    return events;
+}
+
+// Engine output since the last look
+static void reportWritten(std::string &replayed) {
+    std::string written = stream.takeWritten();
+    if (written.empty())
+        return;
+    printAt(replayClock, "  -> tx %s", printable(written).c_str());
+    replayed += written;
+}
+
+static void runEngine(std::string &replayed) {
+    Alarm.loop();
+    do {
+        texecom.loop();
+    } while (stream.available() > 0);
+    reportWritten(replayed);
+}
+
+struct TypeStats {
+    uint32_t count;
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+};
+
+static void usage() {
+    fprintf(stderr,
+            "usage: replay [--eeprom file] [--epoch seconds] [--step ms] [--dump n]\n"
+            "              [--quiet] [--verbose] [trace] < papertrail.log\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *eepromPath = NULL;
+    const char *tracePath = NULL;
+    time_t epoch = 1600000000;
+    uint32_t step = 10;
+    int dumpIndex = -1;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--quiet") == 0) {
+            quiet = true;
+            continue;
+        } else if (strcmp(arg, "--verbose") == 0) {
+            verbose = true;
+            continue;
+        } else if (arg[0] != '-') {
+            tracePath = arg;
+            continue;
+        } else if (value == NULL) {
+            usage();
+            return 1;
+        }
+
+        i++;
+        if (strcmp(arg, "--eeprom") == 0) {
+            eepromPath = value;
+        } else if (strcmp(arg, "--epoch") == 0) {
+            epoch = strtoll(value, NULL, 10);
+        } else if (strcmp(arg, "--step") == 0) {
+            step = atoi(value);
+        } else if (strcmp(arg, "--dump") == 0) {
+            dumpIndex = atoi(value);
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (step == 0) {
+        usage();
+        return 1;
+    }
+
+    std::vector<uint8_t> trace;
+    if (tracePath) {
+        std::ifstream file(tracePath, std::ios::binary);
+        if (!file) {
+            perror(tracePath);
+            return 1;
+        }
+        trace.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    } else {
+        std::vector<std::vector<uint8_t>> dumps = readDumps(std::cin);
+        if (dumps.empty() || dumpIndex >= (int)dumps.size()) {
+            fprintf(stderr, "No trace dump %s found\n", dumpIndex >= 0 ? std::to_string(dumpIndex).c_str() : "");
+            return 1;
+        }
+        trace = dumps[dumpIndex >= 0 ? dumpIndex : dumps.size() - 1];
+    }
+
+    std::vector<TraceEvent> events = parseRecords(trace);
+    if (events.empty()) {
+        fprintf(stderr, "Trace holds no records\n");
+        return 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    Log.setLevel(verbose ? LOG_LEVEL_ALL : LOG_LEVEL_ERROR);
+    if (eepromPath && !EEPROM.open(eepromPath)) {
+        perror(eepromPath);
+        return 1;
+    }
+
+    // The engine starts a little before the trace so its setup is done
+    clockBase = events.front().micros;
+    replayClock = clockBase - 1000000;
+    hostUseVirtualClock(epoch);
+    hostSetClock(replayClock);
+
+    texecom.setZoneCallback(onZone);
+    texecom.setAlarmCallback(onAlarm);
+    texecom.setAreaCallback(onArea);
+    texecom.setTriggeredCallback(onTriggered);
+    texecom.setEventLogCallback(onEventLog);
+    texecom.setup();
+
+    TypeStats stats[TRACE_TYPE_COUNT] = {};
+    std::string recorded;  // serial the device wrote
+    std::string replayed;  // serial the engine wrote
+    auto wallStart = std::chrono::steady_clock::now();
+
+    for (const TraceEvent &event : events) {
+        // Timers due before the event fire on time
+        while (replayClock + step * 1000 < event.micros) {
+            replayClock += step * 1000;
+            hostSetClock(replayClock);
+            runEngine(replayed);
+        }
+        replayClock = std::max(replayClock, event.micros);
+        hostSetClock(replayClock);
+
+        switch (event.type) {
+        case TRACE_SERIAL_RX:
+            printAt(event.micros, "rx %s", printable(event.data).c_str());
+            stream.feed(event.data);
+            break;
+        case TRACE_SERIAL_TX:
+            // What the device wrote, to compare with the engine's -> tx
+            printAt(event.micros, "tx %s (recorded)", printable(event.data).c_str());
+            recorded += event.data;
+            break;
+        case TRACE_PIN:
+            printAt(event.micros, "pin D%u %s", (uint8_t)event.data[0], event.data[1] ? "high" : "low");
+            hostSetPin((uint8_t)event.data[0], event.data[1] ? HIGH : LOW);
+            break;
+        case TRACE_MQTT_IN:
+        case TRACE_MQTT_OUT: {
+            uint8_t topicLength = event.data[0];
+            std::string topic = event.data.substr(1, topicLength);
+            std::string payload = event.data.substr(1 + topicLength);
+            printAt(event.micros, "%s %s %s%s", typeNames[event.type], topic.c_str(), printable(payload).c_str(),
+                    event.type == TRACE_MQTT_OUT ? " (recorded)" : "");
+            if (event.type == TRACE_MQTT_IN)
+                mqttCommand(topic, payload);
+            break;
+        }
+        default:
+            break;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        runEngine(replayed);
+        uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+
+        TypeStats &s = stats[event.type];
+        s.count++;
+        s.totalNanos += nanos;
+        s.maxNanos = std::max(s.maxNanos, nanos);
+    }
+
+    double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    double traceSeconds = (events.back().micros - clockBase) / 1e6;
+
+    printf("\n%zu events over %.3f s replayed in %.3f s (%.0fx)\n",
+           events.size(), traceSeconds, wallSeconds, wallSeconds > 0 ? traceSeconds / wallSeconds : 0);
+    printf("%-9s %8s %10s %10s\n", "event", "count", "avg us", "max us");
+    for (uint8_t i = 0; i < TRACE_TYPE_COUNT; i++) {
+        if (stats[i].count == 0)
+            continue;
+        printf("%-9s %8u %10.1f %10.1f\n", typeNames[i], stats[i].count,
+               stats[i].totalNanos / 1000.0 / stats[i].count, stats[i].maxNanos / 1000.0);
+    }
+
+    // Differences in the serial writes are where the replay left the device
+    size_t matched = 0;
+    while (matched < recorded.size() && matched < replayed.size() && recorded[matched] == replayed[matched])
+        matched++;
+    if (matched == recorded.size() && matched == replayed.size()) {
+        printf("serial writes match, %zu bytes\n", matched);
+        return 0;
+    }
+
+    printf("serial writes differ after %zu of %zu recorded bytes\n", matched, recorded.size());
+    printf("  recorded %s\n", printable(recorded.substr(matched, 32)).c_str());
+    printf("  replayed %s\n", printable(replayed.substr(matched, 32)).c_str());
+    return 2;
+}
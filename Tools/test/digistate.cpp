@@ -0,0 +1,179 @@
+// Copyright 2020 Kevin Cooper
+//
+// Checks the digi output state table against the pin by pin ladder
+// checkDigiOutputs used before it, then drives the engine's pins through
+// every change from one mask to another and checks the state and flags it
+// reports. Exits non-zero on the first few mismatches.
+//
+// Build:  make -C .. test, or in one line:
+//         g++ -std=gnu++17 -O2 -I../gateway/host -I../../TexecomApplication/src
+//             -o digistate digistate.cpp ../gateway/host/particle.cpp
+//             ../../TexecomApplication/src/{texecom,simplehelper,crestronhelper,zonetable,areatable,statereconciler,TimeAlarms,binarylog}.cpp
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "texecom.h"
+#include "TimeAlarms.h"
+#include "digistate.h"
+
+typedef TexecomClass::ALARM_STATE ALARM_STATE;
+
+// Wiring from the pin table in texecom.h, in DIGI_OUTPUT order
+static const int pins[TexecomClass::DIGI_COUNT] = { D12, D16, D13, D17, D14, D18, D15, D19 };
+
+// Serial port with nothing to read that drops what the engine writes
+class NullStream : public Stream {
+ public:
+    using Print::write;
+    size_t write(uint8_t) override { return 1; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+};
+
+static NullStream stream;
+static TexecomClass texecom(stream);
+static uint64_t testClock = 1000000;
+static uint8_t reportedFlags;
+static int failures = 0;
+
+static bool isActive(uint8_t mask, TexecomClass::DIGI_OUTPUT output) {
+    return mask & (1 << output);
+}
+
+// The ladder as it was: each state output turning on sets its state, in
+// this order so the later ones win
+static ALARM_STATE ladderState(ALARM_STATE state, uint8_t before, uint8_t after) {
+    static const struct {
+        TexecomClass::DIGI_OUTPUT output;
+        ALARM_STATE state;
+    } ladder[] = {
+        { TexecomClass::DIGI_FULL_ARMED, TexecomClass::ARMED_AWAY },
+        { TexecomClass::DIGI_PART_ARMED, TexecomClass::ARMED_HOME },
+        { TexecomClass::DIGI_ENTRY, TexecomClass::ENTRY },
+        { TexecomClass::DIGI_EXIT, TexecomClass::EXIT },
+        { TexecomClass::DIGI_TRIGGERED, TexecomClass::TRIGGERED },
+    };
+
+    for (const auto &step : ladder) {
+        if (isActive(after, step.output) && !isActive(before, step.output))
+            state = step.state;
+    }
+    return state;
+}
+
+static uint8_t ladderFlags(uint8_t mask) {
+    uint8_t flags = 0;
+    if (isActive(mask, TexecomClass::DIGI_AREA_READY))
+        flags |= TexecomClass::ALARM_READY;
+    if (isActive(mask, TexecomClass::DIGI_FAULT_PRESENT))
+        flags |= TexecomClass::ALARM_FAULT;
+    if (isActive(mask, TexecomClass::DIGI_ARM_FAILED))
+        flags |= TexecomClass::ALARM_ARM_FAILED;
+    return flags;
+}
+
+static bool anyStateOutput(uint8_t mask) {
+    return isActive(mask, TexecomClass::DIGI_FULL_ARMED) || isActive(mask, TexecomClass::DIGI_PART_ARMED) ||
+           isActive(mask, TexecomClass::DIGI_EXIT) || isActive(mask, TexecomClass::DIGI_ENTRY) ||
+           isActive(mask, TexecomClass::DIGI_TRIGGERED);
+}
+
+static void fail(const char *fmt, ...) {
+    if (++failures > 10)
+        return;
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+static void checkTable() {
+    static const uint8_t bits[TexecomClass::DIGI_COUNT] = {
+        DIGI_BIT_FULL_ARMED, DIGI_BIT_PART_ARMED, DIGI_BIT_EXIT, DIGI_BIT_ENTRY,
+        DIGI_BIT_TRIGGERED, DIGI_BIT_ARM_FAILED, DIGI_BIT_FAULT_PRESENT, DIGI_BIT_AREA_READY
+    };
+    for (uint8_t i = 0; i < TexecomClass::DIGI_COUNT; i++) {
+        if (bits[i] != 1 << i)
+            fail("DIGI_BIT for output %u is 0x%02X", i, bits[i]);
+    }
+
+    for (int mask = 0; mask < 256; mask++) {
+        ALARM_STATE state = ladderState(TexecomClass::DISARMED, 0, mask);
+        if (digiStateTable[mask].state != state)
+            fail("Table mask 0x%02X: state %u, ladder %u", mask, digiStateTable[mask].state, state);
+        if (digiStateTable[mask].flags != ladderFlags(mask))
+            fail("Table mask 0x%02X: flags 0x%02X, ladder 0x%02X", mask, digiStateTable[mask].flags,
+                 ladderFlags(mask));
+    }
+}
+
+static void runFor(uint32_t ms) {
+    testClock += ms * 1000;
+    hostSetClock(testClock);
+    texecom.loop();
+}
+
+static void onAlarm(ALARM_STATE, uint8_t flags) {
+    reportedFlags = flags & ~TexecomClass::ALARM_SOURCE_MISMATCH;
+}
+
+// Sets the outputs in mask active, long enough apart for the debounce to
+// take every edge, and checks the engine against the ladder
+static void apply(uint8_t from, uint8_t to, ALARM_STATE *expected) {
+    for (uint8_t i = 0; i < TexecomClass::DIGI_COUNT; i++)
+        hostSetPin(pins[i], (to & (1 << i)) ? LOW : HIGH);
+    runFor(0);
+    runFor(10);
+
+    *expected = ladderState(*expected, from, to);
+    if (!anyStateOutput(to) && *expected != TexecomClass::DISARMED) {
+        // Exit is held for a second in case the panel is arming
+        if (*expected == TexecomClass::EXIT) {
+            if (texecom.getState() != TexecomClass::EXIT)
+                fail("0x%02X -> 0x%02X: state %u before the exit timeout", from, to, texecom.getState());
+            runFor(1100);
+        }
+        *expected = TexecomClass::DISARMED;
+    }
+
+    if (texecom.getState() != *expected)
+        fail("0x%02X -> 0x%02X: state %u, ladder %u", from, to, texecom.getState(), *expected);
+    if (reportedFlags != ladderFlags(to))
+        fail("0x%02X -> 0x%02X: flags 0x%02X, ladder 0x%02X", from, to, reportedFlags, ladderFlags(to));
+}
+
+static void checkEngine() {
+    ALARM_STATE expected = TexecomClass::DISARMED;
+    uint8_t mask = 0;
+
+    for (int from = 0; from < 256; from++) {
+        for (int to = 0; to < 256; to++) {
+            apply(mask, from, &expected);
+            apply(from, to, &expected);
+            mask = to;
+        }
+    }
+}
+
+int main() {
+    Log.setLevel(LOG_LEVEL_NONE);
+    hostUseVirtualClock(1600000000);
+    hostSetClock(testClock);
+
+    texecom.setAlarmCallback(onAlarm);
+    texecom.setup();
+
+    checkTable();
+    checkEngine();
+
+    if (failures) {
+        fprintf(stderr, "%d digi state mismatches\n", failures);
+        return 1;
+    }
+    printf("Digi state table and engine match the ladder\n");
+    return 0;
+}